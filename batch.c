@@ -0,0 +1,278 @@
+/*
+	Batch conversion for the ptabtools converters
+	(c) 2007: Jelmer Vernooij <jelmer@samba.org>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+#endif
+
+#ifdef HAVE_SYS_WAIT_H
+#  include <sys/wait.h>
+#endif
+
+#include "batch.h"
+
+#define malloc_p(t,n) (t *) calloc(sizeof(t), n)
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+#  define BATCH_FORK
+#endif
+
+static double batch_time(void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return time(NULL);
+#endif
+}
+
+static int batch_nr_cpus(void)
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) return n;
+#endif
+	return 1;
+}
+
+static const char *batch_basename(const char *path)
+{
+	const char *base = strrchr(path, '/');
+#ifdef _WIN32
+	if (strrchr(path, '\\') > base) base = strrchr(path, '\\');
+#endif
+	return base?base+1:path;
+}
+
+/* Expand an output template (see batch.h) for input */
+static char *batch_output(const struct batch *b, const char *tmpl, const char *input)
+{
+	const char *base = batch_basename(input), *ext, *p;
+	size_t dirlen, namelen, len = 0;
+	char *ret, *q;
+	int pass;
+
+	dirlen = base - input;
+	if (dirlen > 1) dirlen--;
+
+	ext = strrchr(base, '.');
+	if (ext && !strcmp(ext, b->suffix)) {
+		namelen = ext - base;
+	} else {
+		namelen = strlen(base);
+	}
+
+	/* First pass computes the length, second one fills in */
+	for (pass = 0; pass < 2; pass++) {
+		ret = q = pass?malloc(len + 1):NULL;
+		for (p = tmpl; *p; p++) {
+			const char *s = p;
+			size_t n = 1;
+
+			if (*p == '%') {
+				switch (*++p) {
+				case 'd':
+					if (dirlen) { s = input; n = dirlen; }
+					else { s = "."; n = 1; }
+					break;
+				case 'n': s = base; n = namelen; break;
+				case 'f': s = base; n = strlen(base); break;
+				case 'e': s = b->extension; n = strlen(b->extension); break;
+				case '%': break;
+				default: p--; break;
+				}
+			}
+
+			if (pass) { memcpy(q, s, n); q += n; }
+			else len += n;
+		}
+	}
+
+	*q = '\0';
+	return ret;
+}
+
+/* Output file for input, NULL if it is not clear where the output
+ * should go */
+static char *batch_output_name(const struct batch *b, const char *input, int nr_inputs)
+{
+	struct stat st;
+	char *tmpl, *ret;
+
+	if (!b->output) {
+		if (!strcmp(input, "-")) return strdup("-");
+
+		/* Next to the input file */
+		return batch_output(b, batch_basename(input) != input?"%d/%n%e":"%n%e", input);
+	}
+
+	if (strchr(b->output, '%'))
+		return batch_output(b, b->output, input);
+
+	if (stat(b->output, &st) == 0 && S_ISDIR(st.st_mode)) {
+		tmpl = malloc(strlen(b->output) + 6);
+		sprintf(tmpl, "%s/%%n%%e", b->output);
+		ret = batch_output(b, tmpl, input);
+		free(tmpl);
+		return ret;
+	}
+
+	/* All output goes to a single file */
+	if (nr_inputs == 1 || (!strcmp(b->output, "-") && b->jobs == 1))
+		return strdup(b->output);
+
+	return NULL;
+}
+
+int batch_convert(const struct batch *b, const char **inputs)
+{
+	int i, nr_inputs, nr_failed = 0, jobs = b->jobs;
+	char **outputs;
+	int *status;
+	double start, size = 0;
+	struct stat st;
+#ifdef BATCH_FORK
+	struct batch_job { pid_t pid; int input; } *slots;
+	int next = 0, running = 0;
+#endif
+
+	for (nr_inputs = 0; inputs[nr_inputs]; nr_inputs++);
+
+	outputs = malloc_p(char *, nr_inputs);
+	status = malloc_p(int, nr_inputs);
+
+	for (i = 0; i < nr_inputs; i++) {
+		outputs[i] = batch_output_name(b, inputs[i], nr_inputs);
+		if (!outputs[i]) {
+			fprintf(stderr, "%s is not a directory or a template (%%n, %%d, %%f or %%e), "
+					"so can not be used for several files\n", b->output);
+			for (i--; i >= 0; i--) free(outputs[i]);
+			free(outputs); free(status);
+			return -1;
+		}
+	}
+
+	if (jobs <= 0) jobs = batch_nr_cpus();
+	if (jobs > nr_inputs) jobs = nr_inputs;
+
+	/* Nothing to isolate or parallelize */
+	if (nr_inputs == 1 && b->jobs == 1) {
+		i = b->convert(inputs[0], outputs[0], b->data);
+		free(outputs[0]); free(outputs); free(status);
+		return i;
+	}
+
+	start = batch_time();
+
+#ifdef BATCH_FORK
+	/* One child process per file, at most jobs at a time */
+	slots = malloc_p(struct batch_job, jobs);
+
+	while (next < nr_inputs || running > 0) {
+		int wstatus;
+		pid_t pid;
+
+		if (next < nr_inputs && running < jobs) {
+			if (stat(inputs[next], &st) == 0) size += st.st_size;
+
+			fflush(stdout); fflush(stderr);
+			pid = fork();
+			if (pid == 0) {
+				exit(b->convert(inputs[next], outputs[next], b->data) == 0?0:1);
+			} else if (pid < 0) {
+				perror("fork");
+				status[next] = -1;
+			} else {
+				for (i = 0; slots[i].pid; i++);
+				slots[i].pid = pid;
+				slots[i].input = next;
+				running++;
+			}
+			next++;
+			continue;
+		}
+
+		pid = wait(&wstatus);
+		if (pid < 0) {
+			perror("wait");
+			break;
+		}
+
+		for (i = 0; i < jobs; i++) {
+			if (slots[i].pid == pid) {
+				status[slots[i].input] = wstatus;
+				slots[i].pid = 0;
+				running--;
+				break;
+			}
+		}
+	}
+
+	free(slots);
+#else
+	for (i = 0; i < nr_inputs; i++) {
+		if (stat(inputs[i], &st) == 0) size += st.st_size;
+		status[i] = b->convert(inputs[i], outputs[i], b->data);
+	}
+#endif
+
+	for (i = 0; i < nr_inputs; i++) {
+		if (status[i] == 0) continue;
+
+		nr_failed++;
+#ifdef BATCH_FORK
+		if (status[i] > 0 && WIFSIGNALED(status[i])) {
+			fprintf(stderr, "Failed to convert %s: killed by signal %d\n", inputs[i], WTERMSIG(status[i]));
+			continue;
+		}
+#endif
+		fprintf(stderr, "Failed to convert %s\n", inputs[i]);
+	}
+
+	if (!b->quiet) {
+		double elapsed = batch_time() - start;
+		if (elapsed <= 0) elapsed = 0.001;
+		fprintf(stderr, "Converted %d of %d files (%.1f MB) in %.2fs using %d jobs: %.1f files/s, %.1f MB/s\n",
+				nr_inputs - nr_failed, nr_inputs, size / 1048576, elapsed, jobs,
+				(nr_inputs - nr_failed) / elapsed, size / 1048576 / elapsed);
+	}
+
+	for (i = 0; i < nr_inputs; i++) free(outputs[i]);
+	free(outputs);
+	free(status);
+
+	return nr_failed?-1:0;
+}
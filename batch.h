@@ -0,0 +1,47 @@
+/*
+	Batch conversion for the ptabtools converters
+	(c) 2007: Jelmer Vernooij <jelmer@samba.org>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+/* Converts a single file, returns 0 on success */
+typedef int (*batch_convert_fn) (const char *input, const char *output, void *data);
+
+struct batch {
+	/* Output file (-o). With several input files this is a template,
+	 * in which %d is replaced by the directory of the input file, %n by
+	 * its name without extension, %f by its full name and %e by the
+	 * output extension. A directory is short for "dir/%n%e". */
+	const char *output;
+	const char *suffix; /* Extension stripped from input file names (".ptb") */
+	const char *extension; /* Extension of output files (".ly") */
+	int jobs; /* Number of files converted at the same time, 0 for one per CPU */
+	int quiet;
+	batch_convert_fn convert;
+	void *data;
+};
+
+/* Convert the NULL-terminated list of inputs. A single file is
+ * converted in this process; otherwise every file is converted in
+ * its own child process, so a file that fails (or crashes the
+ * converter) does not affect the others, and a summary is printed.
+ * Returns 0 if all files were converted. */
+extern int batch_convert(const struct batch *, const char **inputs);
+
+#endif /* __BATCH_H__ */
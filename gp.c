@@ -25,7 +25,6 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <string.h>
-#include <assert.h>
 
 #ifdef HAVE_CONFIG_H
 #  include "config.h"
@@ -49,20 +48,62 @@
 
 #define PTB_CORE
 #include "gp.h"
+#include "ptb-arena.h"
 
-#define malloc_p(t, n) (t *) calloc(sizeof(t), n)
+/* Everything in a file comes from its arena */
+#define gp_alloc_p(gpf, t, n) (t *) gp_alloc(gpf, sizeof(t) * (n))
+
+/* Only the first problem is recorded. Everything after it is skipped, 
+ * so reads return zeroes and lists come out empty. */
+static void gp_error(struct gpf *gpf, int code, size_t offset)
+{
+	if (gpf->error == GP_ERROR_NONE) {
+		gpf->error = code;
+		gpf->error_offset = offset;
+	}
+	gpf->curpos = gpf->length;
+}
+
+static void *gp_alloc(struct gpf *gpf, size_t size)
+{
+	void *ret;
+
+	if (size == 0) 
+		return NULL;
+
+	ret = ptb_arena_alloc(gpf->arena, size);
+	if (ret == NULL) 
+		gp_error(gpf, GP_ERROR_NOMEM, gpf->curpos);
+	return ret;
+}
+
+/* When streaming, items are only kept until they have been handled */
+static void gp_handled(struct gpf *gpf)
+{
+	if (gpf->events) 
+		ptb_arena_reset(gpf->arena);
+}
 
 static void gp_read(struct gpf *gpf, void *data, size_t len)
 {
-	int ret = read(gpf->fd, data, len);
-	assert(ret == len);
+	if (len > gpf->length - gpf->curpos) {
+		gp_error(gpf, GP_ERROR_TRUNCATED, gpf->curpos);
+		memset(data, 0, len);
+		return;
+	}
+
+	memcpy(data, gpf->data + gpf->curpos, len);
+	gpf->curpos += len;
 }
 
 static void gp_read_unknown(struct gpf *gpf, size_t num)
 {
-	char *tmp = malloc_p(char, num);
-	gp_read(gpf, tmp, num);
-	free(tmp);
+	if (num > gpf->length - gpf->curpos) {
+		gp_error(gpf, GP_ERROR_TRUNCATED, gpf->curpos);
+		return;
+	}
+
+	gpf->curpos += num;
 }
 
 static void gp_read_string(struct gpf *gpf, const char **dest)
@@ -70,8 +111,13 @@ static void gp_read_string(struct gpf *gpf, const char **dest)
 	unsigned char len = 0;
 	char *ret;
 	gp_read(gpf, &len, 1);
-	ret = malloc_p(char, len+1);
+	ret = gp_alloc_p(gpf, char, len+1);
+	if (ret == NULL) {
+		*dest = NULL;
+		return;
+	}
 	gp_read(gpf, ret, len);
+	ret[len] = '\0';
 	*dest = ret;
 }
 
@@ -85,13 +131,33 @@ static void gp_read_uint32(struct gpf *gpf, uint32_t *n)
 	gp_read(gpf, n, sizeof(uint32_t));
 }
 
+/* Read the number of items in a list, each of which takes at least 
+ * size bytes. Counts that can not fit in the rest of the data are 
+ * rejected before anything is allocated for them. */
+static void gp_read_count(struct gpf *gpf, uint32_t *n, size_t size)
+{
+	size_t offset = gpf->curpos;
+
+	gp_read_uint32(gpf, n);
+
+	if (*n > (gpf->length - gpf->curpos) / size) {
+		gp_error(gpf, GP_ERROR_BAD_LENGTH, offset);
+		*n = 0;
+	}
+}
+
 static void gp_read_long_string(struct gpf *gpf, const char **dest)
 {
 	uint32_t l;
 	char *ret;
-	gp_read_uint32(gpf, &l);
-	ret = malloc_p(char, l + 1);
+	gp_read_count(gpf, &l, 1);
+	ret = gp_alloc_p(gpf, char, l + 1);
+	if (ret == NULL) {
+		*dest = NULL;
+		return;
+	}
 	gp_read(gpf, ret, l);
+	ret[l] = '\0';
 	*dest = ret;
 }
 
@@ -106,9 +172,16 @@ static void gp_read_color(struct gpf *gpf, struct gp_color *color)
 static void gp_read_nstring(struct gpf *gpf, const char **dest, size_t len)
 {
 	uint8_t _len;
-	char *ret = malloc_p(char, len + 1);
+	char *ret = gp_alloc_p(gpf, char, len + 1);
+	if (ret == NULL) {
+		*dest = NULL;
+		return;
+	}
 	gp_read_uint8(gpf, &_len);
-	assert(_len <= len);
+	if (_len > len) {
+		gp_error(gpf, GP_ERROR_BAD_LENGTH, gpf->curpos - 1);
+		_len = 0;
+	}
 	gp_read(gpf, ret, len);
 	ret[_len] = '\0';
 	*dest = ret;
@@ -127,8 +200,9 @@ static void gp_read_header(struct gpf *gpf)
 		gp_read_long_string(gpf, &gpf->tab_by);
 		gp_read_long_string(gpf, &gpf->instruction);
 
-		gp_read_uint32(gpf, &gpf->notice_num_lines);
-		gpf->notice = malloc_p(const char *, gpf->notice_num_lines);
+		gp_read_count(gpf, &gpf->notice_num_lines, 4);
+		gpf->notice = gp_alloc_p(gpf, const char *, gpf->notice_num_lines);
+		if (gpf->notice == NULL) gpf->notice_num_lines = 0;
 		for (i = 0; i < gpf->notice_num_lines; i++) 
 		{
 			gp_read_long_string(gpf, &gpf->notice[i]);
@@ -155,7 +229,8 @@ static void gp_read_lyrics(struct gpf *gpf)
 
 		gpf->num_lyrics = 5;
 
-		gpf->lyrics = malloc_p(struct gp_lyric, gpf->num_lyrics);
+		gpf->lyrics = gp_alloc_p(gpf, struct gp_lyric, gpf->num_lyrics);
+		if (gpf->lyrics == NULL) gpf->num_lyrics = 0;
 		
 		for (i = 0; i < gpf->num_lyrics; i++) {
 			gp_read_uint32(gpf, &gpf->lyrics[i].bar);
@@ -169,7 +244,8 @@ static void gp_read_instruments(struct gpf *gpf)
 	if (gpf->version >= 3.0) {
 		uint32_t i;
 		gpf->num_instruments = 64; 
-		gpf->instrument = malloc_p(struct gp_instrument, gpf->num_instruments);
+		gpf->instrument = gp_alloc_p(gpf, struct gp_instrument, gpf->num_instruments);
+		if (gpf->instrument == NULL) gpf->num_instruments = 0;
 		for (i = 0; i < gpf->num_instruments; i++) 
 		{
 			gp_read_unknown(gpf, 12);
@@ -179,22 +255,34 @@ static void gp_read_instruments(struct gpf *gpf)
 		for (i = 0; i < 8; i++) 
 		{
 			uint32_t x;
-			gp_read_uint32(gpf, &x);
-			gp_read_unknown(gpf, x * 4);
+			gp_read_count(gpf, &x, 4);
+			gp_read_unknown(gpf, (size_t)x * 4);
 		}
 	}
 }
 
 static void gp_read_bars(struct gpf *gpf)
 {
+	struct gp_bar scratch;
 	uint32_t i;
-	gpf->bars = malloc_p(struct gp_bar, gpf->num_bars);
+
+	if (gpf->events == NULL) {
+		gpf->bars = gp_alloc_p(gpf, struct gp_bar, gpf->num_bars);
+		if (gpf->bars == NULL) gpf->num_bars = 0;
+	}
 
 	for (i = 0; i < gpf->num_bars; i++) 
 	{
-		gp_read_uint8(gpf, &gpf->bars[i].properties);
+		struct gp_bar *bar = &scratch;
+
+		if (gpf->bars) 
+			bar = &gpf->bars[i];
+		else 
+			memset(bar, 0, sizeof(*bar));
 
-		assert((	gpf->bars[i].properties 
+		gp_read_uint8(gpf, &bar->properties);
+
+		if ((	bar->properties 
 					&~ GP_BAR_PROPERTY_CUSTOM_RHYTHM_1 
 					&~ GP_BAR_PROPERTY_CUSTOM_RHYTHM_2
 					&~ GP_BAR_PROPERTY_REPEAT_OPEN
@@ -202,78 +290,129 @@ static void gp_read_bars(struct gpf *gpf)
 					&~ GP_BAR_PROPERTY_ALT_ENDING
 					&~ GP_BAR_PROPERTY_MARKER
 					&~ GP_BAR_PROPERTY_CHANGE_ARMOR
-					&~ GP_BAR_PROPERTY_DOUBLE_ENDING) == 0);
+					&~ GP_BAR_PROPERTY_DOUBLE_ENDING) != 0) {
+			gp_error(gpf, GP_ERROR_BAD_PROPERTY, gpf->curpos - 1);
+			return;
+		}
 
-		if (gpf->bars[i].properties & GP_BAR_PROPERTY_CUSTOM_RHYTHM_1) {
-			gp_read_uint8(gpf, &gpf->bars[i].rhythm_1);
+		if (bar->properties & GP_BAR_PROPERTY_CUSTOM_RHYTHM_1) {
+			gp_read_uint8(gpf, &bar->rhythm_1);
 		} else {
-			gpf->bars[i].rhythm_1 = 4;
+			bar->rhythm_1 = 4;
 		}
 
-		if (gpf->bars[i].properties & GP_BAR_PROPERTY_CUSTOM_RHYTHM_2) {
-			gp_read_uint8(gpf, &gpf->bars[i].rhythm_2);
+		if (bar->properties & GP_BAR_PROPERTY_CUSTOM_RHYTHM_2) {
+			gp_read_uint8(gpf, &bar->rhythm_2);
 		} else {
-			gpf->bars[i].rhythm_2 = 4;
+			bar->rhythm_2 = 4;
 		}
 
-		if (gpf->bars[i].properties & GP_BAR_PROPERTY_REPEAT_CLOSE) {
-			gp_read_uint8(gpf, &gpf->bars[i].repeat_close.volta);
+		if (bar->properties & GP_BAR_PROPERTY_REPEAT_CLOSE) {
+			gp_read_uint8(gpf, &bar->repeat_close.volta);
 		}
 
-		if (gpf->bars[i].properties & GP_BAR_PROPERTY_ALT_ENDING) { 
-			gp_read_uint8(gpf, &gpf->bars[i].alternate_ending.type);
+		if (bar->properties & GP_BAR_PROPERTY_ALT_ENDING) { 
+			gp_read_uint8(gpf, &bar->alternate_ending.type);
 		}
 
-		if (gpf->bars[i].properties & GP_BAR_PROPERTY_MARKER) {
-			gp_read_long_string(gpf, &gpf->bars[i].marker.name);
-			gp_read_color(gpf, &gpf->bars[i].marker.color);
+		if (bar->properties & GP_BAR_PROPERTY_MARKER) {
+			gp_read_long_string(gpf, &bar->marker.name);
+			gp_read_color(gpf, &bar->marker.color);
 		}
 
-		if (gpf->bars[i].properties & GP_BAR_PROPERTY_CHANGE_ARMOR) {
-			gp_read_uint8(gpf, &gpf->bars[i].change_armor.armor_jumps);
-			gp_read_uint8(gpf, &gpf->bars[i].change_armor.minor);
+		if (bar->properties & GP_BAR_PROPERTY_CHANGE_ARMOR) {
+			gp_read_uint8(gpf, &bar->change_armor.armor_jumps);
+			gp_read_uint8(gpf, &bar->change_armor.minor);
 		}
+
+		if (gpf->error) 
+			return;
+
+		if (gpf->events && gpf->events->on_bar) 
+			gpf->events->on_bar(gpf->events_data, i, bar);
+		gp_handled(gpf);
 	}
 }
 
+static void gp_track_done(struct gpf *gpf, uint32_t i, struct gp_track *track)
+{
+	if (gpf->events && gpf->events->on_track) 
+		gpf->events->on_track(gpf->events_data, i, track);
+	gp_handled(gpf);
+}
+
 static void gp_read_tracks(struct gpf *gpf)
 {
+	struct gp_track scratch;
+	struct gp_track *track = &scratch;
 	uint32_t i;
 
-	gpf->tracks = malloc_p(struct gp_track, gpf->num_tracks);
+	if (gpf->events == NULL) {
+		gpf->tracks = gp_alloc_p(gpf, struct gp_track, gpf->num_tracks);
+		if (gpf->tracks == NULL) {
+			gpf->num_tracks = 0;
+			return;
+		}
+	}
 
 	if (gpf->version >= 3.0) 
 	{
 		for (i = 0; i < gpf->num_tracks; i++) 
 		{
 			uint32_t j;
-			gp_read_uint8(gpf, &gpf->tracks[i].spc);
-			gp_read_nstring(gpf, &gpf->tracks[i].name, 40);
-			gp_read_uint32(gpf, &gpf->tracks[i].num_strings);
-			gpf->tracks[i].strings = malloc_p(struct gp_track_string, gpf->tracks[i].num_strings);
+
+			if (gpf->tracks) 
+				track = &gpf->tracks[i];
+			else 
+				memset(track, 0, sizeof(*track));
+
+			gp_read_uint8(gpf, &track->spc);
+			gp_read_nstring(gpf, &track->name, 40);
+			gp_read_uint32(gpf, &track->num_strings);
+			/* There is only room for the pitches of 7 strings */
+			if (track->num_strings > 7) {
+				gp_error(gpf, GP_ERROR_BAD_LENGTH, gpf->curpos - 4);
+				track->num_strings = 0;
+			}
+			track->strings = gp_alloc_p(gpf, struct gp_track_string, track->num_strings);
+			if (track->strings == NULL) track->num_strings = 0;
 			for (j = 0; j < 7; j++) {
 				uint32_t string_pitch;
 				gp_read_uint32(gpf, &string_pitch);
-				if (j < gpf->tracks[i].num_strings) {
-					gpf->tracks[i].strings[j].pitch = string_pitch;
+				if (j < track->num_strings) {
+					track->strings[j].pitch = string_pitch;
 				}
 			}
-			gp_read_uint32(gpf, &gpf->tracks[i].midi_port);
-			gp_read_uint32(gpf, &gpf->tracks[i].channel1);
-			gp_read_uint32(gpf, &gpf->tracks[i].channel2);
-			gp_read_uint32(gpf, &gpf->tracks[i].num_frets);
-			gp_read_uint32(gpf, &gpf->tracks[i].capo);
-			gp_read_color(gpf, &gpf->tracks[i].color);
+			gp_read_uint32(gpf, &track->midi_port);
+			gp_read_uint32(gpf, &track->channel1);
+			gp_read_uint32(gpf, &track->channel2);
+			gp_read_uint32(gpf, &track->num_frets);
+			gp_read_uint32(gpf, &track->capo);
+			gp_read_color(gpf, &track->color);
+
+			if (gpf->error) 
+				return;
+
+			gp_track_done(gpf, i, track);
 		} 
 	} else {
-		int i;
 		for (i = 0; i < 8; i++) 
 		{
+			if (gpf->tracks) 
+				track = &gpf->tracks[i];
+			else 
+				memset(track, 0, sizeof(*track));
+
 			gp_read_unknown(gpf, 4);
-			gp_read_uint32(gpf, &gpf->tracks[i].num_frets);
+			gp_read_uint32(gpf, &track->num_frets);
 			gp_read_unknown(gpf, 1);
-			gp_read_nstring(gpf, &gpf->tracks[i].name, 40);
+			gp_read_nstring(gpf, &track->name, 40);
 			gp_read_unknown(gpf, 1 + 5 * 4);
+
+			if (gpf->error) 
+				return;
+
+			gp_track_done(gpf, i, track);
 		}
 		gpf->num_tracks = 0;
 	}
@@ -281,16 +420,19 @@ static void gp_read_tracks(struct gpf *gpf)
 
 static void gp_read_beat(struct gpf *gpf, struct gp_beat *beat)
 {
-	int i;
+	int i, k;
 	gp_read_uint8(gpf, &beat->properties);
-	assert((beat->properties 
+	if ((beat->properties 
 			 &~ GP_BEAT_PROPERTY_DOTTED	
 			 &~ GP_BEAT_PROPERTY_CHORD
 			 &~ GP_BEAT_PROPERTY_TEXT
 			 &~ GP_BEAT_PROPERTY_EFFECT
 			 &~ GP_BEAT_PROPERTY_CHANGE
 			 &~ GP_BEAT_PROPERTY_TUPLET
-			 &~ GP_BEAT_PROPERTY_REST) == 0);
+			 &~ GP_BEAT_PROPERTY_REST) != 0) {
+		gp_error(gpf, GP_ERROR_BAD_PROPERTY, gpf->curpos - 1);
+		return;
+	}
 
 	if (beat->properties & GP_BEAT_PROPERTY_REST) {
 		gp_read_unknown(gpf, 1);
@@ -357,8 +499,8 @@ static void gp_read_beat(struct gpf *gpf, struct gp_beat *beat)
 
 		if (beat->effect.properties2 & GP_BEAT_EFFECT2_TREMOLO_BAR) {
 			gp_read_unknown(gpf, 5);
-			gp_read_uint32(gpf, &beat->effect.tremolo_bar.num_points);
-			gp_read_unknown(gpf, beat->effect.tremolo_bar.num_points * 9);
+			gp_read_count(gpf, &beat->effect.tremolo_bar.num_points, 9);
+			gp_read_unknown(gpf, (size_t)beat->effect.tremolo_bar.num_points * 9);
 		}
 
 		if (gpf->version >= 4.0) {
@@ -397,12 +539,21 @@ static void gp_read_beat(struct gpf *gpf, struct gp_beat *beat)
 
 	gp_read_uint8(gpf, &beat->strings_present);
 
-	for (i = 0; i < 7; i++)
+	for (i = 0; i < 7; i++) 
+		if (beat->strings_present & (1 << i)) beat->num_notes++;
+
+	beat->notes = gp_alloc_p(gpf, struct gp_note, beat->num_notes);
+	if (beat->notes == NULL) beat->num_notes = 0;
+
+	for (i = 0, k = 0; i < 7 && k < beat->num_notes; i++)
 	{
-		struct gp_note *n = &beat->notes[i];
+		struct gp_note *n;
 
 		if (!(beat->strings_present & (1 << i))) continue;
 
+		n = &beat->notes[k++];
+		n->string = i;
+
 		gp_read_uint8(gpf, &n->properties);
 
 		if (n->properties & GP_NOTE_PROPERTY_ALTERATION) {
@@ -432,72 +583,130 @@ static void gp_read_beat(struct gpf *gpf, struct gp_beat *beat)
 		}
 
 		if (n->properties & GP_NOTE_PROPERTY_EFFECT) {
-			gp_read_uint8(gpf, &n->effect.properties1);
+			n->effect = gp_alloc_p(gpf, struct gp_note_effect, 1);
+			if (n->effect == NULL) 
+				return;
+
+			gp_read_uint8(gpf, &n->effect->properties1);
 			
 			if (gpf->version >= 4.0) {
-				gp_read_uint8(gpf, &n->effect.properties2);
+				gp_read_uint8(gpf, &n->effect->properties2);
 			} else {
-				n->effect.properties2 = 0;
+				n->effect->properties2 = 0;
 			}
 
-			if (n->effect.properties1 & GP_NOTE_EFFECT1_BEND) {
-				unsigned int k;
+			if (n->effect->properties1 & GP_NOTE_EFFECT1_BEND) {
+				unsigned int j;
 				gp_read_unknown(gpf, 5);
-				gp_read_uint32(gpf, &n->effect.bend.num_points);
-				n->effect.bend.points = malloc_p(struct gp_note_effect_bend_point, n->effect.bend.num_points);
-				for (k = 0; k < n->effect.bend.num_points; k++)
+				gp_read_count(gpf, &n->effect->bend.num_points, 9);
+				n->effect->bend.points = gp_alloc_p(gpf, struct gp_note_effect_bend_point, n->effect->bend.num_points);
+				if (n->effect->bend.points == NULL) n->effect->bend.num_points = 0;
+				for (j = 0; j < n->effect->bend.num_points; j++)
 				{
 					gp_read_unknown(gpf, 4);
-					gp_read_uint32(gpf, &n->effect.bend.points[k].pitch);
+					gp_read_uint32(gpf, &n->effect->bend.points[j].pitch);
 					gp_read_unknown(gpf, 1);
 				}
 			}
 
-			if (n->effect.properties1 & GP_NOTE_EFFECT1_APPOGIATURE) 
+			if (n->effect->properties1 & GP_NOTE_EFFECT1_APPOGIATURE) 
 			{
-				gp_read_uint8(gpf, &n->effect.appogiature.previous_note);
+				gp_read_uint8(gpf, &n->effect->appogiature.previous_note);
 				gp_read_unknown(gpf, 1);
-				gp_read_uint8(gpf, &n->effect.appogiature.transition);
-				gp_read_uint8(gpf, &n->effect.appogiature.duration);
+				gp_read_uint8(gpf, &n->effect->appogiature.transition);
+				gp_read_uint8(gpf, &n->effect->appogiature.duration);
 			}
 
-			if (n->effect.properties2 & GP_NOTE_EFFECT2_TREMOLO_PICKING)
+			if (n->effect->properties2 & GP_NOTE_EFFECT2_TREMOLO_PICKING)
 			{
-				gp_read_uint8(gpf, &n->effect.tremolo_picking.duration);
+				gp_read_uint8(gpf, &n->effect->tremolo_picking.duration);
 			}
 
-			if (n->effect.properties2 & GP_NOTE_EFFECT2_SLIDE)
+			if (n->effect->properties2 & GP_NOTE_EFFECT2_SLIDE)
 			{
-				gp_read_uint8(gpf, &n->effect.slide.type);
+				gp_read_uint8(gpf, &n->effect->slide.type);
 			}
 
-			if (n->effect.properties2 & GP_NOTE_EFFECT2_HARMONIC)
+			if (n->effect->properties2 & GP_NOTE_EFFECT2_HARMONIC)
 			{
-				gp_read_uint8(gpf, &n->effect.harmonic.type);
+				gp_read_uint8(gpf, &n->effect->harmonic.type);
 			}
 
-			if (n->effect.properties2 & GP_NOTE_EFFECT2_TRILL)
+			if (n->effect->properties2 & GP_NOTE_EFFECT2_TRILL)
 			{
-				gp_read_uint8(gpf, &n->effect.trill.note_value);
-				gp_read_uint8(gpf, &n->effect.trill.frequency);
+				gp_read_uint8(gpf, &n->effect->trill.note_value);
+				gp_read_uint8(gpf, &n->effect->trill.frequency);
 			}
 		}
 	}
 }
 
+static void gp_beat_done(struct gpf *gpf, uint32_t bar, uint32_t track, struct gp_beat *beat)
+{
+	int i;
+
+	if (gpf->events == NULL) 
+		return;
+
+	if (gpf->events->on_beat) 
+		gpf->events->on_beat(gpf->events_data, bar, track, beat);
+
+	if (gpf->events->on_note) {
+		for (i = 0; i < beat->num_notes; i++) 
+			gpf->events->on_note(gpf->events_data, beat, &beat->notes[i]);
+	}
+
+	gp_handled(gpf);
+}
+
 static void gp_read_data(struct gpf *gpf)
 {
+	struct gp_bar_track scratch_track;
+	struct gp_beat scratch_beat;
 	uint32_t i, j, k;
 	for (i = 0; i < gpf->num_bars; i++) 
 	{
-		gpf->bars[i].tracks = malloc_p(struct gp_bar_track, gpf->num_tracks);
+		/* Each track starts with its number of beats */
+		if (gpf->num_tracks > (gpf->length - gpf->curpos) / 4) {
+			gp_error(gpf, GP_ERROR_TRUNCATED, gpf->curpos);
+			return;
+		}
+
+		if (gpf->events == NULL) {
+			gpf->bars[i].tracks = gp_alloc_p(gpf, struct gp_bar_track, gpf->num_tracks);
+			if (gpf->bars[i].tracks == NULL) 
+				return;
+		}
+
 		for (j = 0; j < gpf->num_tracks; j++) 
 		{
-			gp_read_uint32(gpf, &gpf->bars[i].tracks[j].num_beats);
-			gpf->bars[i].tracks[j].beats = malloc_p(struct gp_beat, gpf->bars[i].tracks[j].num_beats);
-			for (k = 0; k < gpf->bars[i].tracks[j].num_beats; k++) 
+			struct gp_bar_track *bar_track = &scratch_track;
+
+			if (gpf->events == NULL) 
+				bar_track = &gpf->bars[i].tracks[j];
+
+			/* Properties, duration and strings present */
+			gp_read_count(gpf, &bar_track->num_beats, 3);
+			if (gpf->events == NULL) {
+				bar_track->beats = gp_alloc_p(gpf, struct gp_beat, bar_track->num_beats);
+				if (bar_track->beats == NULL) bar_track->num_beats = 0;
+			}
+
+			for (k = 0; k < bar_track->num_beats; k++) 
 			{
-				gp_read_beat(gpf, &gpf->bars[i].tracks[j].beats[k]);
+				struct gp_beat *beat = &scratch_beat;
+
+				if (gpf->events == NULL) 
+					beat = &bar_track->beats[k];
+				else 
+					memset(beat, 0, sizeof(*beat));
+
+				gp_read_beat(gpf, beat);
+
+				if (gpf->error) 
+					return;
+
+				gp_beat_done(gpf, i, j, beat);
 			}
 		}
 	}
@@ -505,21 +714,19 @@ static void gp_read_data(struct gpf *gpf)
 
 static double find_version(const char *name)
 {
-	int i;
-	for(i = strlen(name)-1; isdigit(name[i]) || name[i] == '.'; i--);
+	size_t i;
+
+	if (name == NULL) 
+		return 0;
+
+	for(i = strlen(name); i > 0 && (isdigit(name[i-1]) || name[i-1] == '.'); i--);
 
-	return atof(name+i+1);
+	return atof(name+i);
 }
 
-struct gpf *gp_read_file(const char *filename)
+static void gp_read_all(struct gpf *gpf)
 {
-	
-	struct gpf *gpf = malloc_p(struct gpf, 1);
-	gpf->fd = open(filename, O_RDONLY);
-
-	if (gpf->fd < 0) {
-		return NULL;
-	}
+	gpf->curpos = 0;
 
 	gp_read_string(gpf, &gpf->version_string);
 	gpf->version = find_version(gpf->version_string);
@@ -542,15 +749,22 @@ struct gpf *gp_read_file(const char *filename)
 
 	gp_read_instruments(gpf);
 
-	gp_read_uint32(gpf, &gpf->num_bars);
+	gp_read_count(gpf, &gpf->num_bars, 1);
 
 	if (gpf->version >= 3.0) 
 	{
-		gp_read_uint32(gpf, &gpf->num_tracks);
+		gp_read_count(gpf, &gpf->num_tracks, 1);
 	} else {
 		gpf->num_tracks = 8;
 	}
 
+	if (gpf->error) 
+		return;
+
+	if (gpf->events && gpf->events->on_header) 
+		gpf->events->on_header(gpf->events_data, gpf);
+	gp_handled(gpf);
+
 	gp_read_bars(gpf);
 
 	gp_read_tracks(gpf);
@@ -558,12 +772,625 @@ struct gpf *gp_read_file(const char *filename)
 	gp_read_data(gpf);
 
 	gp_read_unknown(gpf, 2);
+}
+
+static struct gpf *gp_new(const struct ptb_allocator *allocator)
+{
+	const struct ptb_allocator *a = ptb_allocator(allocator);
+	struct gpf *gpf = mem_p(a, struct gpf, 1);
+
+	if (gpf == NULL) 
+		return NULL;
+
+	gpf->allocator = *a;
+	gpf->arena = ptb_arena_new(a);
+	if (gpf->arena == NULL) {
+		ptb_mem_free(a, gpf);
+		return NULL;
+	}
 
 	return gpf;
 }
 
+/* Load the complete contents of fd into memory, preferably by mapping it */
+static int gp_load_data(struct gpf *gpf, int fd)
+{
+	char *data;
+	int ret = ptb_mem_load(&gpf->allocator, fd, &data, &gpf->length, &gpf->data_source);
+
+	if (ret < 0) {
+		gp_error(gpf, ret == -2?GP_ERROR_NOMEM:GP_ERROR_IO, gpf->length);
+		gpf->length = 0;
+		gpf->curpos = 0;
+		return -1;
+	}
+
+	gpf->data = data;
+	return 0;
+}
+
+/* The input is only needed while parsing */
+static void gp_release_data(struct gpf *gpf)
+{
+	ptb_mem_unload(&gpf->allocator, (char *)gpf->data, gpf->length, gpf->data_source);
+
+	gpf->data = NULL;
+	gpf->length = 0;
+	gpf->curpos = 0;
+	gpf->data_source = PTB_DATA_NONE;
+}
+
+/* Hand the document to the caller, or describe why there is none */
+static struct gpf *gp_finish(struct gpf *gpf, struct gp_error *error)
+{
+	gp_release_data(gpf);
+
+	if (error != NULL) {
+		error->code = gpf->error;
+		error->offset = gpf->error_offset;
+	}
+
+	if (gpf->error != GP_ERROR_NONE) {
+		gp_free(gpf);
+		return NULL;
+	}
+
+	return gpf;
+}
+
+static struct gpf *gp_no_memory(struct gp_error *error)
+{
+	if (error != NULL) {
+		error->code = GP_ERROR_NOMEM;
+		error->offset = 0;
+	}
+	return NULL;
+}
+
+struct gpf *gp_read_mem_ex(const char *data, size_t length, const struct ptb_allocator *allocator, struct gp_error *error)
+{
+	struct gpf *gpf = gp_new(allocator);
+
+	if (gpf == NULL) 
+		return gp_no_memory(error);
+
+	/* The buffer is owned by the caller */
+	gpf->data = data;
+	gpf->length = length;
+	gpf->data_source = PTB_DATA_NONE;
+
+	gp_read_all(gpf);
+
+	return gp_finish(gpf, error);
+}
+
+struct gpf *gp_read_mem(const char *data, size_t length)
+{
+	return gp_read_mem_ex(data, length, NULL, NULL);
+}
+
+static void gp_read_path(struct gpf *gpf, const char *filename)
+{
+	int fd = open(filename, O_RDONLY
+#ifdef O_BINARY
+			  | O_BINARY
+#endif
+			  );
+
+	if (fd < 0) {
+		gp_error(gpf, GP_ERROR_IO, 0);
+		return;
+	}
+
+	if (gp_load_data(gpf, fd) == 0) 
+		gp_read_all(gpf);
+	close(fd);
+}
+
+struct gpf *gp_read_file_ex(const char *filename, const struct ptb_allocator *allocator, struct gp_error *error)
+{
+	struct gpf *gpf = gp_new(allocator);
+
+	if (gpf == NULL) 
+		return gp_no_memory(error);
+
+	gp_read_path(gpf, filename);
+
+	return gp_finish(gpf, error);
+}
+
+struct gpf *gp_read_file(const char *filename)
+{
+	return gp_read_file_ex(filename, NULL, NULL);
+}
+
+/* Nothing is left of the document once the events have been sent */
+static int gp_parse_finish(struct gpf *gpf, struct gp_error *error)
+{
+	gpf = gp_finish(gpf, error);
+	if (gpf == NULL) 
+		return -1;
+
+	gp_free(gpf);
+	return 0;
+}
+
+int gp_parse_mem(const char *data, size_t length, const struct gp_events *events, void *private_data, const struct ptb_allocator *allocator, struct gp_error *error)
+{
+	struct gpf *gpf = gp_new(allocator);
+
+	if (gpf == NULL) {
+		gp_no_memory(error);
+		return -1;
+	}
+
+	gpf->events = events;
+	gpf->events_data = private_data;
+	gpf->data = data;
+	gpf->length = length;
+	gpf->data_source = PTB_DATA_NONE;
+
+	gp_read_all(gpf);
+
+	return gp_parse_finish(gpf, error);
+}
+
+int gp_parse_file(const char *filename, const struct gp_events *events, void *private_data, const struct ptb_allocator *allocator, struct gp_error *error)
+{
+	struct gpf *gpf = gp_new(allocator);
+
+	if (gpf == NULL) {
+		gp_no_memory(error);
+		return -1;
+	}
+
+	gpf->events = events;
+	gpf->events_data = private_data;
+
+	gp_read_path(gpf, filename);
+
+	return gp_parse_finish(gpf, error);
+}
+
+const char *gp_strerror(int code)
+{
+	switch (code) {
+	case GP_ERROR_NONE: return "No error";
+	case GP_ERROR_IO: return "Unable to read file";
+	case GP_ERROR_TRUNCATED: return "Unexpected end of data";
+	case GP_ERROR_BAD_LENGTH: return "Length does not fit in the data";
+	case GP_ERROR_BAD_PROPERTY: return "Unknown property flags";
+	case GP_ERROR_NOMEM: return "Out of memory";
+	default: return "Unknown error";
+	}
+}
+
+struct gp_note *gp_get_note(struct gp_beat *beat, int string)
+{
+	int i;
+
+	for (i = 0; i < beat->num_notes; i++) {
+		if (beat->notes[i].string == string) 
+			return &beat->notes[i];
+	}
+
+	return NULL;
+}
+
+static void gp_write(FILE *out, const void *data, size_t len)
+{
+	/* Missing strings are written as just their length */
+	if (len == 0) return;
+	fwrite(data, 1, len, out);
+}
+
+static void gp_write_unknown(FILE *out, size_t num)
+{
+	static const char zeros[32];
+	while (num > 0) {
+		size_t n = num < sizeof(zeros)?num:sizeof(zeros);
+		gp_write(out, zeros, n);
+		num -= n;
+	}
+}
+
+static void gp_write_uint8(FILE *out, uint8_t n)
+{
+	gp_write(out, &n, sizeof(uint8_t));
+}
+
+static void gp_write_uint32(FILE *out, uint32_t n)
+{
+	gp_write(out, &n, sizeof(uint32_t));
+}
+
+static void gp_write_string(FILE *out, const char *s)
+{
+	size_t len = s?strlen(s):0;
+	if (len > 0xff) len = 0xff;
+	gp_write_uint8(out, len);
+	gp_write(out, s, len);
+}
+
+static void gp_write_long_string(FILE *out, const char *s)
+{
+	size_t len = s?strlen(s):0;
+	gp_write_uint32(out, len);
+	gp_write(out, s, len);
+}
+
+static void gp_write_color(FILE *out, const struct gp_color *color)
+{
+	gp_write_uint8(out, color->unknown);
+	gp_write_uint8(out, color->red);
+	gp_write_uint8(out, color->green);
+	gp_write_uint8(out, color->blue);
+}
+
+static void gp_write_nstring(FILE *out, const char *s, size_t len)
+{
+	size_t _len = s?strlen(s):0;
+	if (_len > len) _len = len;
+	gp_write_uint8(out, _len);
+	gp_write(out, s, _len);
+	gp_write_unknown(out, len - _len);
+}
+
+static void gp_write_header(struct gpf *gpf, FILE *out)
+{
+	uint32_t i;
+	gp_write_long_string(out, gpf->title);
+	gp_write_long_string(out, gpf->subtitle);
+	gp_write_long_string(out, gpf->artist);
+	gp_write_long_string(out, gpf->album);
+	gp_write_long_string(out, gpf->author);
+	gp_write_long_string(out, gpf->copyright);
+	gp_write_long_string(out, gpf->tab_by);
+	gp_write_long_string(out, gpf->instruction);
+
+	gp_write_uint32(out, gpf->notice_num_lines);
+	for (i = 0; i < gpf->notice_num_lines; i++) 
+	{
+		gp_write_long_string(out, gpf->notice[i]);
+	}
+	gp_write_uint8(out, gpf->shuffle);
+}
+
+static void gp_write_lyrics(struct gpf *gpf, FILE *out)
+{
+	if (gpf->version >= 4.0) 
+	{
+		uint32_t i;
+		gp_write_uint32(out, gpf->lyrics_track);
+
+		/* There are always 5 lines of lyrics */
+		for (i = 0; i < 5; i++) {
+			gp_write_uint32(out, i < gpf->num_lyrics?gpf->lyrics[i].bar:0);
+			gp_write_long_string(out, i < gpf->num_lyrics?gpf->lyrics[i].data:NULL);
+		}
+	}
+}
+
+static void gp_write_bars(struct gpf *gpf, FILE *out)
+{
+	uint32_t i;
+
+	for (i = 0; i < gpf->num_bars; i++) 
+	{
+		struct gp_bar *bar = &gpf->bars[i];
+
+		gp_write_uint8(out, bar->properties);
+
+		if (bar->properties & GP_BAR_PROPERTY_CUSTOM_RHYTHM_1) {
+			gp_write_uint8(out, bar->rhythm_1);
+		}
+
+		if (bar->properties & GP_BAR_PROPERTY_CUSTOM_RHYTHM_2) {
+			gp_write_uint8(out, bar->rhythm_2);
+		}
+
+		if (bar->properties & GP_BAR_PROPERTY_REPEAT_CLOSE) {
+			gp_write_uint8(out, bar->repeat_close.volta);
+		}
+
+		if (bar->properties & GP_BAR_PROPERTY_ALT_ENDING) { 
+			gp_write_uint8(out, bar->alternate_ending.type);
+		}
+
+		if (bar->properties & GP_BAR_PROPERTY_MARKER) {
+			gp_write_long_string(out, bar->marker.name);
+			gp_write_color(out, &bar->marker.color);
+		}
+
+		if (bar->properties & GP_BAR_PROPERTY_CHANGE_ARMOR) {
+			gp_write_uint8(out, bar->change_armor.armor_jumps);
+			gp_write_uint8(out, bar->change_armor.minor);
+		}
+	}
+}
+
+static void gp_write_tracks(struct gpf *gpf, FILE *out)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < gpf->num_tracks; i++) 
+	{
+		struct gp_track *track = &gpf->tracks[i];
+
+		gp_write_uint8(out, track->spc);
+		gp_write_nstring(out, track->name, 40);
+		gp_write_uint32(out, track->num_strings);
+		for (j = 0; j < 7; j++) {
+			gp_write_uint32(out, j < track->num_strings?track->strings[j].pitch:0);
+		}
+		gp_write_uint32(out, track->midi_port);
+		gp_write_uint32(out, track->channel1);
+		gp_write_uint32(out, track->channel2);
+		gp_write_uint32(out, track->num_frets);
+		gp_write_uint32(out, track->capo);
+		gp_write_color(out, &track->color);
+	} 
+}
+
+static void gp_write_beat(struct gpf *gpf, FILE *out, struct gp_beat *beat)
+{
+	int i;
+	gp_write_uint8(out, beat->properties);
+
+	if (beat->properties & GP_BEAT_PROPERTY_REST) {
+		gp_write_unknown(out, 1);
+	}
+
+	gp_write_uint8(out, beat->duration);
+
+	if (beat->properties & GP_BEAT_PROPERTY_TUPLET) {
+		gp_write_uint32(out, beat->tuplet.n_tuplet);
+	}
+
+	if (beat->properties & GP_BEAT_PROPERTY_CHORD) {
+		gp_write_uint8(out, beat->chord.complete);
+		if (!beat->chord.complete) {
+			gp_write_long_string(out, beat->chord.name);
+		} else {
+			if (gpf->version >= 4.0) {
+				gp_write_unknown(out, 16);
+				gp_write_string(out, beat->chord.name);
+				gp_write_unknown(out, 25);
+			} else {
+				gp_write_unknown(out, 25);
+				gp_write_string(out, beat->chord.name);
+				gp_write_unknown(out, 34);	
+			}
+		}
+		gp_write_uint32(out, beat->chord.top_fret);
+		if (beat->chord.top_fret == 0) 
+		{
+			gp_write_unknown(out, beat->chord.complete?6 * 4:7 * 4);
+		} 
+		if (beat->chord.complete) 
+		{
+			gp_write_unknown(out, 32);
+		}
+	}
+
+	if (beat->properties & GP_BEAT_PROPERTY_EFFECT) 
+	{
+		gp_write_uint8(out, beat->effect.properties1);
+
+		if (gpf->version >= 4.0) {
+			gp_write_uint8(out, beat->effect.properties2);
+		}
+
+		if (beat->effect.properties1 & GP_BEAT_EFFECT1_STROCKE) {
+			gp_write_unknown(out, 2);
+		}
+
+		if (gpf->version >= 4.0) {
+			if (beat->effect.properties2 & GP_BEAT_EFFECT2_PICK_STROCKE) {
+				gp_write_unknown(out, 1);
+			}
+
+			if (beat->effect.properties2 & GP_BEAT_EFFECT2_TREMOLO_BAR) {
+				gp_write_unknown(out, 5);
+				gp_write_uint32(out, beat->effect.tremolo_bar.num_points);
+				gp_write_unknown(out, beat->effect.tremolo_bar.num_points * 9);
+			}
+
+			if (beat->effect.properties1 & GP_BEAT_EFFECT1_4_STROCKE_EFFECT) {
+				gp_write_unknown(out, 1);
+			}
+		} else {
+			if (beat->effect.properties1 & GP_BEAT_EFFECT1_TREMOLO_BAR) {
+				gp_write_unknown(out, 5);
+			}
+		}
+	}
+
+	if (beat->properties & GP_BEAT_PROPERTY_CHANGE) 
+	{
+		gp_write_uint8(out, beat->change.new_instrument);
+		gp_write_uint8(out, beat->change.new_volume);
+		gp_write_uint8(out, beat->change.new_pan);
+		gp_write_uint8(out, beat->change.new_chorus);
+		gp_write_uint8(out, beat->change.new_reverb);
+		gp_write_uint8(out, beat->change.new_phaser);
+		gp_write_uint8(out, beat->change.new_tremolo);
+		gp_write_uint32(out, beat->change.new_tempo);
+		if (beat->change.new_volume != 0xFF) gp_write_unknown(out, 1);
+		if (beat->change.new_pan != 0xFF) gp_write_unknown(out, 1);
+		if (beat->change.new_chorus != 0xFF) gp_write_unknown(out, 1);
+		if (beat->change.new_reverb != 0xFF) gp_write_unknown(out, 1);
+		if (beat->change.new_phaser != 0xFF) gp_write_unknown(out, 1);
+		if (beat->change.new_tremolo != 0xFF) gp_write_unknown(out, 1);
+		if (beat->change.new_tempo != -1) gp_write_unknown(out, 1);
+
+		if (gpf->version >= 4.0) {
+			gp_write_unknown(out, 1);
+		}
+	}
+
+	gp_write_uint8(out, beat->strings_present);
+
+	for (i = 0; i < 7; i++)
+	{
+		static const struct gp_note no_note;
+		static const struct gp_note_effect no_effect;
+		const struct gp_note *n;
+		const struct gp_note_effect *e;
+
+		if (!(beat->strings_present & (1 << i))) continue;
+
+		n = gp_get_note(beat, i);
+		if (n == NULL) n = &no_note;
+		e = n->effect?n->effect:&no_effect;
+
+		gp_write_uint8(out, n->properties);
+
+		if (n->properties & GP_NOTE_PROPERTY_ALTERATION) {
+			gp_write_uint8(out, n->alteration);
+		}
+
+		if (n->properties & GP_NOTE_PROPERTY_DURATION_SPECIAL) {
+			gp_write_uint8(out, n->duration);
+			gp_write_unknown(out, 1);
+		}
+
+		if (n->properties & GP_NOTE_PROPERTY_NUANCE_CHANGE) {
+			gp_write_uint8(out, n->new_nuance);
+		}
+
+		if (n->properties & GP_NOTE_PROPERTY_ALTERATION) {
+			gp_write_uint8(out, n->value);
+		}
+
+		if (n->properties & GP_NOTE_PROPERTY_FINGERING) {
+			gp_write_uint8(out, n->fingering.left_hand);
+			gp_write_uint8(out, n->fingering.right_hand);
+		}
+
+		if (n->properties & GP_NOTE_PROPERTY_EFFECT) {
+			gp_write_uint8(out, e->properties1);
+			
+			if (gpf->version >= 4.0) {
+				gp_write_uint8(out, e->properties2);
+			}
+
+			if (e->properties1 & GP_NOTE_EFFECT1_BEND) {
+				unsigned int k;
+				gp_write_unknown(out, 5);
+				gp_write_uint32(out, e->bend.num_points);
+				for (k = 0; k < e->bend.num_points; k++)
+				{
+					gp_write_unknown(out, 4);
+					gp_write_uint32(out, e->bend.points[k].pitch);
+					gp_write_unknown(out, 1);
+				}
+			}
+
+			if (e->properties1 & GP_NOTE_EFFECT1_APPOGIATURE) 
+			{
+				gp_write_uint8(out, e->appogiature.previous_note);
+				gp_write_unknown(out, 1);
+				gp_write_uint8(out, e->appogiature.transition);
+				gp_write_uint8(out, e->appogiature.duration);
+			}
+
+			if (gpf->version < 4.0) continue;
+
+			if (e->properties2 & GP_NOTE_EFFECT2_TREMOLO_PICKING)
+			{
+				gp_write_uint8(out, e->tremolo_picking.duration);
+			}
+
+			if (e->properties2 & GP_NOTE_EFFECT2_SLIDE)
+			{
+				gp_write_uint8(out, e->slide.type);
+			}
+
+			if (e->properties2 & GP_NOTE_EFFECT2_HARMONIC)
+			{
+				gp_write_uint8(out, e->harmonic.type);
+			}
+
+			if (e->properties2 & GP_NOTE_EFFECT2_TRILL)
+			{
+				gp_write_uint8(out, e->trill.note_value);
+				gp_write_uint8(out, e->trill.frequency);
+			}
+		}
+	}
+}
+
+static void gp_write_data(struct gpf *gpf, FILE *out)
+{
+	uint32_t i, j, k;
+	for (i = 0; i < gpf->num_bars; i++) 
+	{
+		for (j = 0; j < gpf->num_tracks; j++) 
+		{
+			struct gp_bar_track *track = &gpf->bars[i].tracks[j];
+			gp_write_uint32(out, track->num_beats);
+			for (k = 0; k < track->num_beats; k++) 
+			{
+				gp_write_beat(gpf, out, &track->beats[k]);
+			}
+		}
+	}
+}
+
+/* Only files of version 3.0 and later can be written */
+int gp_write_file(const char *filename, struct gpf *gpf)
+{
+	FILE *out;
+	int ret;
+
+	if (gpf->version < 3.0 || !gpf->version_string) {
+		return -1;
+	}
+
+	out = fopen(filename, "wb");
+	if (!out) {
+		return -1;
+	}
+
+	gp_write_string(out, gpf->version_string);
+
+	gp_write_unknown(out, 6);
+
+	gp_write_header(gpf, out);
+
+	gp_write_lyrics(gpf, out);
+
+	gp_write_uint32(out, gpf->bpm);
+
+	gp_write_unknown(out, gpf->version >= 4.0?5:4);
+
+	/* Instruments */
+	gp_write_unknown(out, 64 * 12);
+
+	gp_write_uint32(out, gpf->num_bars);
+
+	gp_write_uint32(out, gpf->num_tracks);
+
+	gp_write_bars(gpf, out);
+
+	gp_write_tracks(gpf, out);
+
+	gp_write_data(gpf, out);
+
+	gp_write_unknown(out, 2);
+
+	ret = ferror(out)?-1:0;
+	if (fclose(out) != 0) ret = -1;
+
+	return ret;
+}
+
 void gp_free(struct gpf *ret)
 {
-	/* FIXME */
-	free(ret);
+	struct ptb_allocator allocator = ret->allocator;
+
+	/* Everything but the document itself came from the arena */
+	ptb_arena_free(ret->arena);
+	ptb_mem_free(&allocator, ret);
 }
@@ -22,16 +22,7 @@
 
 #include <sys/stat.h>
 #include <stdlib.h>
-
-#if defined(_MSC_VER) && !defined(PTB_CORE)
-#pragma comment(lib,"ptb.lib")
-#endif
-
-#ifdef _MSC_VER
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned long uint32_t;
-#endif
+#include "ptb.h" /* For the integer types and struct ptb_allocator */
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,7 +36,18 @@ struct gp_color {
 };
 
 struct gpf {
-	int fd;
+	/* Input, only valid while parsing */
+	const char *data;
+	size_t length;
+	size_t curpos;
+	int data_source;
+	int error;
+	size_t error_offset;
+	const struct gp_events *events; /* Set while streaming */
+	void *events_data;
+	struct ptb_allocator allocator;
+	/* Everything in the file comes from here, see gp_free() */
+	struct ptb_arena *arena;
 	const char *version_string;
 	double version;
 	
@@ -159,7 +161,10 @@ struct gpf {
 				uint8_t duration;
 				const char *text;
 				uint8_t strings_present;
+				/* Only the notes that are present, ordered by string */
+				uint8_t num_notes;
 				struct gp_note {
+					uint8_t string; /* Bit in strings_present */
 					uint8_t duration;
 					uint8_t new_nuance;
 					uint8_t value;
@@ -176,6 +181,11 @@ struct gpf {
 #define GP_NOTE_ALTERATION_LINKED			0x02
 #define GP_NOTE_ALTERATION_DEAD				0x03
 					struct {
+						uint8_t left_hand;
+						uint8_t right_hand;
+					} fingering;
+					/* Only set if GP_NOTE_PROPERTY_EFFECT is */
+					struct gp_note_effect {
 						uint8_t properties1;
 #define GP_NOTE_EFFECT1_BEND				0x01
 #define GP_NOTE_EFFECT1_HAMMER				0x02
@@ -220,12 +230,8 @@ struct gpf {
 							uint8_t previous_note;
 							uint8_t transition;
 						} appogiature;
-					} effect;
-					struct {
-						uint8_t left_hand;
-						uint8_t right_hand;
-					} fingering;
-				} notes[7];
+					} *effect;
+				} *notes;
 			} *beats;
 		} *tracks;
 	} *bars;
@@ -247,7 +253,57 @@ struct gpf {
 
 };
 
+/* Why reading a file failed */
+#define GP_ERROR_NONE			0
+#define GP_ERROR_IO				1 /* See errno */
+#define GP_ERROR_TRUNCATED		2
+#define GP_ERROR_BAD_LENGTH		3
+#define GP_ERROR_BAD_PROPERTY	4
+#define GP_ERROR_NOMEM			5
+
+struct gp_error {
+	int code;
+	size_t offset; /* In the file */
+};
+
+/* The buffer is only needed for the duration of the call */
+extern struct gpf *gp_read_mem(const char *data, size_t length);
 extern struct gpf *gp_read_file(const char *filename);
+/* Allocate the file from allocator rather than the one set with 
+ * ptb_set_allocator(), if it is not NULL. If reading fails, NULL is 
+ * returned and the first problem is described in error (which may 
+ * be NULL) */
+extern struct gpf *gp_read_mem_ex(const char *data, size_t length, const struct ptb_allocator *allocator, struct gp_error *error);
+extern struct gpf *gp_read_file_ex(const char *filename, const struct ptb_allocator *allocator, struct gp_error *error);
+extern const char *gp_strerror(int code);
+
+/* The note on string (0 to 6) of a beat, or NULL if there is none */
+extern struct gp_note *gp_get_note(struct gp_beat *beat, int string);
+extern int gp_write_file(const char *filename, struct gpf *);
+/* Callbacks for gp_parse_file() and gp_parse_mem(), any of which may 
+ * be NULL. Items are passed in file order: the header, the bars, the 
+ * tracks and then the beats of every track of every bar, each beat 
+ * followed by its notes. */
+struct gp_events {
+	/* The lists in the file (bars, tracks) are not filled in */
+	void (*on_header) (void *data, struct gpf *);
+	void (*on_bar) (void *data, int bar, struct gp_bar *);
+	void (*on_track) (void *data, int track, struct gp_track *);
+	void (*on_beat) (void *data, int bar, int track, struct gp_beat *);
+	void (*on_note) (void *data, struct gp_beat *, struct gp_note *);
+};
+
+/* Decode a file in a single pass, calling the callbacks in events rather 
+ * than building a document. Items are only valid until the callback 
+ * (or, for notes, the beat) they were passed to has returned, so memory 
+ * use does not grow with the size of the file. Returns 0 on success; 
+ * otherwise the first problem is described in error (which may be NULL) 
+ * and no more callbacks are made after it. */
+extern int gp_parse_mem(const char *data, size_t length, const struct gp_events *events, void *private_data, const struct ptb_allocator *allocator, struct gp_error *error);
+extern int gp_parse_file(const char *filename, const struct gp_events *events, void *private_data, const struct ptb_allocator *allocator, struct gp_error *error);
+
+/* Releases a document and everything in it at once. Items in a 
+ * document that was read can not be freed individually. */
 extern void gp_free(struct gpf *);
 
 #ifdef __cplusplus
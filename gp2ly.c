@@ -30,6 +30,7 @@
 #endif
 
 #include "gp.h"
+#include "batch.h"
 
 #define LILYPOND_VERSION "2.4"
 
@@ -110,7 +111,8 @@ static void ly_write_beat(FILE *out, struct gp_beat *b)
 		int j;
 		fprintf(out, " <");
 		for (j = 0; j < 7; j++) { /* FIXME: s/7/num_strings? */
-			fprintf(out, "%d-%d ", b->notes[j].value, b->notes[j].duration);
+			const struct gp_note *n = gp_get_note(b, j);
+			fprintf(out, "%d-%d ", n?n->value:0, n?n->duration:0);
 		}
 		fprintf(out, "> ");
 	}
@@ -179,62 +181,27 @@ static void ly_write_bars(FILE *out, struct gpf *ret)
 	}
 }
 
-int main(int argc, const char **argv) 
+static int quiet = 0;
+
+static int convert(const char *input, const char *output, void *data)
 {
 	FILE *out;
 	struct gpf *ret;
-	int c;
-	int version = 0;
-	int quiet = 0;
+	struct gp_error error;
 	int i;
-	const char *input;
-	char *output = NULL;
-	poptContext pc;
-	struct poptOption options[] = {
-		POPT_AUTOHELP
-		{"outputfile", 'o', POPT_ARG_STRING, &output, 0, "Write to specified file", "FILE" },
-		{"quiet", 'q', POPT_ARG_NONE, &quiet, 1, "Be quiet (no output to stderr)" },
-		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
-		POPT_TABLEEND
-	};
 
-	pc = poptGetContext(argv[0], argc, argv, options, 0);
-	poptSetOtherOptionHelp(pc, "file.ptb");
-	while((c = poptGetNextOpt(pc)) >= 0) {
-		switch(c) {
-		case 'v':
-			printf("gp2ly Version "PACKAGE_VERSION"\n");
-			printf("(C) 2004 Jelmer Vernooij <jelmer@samba.org>\n");
-			exit(0);
-			break;
-		}
-	}
-			
-	if(!poptPeekArg(pc)) {
-		poptPrintUsage(pc, stderr, 0);
-		return -1;
-	}
-	input = poptGetArg(pc);
-	
 	if (!quiet) fprintf(stderr, "Parsing %s... \n", input);
 					
-	ret = gp_read_file(input);
+	ret = gp_read_file_ex(input, NULL, &error);
 	
 	if(!ret) {
-		perror("Read error: ");
+		if (error.code == GP_ERROR_IO) 
+			perror("Read error: ");
+		else 
+			fprintf(stderr, "%s: 0x%lx: %s\n", input, (unsigned long)error.offset, gp_strerror(error.code));
 		return -1;
 	} 
 
-	if(!output) {
-		int baselength = strlen(input);
-		if (!strncmp(input + strlen(input) - 4, ".gp", 3)) {
-			baselength -= 4;
-		}
-		output = malloc(baselength + 5);
-		strncpy(output, input, baselength);
-		strcpy(output + baselength, ".ly");
-	}
-
 	if (!quiet) fprintf(stderr, "Generating lilypond file in %s...\n", output);
 
 	if (!strcmp(output, "-")) {
@@ -243,6 +210,7 @@ int main(int argc, const char **argv)
 		out = fopen(output, "w+");
 		if(!out) {
 			perror("open");
+			gp_free(ret);
 			return -1;
 		}
 	}
@@ -275,7 +243,46 @@ int main(int argc, const char **argv)
 	fprintf(out, "\t\\midi { }\n");
 	fprintf(out, "} \n");
 
-	if(output)fclose(out);
+	if(out != stdout)fclose(out);
+	else fflush(out);
+
+	gp_free(ret);
 	
-	return (ret?0:1);
+	return 0;
+}
+
+int main(int argc, const char **argv) 
+{
+	int c;
+	int version = 0;
+	struct batch batch = { NULL, ".gp", ".ly", 1, 0, convert, NULL };
+	poptContext pc;
+	struct poptOption options[] = {
+		POPT_AUTOHELP
+		{"outputfile", 'o', POPT_ARG_STRING, &batch.output, 0, "Write to specified file (or template, for several files)", "FILE" },
+		{"jobs", 'j', POPT_ARG_INT, &batch.jobs, 0, "Convert N files at the same time (0 for one per CPU)", "N" },
+		{"quiet", 'q', POPT_ARG_NONE, &quiet, 1, "Be quiet (no output to stderr)" },
+		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, options, 0);
+	poptSetOtherOptionHelp(pc, "file.gp ...");
+	while((c = poptGetNextOpt(pc)) >= 0) {
+		switch(c) {
+		case 'v':
+			printf("gp2ly Version "PACKAGE_VERSION"\n");
+			printf("(C) 2004 Jelmer Vernooij <jelmer@samba.org>\n");
+			exit(0);
+			break;
+		}
+	}
+			
+	if(!poptPeekArg(pc)) {
+		poptPrintUsage(pc, stderr, 0);
+		return -1;
+	}
+
+	batch.quiet = quiet;
+	return batch_convert(&batch, poptGetArgs(pc));
 }
@@ -0,0 +1,280 @@
+/*
+   Memory management: allocator hooks, loading of input files and a 
+   simple chunked bump allocator used for parsed documents
+   (c) 2007: Jelmer Vernooij <jelmer@samba.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#  include <io.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#else
+#  undef HAVE_MMAP
+#endif
+
+#define PTB_CORE
+#include "ptb-arena.h"
+
+#define ARENA_MIN_CHUNK		0x4000
+#define ARENA_MAX_CHUNK		0x100000
+#define ARENA_ALIGN			(sizeof(void *) > sizeof(double)?sizeof(void *):sizeof(double))
+#define ARENA_ROUND(n)		(((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct ptb_arena_chunk {
+	struct ptb_arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+#define CHUNK_HDR_SIZE ARENA_ROUND(sizeof(struct ptb_arena_chunk))
+
+/* Only read when a call starts, like the default parse options */
+static struct ptb_allocator default_allocator;
+
+void ptb_set_allocator(const struct ptb_allocator *a)
+{
+	if (a) 
+		default_allocator = *a;
+	else 
+		memset(&default_allocator, 0, sizeof(default_allocator));
+}
+
+const struct ptb_allocator *ptb_allocator(const struct ptb_allocator *a)
+{
+	return a?a:&default_allocator;
+}
+
+static void *ptb_mem_alloc_raw(const struct ptb_allocator *a, size_t size)
+{
+	/* Allocators may well return NULL for 0 bytes */
+	if (size == 0) size = 1;
+	return a->alloc?a->alloc(a->data, size):malloc(size);
+}
+
+void *ptb_mem_alloc(const struct ptb_allocator *a, size_t size)
+{
+	void *ret = ptb_mem_alloc_raw(a, size);
+	if (ret) memset(ret, 0, size);
+	return ret;
+}
+
+void *ptb_mem_realloc(const struct ptb_allocator *a, void *ptr, size_t size)
+{
+	if (ptr == NULL) return ptb_mem_alloc_raw(a, size);
+	if (size == 0) size = 1;
+	return a->realloc?a->realloc(a->data, ptr, size):realloc(ptr, size);
+}
+
+void ptb_mem_free(const struct ptb_allocator *a, void *ptr)
+{
+	if (ptr == NULL) return;
+	if (a->free) a->free(a->data, ptr);
+	else free(ptr);
+}
+
+char *ptb_mem_strdup(const struct ptb_allocator *a, const char *s)
+{
+	size_t len = strlen(s);
+	char *ret = mem_p(a, char, len + 1);
+	if (ret) memcpy(ret, s, len);
+	return ret;
+}
+
+int ptb_mem_load(const struct ptb_allocator *a, int fd, char **data, size_t *length, int *source)
+{
+	struct stat st;
+	size_t allocated;
+	char *buf;
+	ssize_t ret;
+
+	*data = NULL;
+	*length = 0;
+	*source = PTB_DATA_NONE;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size == 0) 
+			return 0;
+#ifdef HAVE_MMAP
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			*data = buf;
+			*length = st.st_size;
+			*source = PTB_DATA_MMAP;
+			return 0;
+		}
+#endif
+		allocated = st.st_size;
+	} else {
+		allocated = 0x10000;
+	}
+
+	/* Not mappable, read everything in one go (or as few as possible) */
+	buf = ptb_mem_alloc(a, allocated);
+	while (buf) {
+		if (*length == allocated) {
+			char *newbuf;
+			allocated *= 2;
+			newbuf = ptb_mem_realloc(a, buf, allocated);
+			if (newbuf == NULL) break;
+			buf = newbuf;
+		}
+
+		ret = read(fd, buf + *length, allocated - *length);
+		if (ret == 0) {
+			*data = buf;
+			*source = PTB_DATA_HEAP;
+			return 0;
+		}
+		if (ret < 0) {
+			ptb_mem_free(a, buf);
+			return -1;
+		}
+		*length += ret;
+	}
+
+	ptb_mem_free(a, buf);
+	return -2;
+}
+
+void ptb_mem_unload(const struct ptb_allocator *a, char *data, size_t length, int source)
+{
+	switch (source) {
+#ifdef HAVE_MMAP
+	case PTB_DATA_MMAP: munmap(data, length); break;
+#endif
+	case PTB_DATA_HEAP: ptb_mem_free(a, data); break;
+	default: break;
+	}
+}
+
+struct ptb_arena {
+	struct ptb_arena_chunk *chunks;
+	size_t next_chunk_size;
+	struct ptb_allocator allocator;
+};
+
+struct ptb_arena *ptb_arena_new(const struct ptb_allocator *a)
+{
+	struct ptb_arena *arena;
+
+	a = ptb_allocator(a);
+	arena = mem_p(a, struct ptb_arena, 1);
+	if (arena == NULL) return NULL;
+	arena->next_chunk_size = ARENA_MIN_CHUNK;
+	arena->allocator = *a;
+	return arena;
+}
+
+static struct ptb_arena_chunk *ptb_arena_grow(struct ptb_arena *arena, size_t size)
+{
+	struct ptb_arena_chunk *chunk;
+
+	/* Oversized allocations get a chunk of their own, which is kept 
+	 * behind the current chunk so its free space is not lost */
+	if (size + CHUNK_HDR_SIZE > arena->next_chunk_size) {
+		chunk = ptb_mem_alloc_raw(&arena->allocator, size + CHUNK_HDR_SIZE);
+		if (chunk == NULL) return NULL;
+		chunk->size = size + CHUNK_HDR_SIZE;
+		chunk->used = CHUNK_HDR_SIZE;
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+		return chunk;
+	}
+
+	chunk = ptb_mem_alloc_raw(&arena->allocator, arena->next_chunk_size);
+	if (chunk == NULL) return NULL;
+
+	chunk->size = arena->next_chunk_size;
+	chunk->used = CHUNK_HDR_SIZE;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	/* Chunks double in size, so large documents only need a 
+	 * handful of them */
+	if (arena->next_chunk_size < ARENA_MAX_CHUNK) 
+		arena->next_chunk_size *= 2;
+
+	return chunk;
+}
+
+/* Returns zeroed memory, like calloc() */
+void *ptb_arena_alloc(struct ptb_arena *arena, size_t size)
+{
+	struct ptb_arena_chunk *chunk = arena->chunks;
+	void *ret;
+
+	size = ARENA_ROUND(size);
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = ptb_arena_grow(arena, size);
+		if (chunk == NULL) return NULL;
+	}
+
+	ret = (char *)chunk + chunk->used;
+	chunk->used += size;
+	memset(ret, 0, size);
+	return ret;
+}
+
+/* Forget about everything allocated so far, but hang on to the most 
+ * recent chunk so the arena can be reused without calling malloc() */
+void ptb_arena_reset(struct ptb_arena *arena)
+{
+	struct ptb_arena_chunk *chunk, *next;
+
+	if (arena->chunks == NULL) return;
+
+	for (chunk = arena->chunks->next; chunk; chunk = next) {
+		next = chunk->next;
+		ptb_mem_free(&arena->allocator, chunk);
+	}
+
+	arena->chunks->next = NULL;
+	arena->chunks->used = CHUNK_HDR_SIZE;
+}
+
+void ptb_arena_free(struct ptb_arena *arena)
+{
+	struct ptb_arena_chunk *chunk, *next;
+
+	if (arena == NULL) return;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		ptb_mem_free(&arena->allocator, chunk);
+	}
+
+	ptb_mem_free(&arena->allocator, arena);
+}
@@ -0,0 +1,64 @@
+/*
+   Memory management: allocator hooks, loading of input files and a 
+   simple chunked bump allocator used for parsed documents
+   (c) 2007: Jelmer Vernooij <jelmer@samba.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __PTB_ARENA_H__
+#define __PTB_ARENA_H__
+
+#include <stdlib.h>
+#include "ptb.h"
+
+/* The allocator set with ptb_set_allocator(), if a is NULL */
+const struct ptb_allocator *ptb_allocator(const struct ptb_allocator *a);
+
+/* Wrappers around an allocator. ptb_mem_alloc() returns zeroed memory, 
+ * like calloc(), and ptb_mem_free() ignores NULL. */
+void *ptb_mem_alloc(const struct ptb_allocator *, size_t size);
+void *ptb_mem_realloc(const struct ptb_allocator *, void *ptr, size_t size);
+void ptb_mem_free(const struct ptb_allocator *, void *ptr);
+char *ptb_mem_strdup(const struct ptb_allocator *, const char *s);
+
+#define mem_p(a,t,n) (t *) ptb_mem_alloc(a, sizeof(t) * (n))
+
+/* Where the input of a reader lives */
+#define PTB_DATA_NONE	0 /* Owned by the caller, or nothing */
+#define PTB_DATA_HEAP	1
+#define PTB_DATA_MMAP	2
+
+/* Load the complete contents of fd, preferably by mapping it and 
+ * otherwise into a buffer from a. Returns 0 on success, -1 if reading 
+ * fails and -2 if a runs out of memory; on failure *length is the 
+ * number of bytes read before that happened. */
+int ptb_mem_load(const struct ptb_allocator *a, int fd, char **data, size_t *length, int *source);
+/* Release data returned by ptb_mem_load() */
+void ptb_mem_unload(const struct ptb_allocator *a, char *data, size_t length, int source);
+
+/* Memory allocated from an arena can not be freed individually; 
+ * everything is released at once by ptb_arena_free() */
+struct ptb_arena;
+
+/* Chunks are allocated from a, which may be NULL for the default */
+struct ptb_arena *ptb_arena_new(const struct ptb_allocator *a);
+void *ptb_arena_alloc(struct ptb_arena *, size_t size);
+void ptb_arena_reset(struct ptb_arena *);
+void ptb_arena_free(struct ptb_arena *);
+
+#define arena_p(a,t,n) (t *) ptb_arena_alloc(a, sizeof(t) * (n))
+
+#endif /* __PTB_ARENA_H__ */
@@ -38,16 +38,21 @@ typedef int ssize_t;
 
 #define PTB_CORE
 #include "ptb.h"
-
-#define malloc_p(t,n) (t *) calloc(sizeof(t), n)
+#include "ptb-arena.h"
 
 struct ptb_tuning_dict *ptb_read_tuning_dict(const char *f)
 {
-	struct ptb_tuning_dict *ptbf = malloc_p(struct ptb_tuning_dict, 1);
+	const struct ptb_allocator *a = ptb_allocator(NULL);
+	struct ptb_tuning_dict *ptbf = mem_p(a, struct ptb_tuning_dict, 1);
 	char unknown[8];
 	int i;
 	int fd;
 
+	if (ptbf == NULL) 
+		return NULL;
+
+	ptbf->allocator = *a;
+
 	fd = open(f, O_RDONLY
 #ifdef O_BINARY
 						| O_BINARY
@@ -58,18 +63,25 @@ struct ptb_tuning_dict *ptb_read_tuning_dict(const char *f)
 	read(fd, unknown, 7);
 	read(fd, unknown, 7); /* Class name (CTuning) */
 
-	ptbf->tunings = malloc_p(struct ptb_tuning, ptbf->nr_tunings);
+	ptbf->tunings = mem_p(a, struct ptb_tuning, ptbf->nr_tunings);
+	if (ptbf->tunings == NULL) 
+		goto fail;
+
 	for (i = 0; i < ptbf->nr_tunings; i++) {
 		uint8_t name_len;
 		read(fd, &name_len, 1);
 
-		ptbf->tunings[i].name = malloc_p(char, name_len+1);
+		ptbf->tunings[i].name = mem_p(a, char, name_len+1);
+		if (ptbf->tunings[i].name == NULL) 
+			goto fail;
 		read(fd, ptbf->tunings[i].name, name_len);
 		ptbf->tunings[i].name[name_len] = '\0';
 
 		read(fd, &ptbf->tunings[i].capo, 1);
 		read(fd, &ptbf->tunings[i].nr_strings, 1);
-		ptbf->tunings[i].strings = malloc_p(uint8_t, ptbf->tunings[i].nr_strings);
+		ptbf->tunings[i].strings = mem_p(a, uint8_t, ptbf->tunings[i].nr_strings);
+		if (ptbf->tunings[i].strings == NULL) 
+			goto fail;
 		read(fd, ptbf->tunings[i].strings, ptbf->tunings[i].nr_strings);
 
 		read(fd, unknown, 2);
@@ -78,11 +90,16 @@ struct ptb_tuning_dict *ptb_read_tuning_dict(const char *f)
 	close(fd);
 
 	return ptbf;
+
+fail:
+	close(fd);
+	ptb_free_tuning_dict(ptbf);
+	return NULL;
 }
 
 int ptb_write_tuning_dict(const char *f, struct ptb_tuning_dict *t)
 {
-	struct ptb_tuning_dict *ptbf = malloc_p(struct ptb_tuning_dict, 1);
+	struct ptb_tuning_dict *ptbf = t;
 	char unknown[8];
 	int i;
 	int fd;
@@ -128,11 +145,12 @@ const char *ptb_tuning_get_note(char n)
 
 void ptb_free_tuning_dict(struct ptb_tuning_dict *t)
 {
+	struct ptb_allocator allocator = t->allocator;
 	int i;
-	for (i = 0; i < t->nr_tunings; i++) {
-		free(t->tunings[i].name);
-		free(t->tunings[i].strings);
+	for (i = 0; t->tunings && i < t->nr_tunings; i++) {
+		ptb_mem_free(&allocator, t->tunings[i].name);
+		ptb_mem_free(&allocator, t->tunings[i].strings);
 	}
-	free(t->tunings);
-	free(t);
+	ptb_mem_free(&allocator, t->tunings);
+	ptb_mem_free(&allocator, t);
 }
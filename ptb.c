@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include "dlinklist.h"
 
 #ifndef __PRETTY_FUNCTION__
@@ -43,73 +44,157 @@ typedef int ssize_t;
 #  include <stdint.h>
 #endif
 
+#ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+#endif
+
+#include <time.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#else
+#  undef HAVE_MMAP
+#endif
+
 #define PTB_CORE
 #include "ptb.h"
-
-int assert_is_fatal = 0;
+#include "ptb-arena.h"
 
 #define ptb_assert(ptb, expr) \
-	if (!(expr)) { ptb_debug("---------------------------------------------"); \
-		ptb_error("file: %s, line: %d (%s): assertion failed: %s. Current position: 0x%lx", __FILE__, __LINE__, __PRETTY_FUNCTION__, #expr, ptb->curpos); \
-		if(assert_is_fatal) abort(); \
+	if (!(expr)) { ptb_debug(ptb, "---------------------------------------------"); \
+		ptb_error(ptb, "file: %s, line: %d (%s): assertion failed: %s. Current position: 0x%lx", __FILE__, __LINE__, __PRETTY_FUNCTION__, #expr, ptb->curpos); \
+		if((ptb)->options.asserts_fatal) abort(); \
 	}
 
-#define malloc_p(t,n) (t *) calloc(sizeof(t), n)
+/* Allocate memory that is part of the document */
+#define ptb_alloc(bf,t,n) (t *) ptb_doc_alloc(bf, sizeof(t) * (n))
 
-#define GET_ITEM(bf, dest, type)  ((bf)->mode == O_WRONLY?(type *)(*(dest)):malloc_p(type, 1))
+#define GET_ITEM(bf, dest, type)  ((bf)->mode == O_WRONLY?(type *)(*(dest)):ptb_alloc(bf, type, 1))
 
 #define ptb_assert_0(ptb, expr) \
-	if(expr) ptb_error("%s == 0x%x!", #expr, expr); \
+	if(expr) ptb_error(ptb, "%s == 0x%x!", #expr, expr); \
 /*	ptb_assert(ptb, (expr) == 0); */
 
 struct ptb_list {
 	struct ptb_list *prev, *next;
 };
 
+/* Positions of a staff by offset. Both voices are stored one after 
+ * the other, in list order. */
+struct ptb_staff_index {
+	struct ptb_position **positions;
+	/* Sum of 0x100 / length of the earlier positions in the same voice */
+	uint32_t *start;
+	/* positions[first[v]] up to positions[first[v+1]] are voice v */
+	uint16_t first[3];
+	uint32_t end[2]; /* Sum for the whole voice */
+	uint8_t sorted[2]; /* Offsets never decrease */
+	/* 1 + the number of the first position at an offset, 0 if none */
+	uint16_t by_offset[0x100];
+};
+
 struct ptb_section_handler {
-	char *name;
+	const char *name;
 	int (*handler) (struct ptbf *, const char *section, struct ptb_list **ret);
 };
 
-extern struct ptb_section_handler ptb_section_handlers[];
+extern const struct ptb_section_handler ptb_section_handlers[PTB_CLASS_MAX];
 
-static void ptb_debug(const char *fmt, ...);
-static void ptb_error(const char *fmt, ...);
+static void ptb_debug(struct ptbf *bf, const char *fmt, ...);
+static void ptb_error(struct ptbf *bf, const char *fmt, ...);
 
-int debugging = 0;
+/* Statistics are only kept for reading, and not for the first pass 
+ * over lazily read sections (which is thrown away) */
+#define ptb_stats_active(bf) ((bf)->stats && (bf)->mode == O_RDONLY && !(bf)->skipping)
 
-static ssize_t ptb_read(struct ptbf *f, void *data, ssize_t length)
+/* Returns zeroed memory. If the allocator runs out, the rest of the 
+ * input is skipped so reading ends as soon as possible, and the read 
+ * fails. */
+static void *ptb_doc_alloc(struct ptbf *bf, size_t size)
 {
-	ssize_t ret = read(f->fd, data, length);
-#define read DONT_USE_READ
+	void *ret;
 
-	if(ret == -1) { 
-		perror("read"); 
-		ptb_assert(f, 0);
-	} else if (ret != length) {
-		ptb_error("Expected read of %d bytes, got %d\n", length, ret);
+	if (ptb_stats_active(bf)) {
+		bf->stats->allocs++;
+		bf->stats->alloc_bytes += size;
+	}
+
+	if (bf->arena) 
+		ret = ptb_arena_alloc(bf->arena, size);
+	else 
+		ret = ptb_mem_alloc(&bf->allocator, size);
+
+	if (ret == NULL && !bf->out_of_memory) {
+		ptb_error(bf, "Out of memory allocating %lu bytes at 0x%lx", (unsigned long)size, bf->curpos);
+		bf->out_of_memory = 1;
+		bf->curpos = bf->length;
 	}
 
-	f->curpos+=ret;
-	
 	return ret;
 }
 
-static ssize_t ptb_write(struct ptbf *f, void *data, size_t length)
+static double ptb_time(void)
 {
-	ssize_t ret = write(f->fd, data, length);
-#define write DONT_USE_WRITE
+#ifdef HAVE_SYS_TIME_H
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return time(NULL);
+#endif
+}
+
+/* Account for an item of class cls that started at offset start, and 
+ * has just been read completely */
+static void ptb_count_item(struct ptbf *bf, enum ptb_class cls, off_t start, off_t nested)
+{
+	off_t length = bf->curpos - start;
+
+	if (ptb_stats_active(bf)) {
+		bf->stats->classes[cls].items++;
+		bf->stats->classes[cls].bytes += length - bf->nested_bytes;
+	}
+
+	/* The parent should not count this item as its own */
+	bf->nested_bytes = nested + length;
+}
 
-	if(ret == -1) { 
-		perror("write"); 
-		ptb_assert(f, 0);
+static ssize_t ptb_read(struct ptbf *f, void *data, ssize_t length)
+{
+	ssize_t ret = length;
+
+	/* Never walk off the end of the buffer, even if the file claims 
+	 * there is more data */
+	if (f->curpos + length > f->length) {
+		ret = f->length - f->curpos;
+		ptb_error(f, "Expected read of %d bytes, got %d\n", length, ret);
+		memset((char *)data + ret, 0, length - ret);
 	}
 
+	memcpy(data, f->data + f->curpos, ret);
 	f->curpos+=ret;
 	
 	return ret;
 }
 
+static ssize_t ptb_write(struct ptbf *f, void *data, size_t length)
+{
+	/* The sizing pass has no buffer yet and only keeps count */
+	if (f->data) {
+		if (f->curpos + length > f->length) {
+			ptb_error(f, "Write of %lu bytes past end of output buffer", (unsigned long)length);
+			ptb_assert(f, 0);
+			return 0;
+		}
+		/* Empty strings have no data */
+		if (length > 0) memcpy(f->data + f->curpos, data, length);
+	}
+
+	f->curpos+=length;
+	
+	return length;
+}
+
 static ssize_t ptb_data(struct ptbf *f, void *data, size_t length)
 {
 	switch (f->mode) {
@@ -124,6 +209,18 @@ static ssize_t ptb_data(struct ptbf *f, void *data, size_t length)
 #define ptb_data_uint16(f,d) ptb_data(f,d,2)
 #define ptb_data_uint32(f,d) ptb_data(f,d,4)
 
+/* Look at the next uint16 without consuming it. Returns 0 at the end 
+ * of the data, in which case dest is set to 0. */
+static int ptb_peek_uint16(struct ptbf *f, uint16_t *dest)
+{
+	*dest = 0;
+	if (f->curpos + 2 > f->length) 
+		return 0;
+	memcpy(dest, f->data + f->curpos, 2);
+	return 2;
+}
+
+
 #define ptb_data_constant(f,e) ptb_data_constant_helper(f,e,__LINE__)
 static ssize_t ptb_data_constant_helper(struct ptbf *f, unsigned char expected, int line) 
 {
@@ -136,7 +233,7 @@ static ssize_t ptb_data_constant_helper(struct ptbf *f, unsigned char expected,
 			ret = ptb_data_uint8(f, &real);
 	
 		if(real != expected) {
-			ptb_error("%04lx: Expected %02x, got %02x at line "__FILE__":%d", f->curpos-1, expected, real, line);
+			ptb_error(f, "%04lx: Expected %02x, got %02x at line "__FILE__":%d", f->curpos-1, expected, real, line);
 			ptb_assert(f, 0);
 		}
 	}
@@ -156,15 +253,26 @@ static ssize_t ptb_data_constant_string(struct ptbf *f, const char *expected, in
 
 static ssize_t ptb_data_unknown(struct ptbf *f, size_t length, const char *comment) {
 	char unknown[255];
-	ssize_t ret;
-	off_t oldpos = f->curpos;
+	ssize_t ret = 0;
 	size_t i;
 
-	memset(unknown, 0, length);
-	ret = ptb_data(f, unknown, length);
-	if(debugging) {
-		for(i = 0; i < length; i++) 
-			ptb_debug("Unknown[%04lx]: %02x", oldpos + i, unknown[i]);
+	if (f->mode == O_RDONLY) {
+		/* Skip over the data rather than copying it */
+		if (f->curpos + length > f->length) {
+			ptb_error(f, "Expected read of %d bytes, got %d\n", length, f->length - f->curpos);
+			length = f->length - f->curpos;
+		}
+		if(f->options.debug) {
+			for(i = 0; i < length; i++) 
+				ptb_debug(f, "Unknown[%04lx]: %02x", f->curpos + i, (unsigned char)f->data[f->curpos + i]);
+		}
+		f->curpos+=length;
+		return length;
+	}
+
+	memset(unknown, 0, sizeof(unknown));
+	for (i = 0; i < length; i += sizeof(unknown)) {
+		ret += ptb_data(f, unknown, (length - i < sizeof(unknown))?length - i:sizeof(unknown));
 	}
 	return ret;
 }
@@ -184,12 +292,22 @@ static ssize_t ptb_read_string(struct ptbf *f, char **dest)
 	}
 
 	if(length) {
-		data = malloc_p(char, length+1);
-		if(ptb_data(f, data, length) < length) return -1;
-		ptb_debug("Read string: %s", data);
+		if (f->curpos + length > f->length) {
+			ptb_error(f, "String of %d bytes runs past end of file", length);
+			*dest = NULL;
+			return -1;
+		}
+		data = ptb_alloc(f, char, length+1);
+		if (data == NULL) {
+			*dest = NULL;
+			return -1;
+		}
+		memcpy(data, f->data + f->curpos, length);
+		f->curpos+=length;
+		ptb_debug(f, "Read string: %s", data);
 		*dest = data;
 	} else {
-		ptb_debug("Empty string");
+		ptb_debug(f, "Empty string");
 		*dest = NULL;
 	}
 
@@ -219,7 +337,7 @@ static ssize_t ptb_write_string(struct ptbf *f, char **dest)
 		length = shortlength;
 	}
 
-	if(ptb_data(f, *dest, length) < length) return -1;
+	if(length && ptb_data(f, *dest, length) < length) return -1;
 
 	return length;
 }
@@ -342,27 +460,22 @@ static void default_error_fn(const char *fmt, va_list ap)
 	fputc('\n', stderr);
 }
 
-static void (*error_fn) (const char *, va_list) = default_error_fn;
-void ptb_set_error_fn(void (*fn) (const char *, va_list)) { error_fn = fn; }
-
-static void ptb_error(const char *fmt, ...)
+static void ptb_error(struct ptbf *bf, const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	if (error_fn) error_fn(fmt, ap);		
+	if (bf->options.error_fn) bf->options.error_fn(fmt, ap);		
 	va_end(ap);
 }
 
-static int debug_level = 0;
-
-static void ptb_debug(const char *fmt, ...) 
+static void ptb_debug(struct ptbf *bf, const char *fmt, ...) 
 {
 	va_list ap;
 	int i;
-	if(debugging == 0) return;
+	if(bf->options.debug == 0) return;
 
 	/* Add spaces */
-	for(i = 0; i < debug_level; i++) fprintf(stderr, " ");
+	for(i = 0; i < bf->debug_level; i++) fprintf(stderr, " ");
 
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
@@ -370,101 +483,250 @@ static void ptb_debug(const char *fmt, ...)
 	fputc('\n', stderr);
 }
 
-static int ptb_read_items(struct ptbf *bf, const char *assumed_type, struct ptb_list **result) {
-	int i;
-	uint16_t unknownval;
-	uint16_t l;
-	uint16_t length;
-	uint16_t header;
-	uint16_t nr_items;
-	int ret = 0;
-
-	*result = NULL;
+/* MFC class tags, see CArchive::ReadClass() */
+#define PTB_NEW_CLASS_TAG	0xFFFF
+#define PTB_CLASS_TAG		0x8000
+#define PTB_BIG_OBJECT_TAG	0x7FFF
+#define PTB_BIG_CLASS_TAG	0x80000000
 
-	ret+=ptb_data_uint16(bf, &nr_items);	
-	if(ret == 0 || nr_items == 0x0) return 1; 
-	ret+=ptb_data_uint16(bf, &header);
+/* Read the tag in front of an object and check that it is of the 
+ * expected class. Every class and every object gets the next id 
+ * in the archive map, starting at 1. */
+static int ptb_read_class_tag(struct ptbf *bf, enum ptb_class cls)
+{
+	const char *name = ptb_section_handlers[cls].name;
+	uint16_t tag, schema, length;
+	uint32_t obtag;
 
-	ptb_debug("Going to read %d items", nr_items);
+	if (ptb_data_uint16(bf, &tag) < 2) return 0;
 
-	if(header == 0xffff) { /* New section */
-		char *my_section_name;
-		/* Read Section */
-		ret+=ptb_data_uint16(bf, &unknownval);
+	if (tag == PTB_NEW_CLASS_TAG) {
+		ptb_data_uint16(bf, &schema);
+		if (schema != 0x0001) {
+			ptb_error(bf, "Unknown schema %04x for class %s", schema, name);
+			return 0;
+		}
 
-		if(unknownval != 0x0001) {
-			fprintf(stderr, "Unknownval: %04x\n", unknownval);
+		ptb_data_uint16(bf, &length);
+		if (bf->curpos + length > bf->length || 
+			length != strlen(name) || 
+			memcmp(bf->data + bf->curpos, name, length) != 0) {
+			ptb_error(bf, "Expected definition of class %s at 0x%lx", name, bf->curpos);
+			ptb_assert(bf, 0);
 			return 0;
 		}
+		bf->curpos += length;
 
-		ret+=ptb_data_uint16(bf, &length);
+		bf->class_index[cls] = bf->map_count++;
+		bf->map_count++;
+		return 1;
+	}
 
-		my_section_name = malloc_p(char, length + 1);
-		ret+=ptb_data(bf, my_section_name, length);
+	if (tag == PTB_BIG_OBJECT_TAG) {
+		ptb_data_uint32(bf, &obtag);
+	} else {
+		obtag = ((uint32_t)(tag & PTB_CLASS_TAG) << 16) | (tag & ~PTB_CLASS_TAG);
+	}
 
-	} else if(header & 0x8000) {
-	} else { 
-		ptb_error("Expected new item type (%s), got %04x %02x\n", assumed_type, nr_items, header);
+	if (!(obtag & PTB_BIG_CLASS_TAG)) {
+		ptb_error(bf, "Expected new item of class %s, got %04x", name, tag);
 		ptb_assert(bf, 0);
 		return 0;
 	}
 
-	for(i = 0; ptb_section_handlers[i].name; i++) {
-		if(!strcmp(ptb_section_handlers[i].name, assumed_type)) {
-			break;
-		}
+	if ((obtag & ~PTB_BIG_CLASS_TAG) != bf->class_index[cls]) {
+		ptb_error(bf, "Warning: got reference to class %d, expected %d (%s)", 
+				  obtag & ~PTB_BIG_CLASS_TAG, bf->class_index[cls], name);
+		ptb_assert(bf, 0);
+	}
+
+	bf->map_count++;
+	return 1;
+}
+
+/* Write the tag in front of an object: the class definition the first 
+ * time a class is used, a reference to it afterwards */
+static int ptb_write_class_tag(struct ptbf *bf, enum ptb_class cls)
+{
+	const char *name = ptb_section_handlers[cls].name;
+	uint16_t tag, schema = 0x0001, length;
+	uint32_t obtag;
+
+	if (bf->class_index[cls] == 0) {
+		tag = PTB_NEW_CLASS_TAG;
+		ptb_data_uint16(bf, &tag);
+		ptb_data_uint16(bf, &schema);
+		length = strlen(name);
+		ptb_data_uint16(bf, &length);
+		ptb_data(bf, (void *)name, length);
+		bf->class_index[cls] = bf->map_count++;
+	} else if (bf->class_index[cls] < PTB_BIG_OBJECT_TAG) {
+		tag = PTB_CLASS_TAG | bf->class_index[cls];
+		ptb_data_uint16(bf, &tag);
+	} else {
+		tag = PTB_BIG_OBJECT_TAG;
+		obtag = PTB_BIG_CLASS_TAG | bf->class_index[cls];
+		ptb_data_uint16(bf, &tag);
+		ptb_data_uint32(bf, &obtag);
+	}
+
+	bf->map_count++;
+	return 1;
+}
+
+#define EVENT(bf,fn) if ((bf)->events->fn) (bf)->events->fn
+
+/* Called by handlers of items that contain other items, before the 
+ * contained items are read */
+static void ptb_event_begin(struct ptbf *bf, enum ptb_class cls, void *item)
+{
+	switch (cls) {
+	case PTB_CLASS_SECTION: 
+		bf->cur_section = item;
+		EVENT(bf, on_section_begin)(bf->events_data, bf->cur_instrument, item); 
+		break;
+	case PTB_CLASS_STAFF: 
+		bf->cur_staff = item;
+		EVENT(bf, on_staff)(bf->events_data, bf->cur_section, item); 
+		break;
+	case PTB_CLASS_POSITION: 
+		bf->cur_position = item;
+		EVENT(bf, on_position)(bf->events_data, bf->cur_staff, bf->cur_voice, item); 
+		break;
+	default: 
+		ptb_assert(bf, 0);
+		break;
+	}
+}
+
+/* Called once an item has been read completely */
+static void ptb_event_end(struct ptbf *bf, enum ptb_class cls, void *item)
+{
+	void *data = bf->events_data;
+	int instrument = bf->cur_instrument;
+
+	switch (cls) {
+	case PTB_CLASS_GUITAR: EVENT(bf, on_guitar)(data, instrument, item); break;
+	case PTB_CLASS_CHORDDIAGRAM: EVENT(bf, on_chorddiagram)(data, instrument, item); break;
+	case PTB_CLASS_FLOATINGTEXT: EVENT(bf, on_floatingtext)(data, instrument, item); break;
+	case PTB_CLASS_GUITARIN: EVENT(bf, on_guitarin)(data, instrument, item); break;
+	case PTB_CLASS_TEMPOMARKER: EVENT(bf, on_tempomarker)(data, instrument, item); break;
+	case PTB_CLASS_DYNAMIC: EVENT(bf, on_dynamic)(data, instrument, item); break;
+	case PTB_CLASS_SECTIONSYMBOL: EVENT(bf, on_sectionsymbol)(data, instrument, item); break;
+	case PTB_CLASS_SECTION: EVENT(bf, on_section_end)(data, instrument, item); break;
+	case PTB_CLASS_DIRECTION: EVENT(bf, on_direction)(data, bf->cur_section, item); break;
+	case PTB_CLASS_CHORDTEXT: EVENT(bf, on_chordtext)(data, bf->cur_section, item); break;
+	case PTB_CLASS_RHYTHMSLASH: EVENT(bf, on_rhythmslash)(data, bf->cur_section, item); break;
+	case PTB_CLASS_MUSICBAR: EVENT(bf, on_musicbar)(data, bf->cur_section, item); break;
+	case PTB_CLASS_LINEDATA: EVENT(bf, on_linedata)(data, bf->cur_position, item); break;
+	default: break; /* Staffs and positions were reported by ptb_event_begin() */
 	}
+}
 
-	if(!ptb_section_handlers[i].handler) {
-		fprintf(stderr, "Unable to find handler for section %s\n", assumed_type);
+/* Skip over n bytes, returning the byte at offset peek first */
+static int ptb_skip(struct ptbf *bf, size_t n, size_t peek, uint8_t *peeked)
+{
+	if (bf->curpos + n > bf->length) {
+		ptb_error(bf, "Expected skip of %d bytes, only %d left", n, bf->length - bf->curpos);
 		return 0;
 	}
+	if (peeked) *peeked = bf->data[bf->curpos + peek];
+	bf->curpos += n;
+	return 1;
+}
+
+/* Positions and line data make up the bulk of a file and have a simple 
+ * layout, so they can be skipped without decoding them */
+static int ptb_skip_items(struct ptbf *bf, enum ptb_class cls)
+{
+	uint16_t l, nr_items;
+	uint8_t n;
+
+	if (ptb_data_uint16(bf, &nr_items) < 2) return 0;
+
+	for (l = 0; l < nr_items; l++) {
+		if (!ptb_read_class_tag(bf, cls)) 
+			return 0;
+
+		switch (cls) {
+		case PTB_CLASS_POSITION:
+			/* Everything up to nr_additional_data */
+			if (!ptb_skip(bf, 8, 7, &n)) return 0;
+			if (!ptb_skip(bf, 4 * n, 0, NULL)) return 0;
+			if (!ptb_skip_items(bf, PTB_CLASS_LINEDATA)) return 0;
+			break;
+		case PTB_CLASS_LINEDATA:
+			/* Everything up to conn_to_next */
+			if (!ptb_skip(bf, 4, 3, &n)) return 0;
+			if (!ptb_skip(bf, 4 * n, 0, NULL)) return 0;
+			break;
+		default:
+			ptb_assert(bf, 0);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int ptb_read_items(struct ptbf *bf, enum ptb_class cls, struct ptb_list **result) {
+	const struct ptb_section_handler *h = &ptb_section_handlers[cls];
+	struct ptb_list *last = NULL;
+	uint16_t l;
+	uint16_t nr_items;
+	int ret = 0;
+
+	*result = NULL;
+
+	if (bf->skipping && cls == PTB_CLASS_POSITION) 
+		return ptb_skip_items(bf, cls);
+
+	ret+=ptb_data_uint16(bf, &nr_items);	
+	if(ret == 0 || nr_items == 0x0) return 1; 
+
+	ptb_debug(bf, "Going to read %d items", nr_items);
 
 	for(l = 0; l < nr_items; l++) {
 		struct ptb_list *item;
-		int ret;
-		uint16_t next_thing;
+		off_t start = bf->curpos, nested = bf->nested_bytes;
+
+		bf->nested_bytes = 0;
 
-		ptb_debug("%04x ============= Handling %s (%d of %d) =============", bf->curpos, assumed_type, l+1, nr_items);
-		debug_level++;
+		if (!ptb_read_class_tag(bf, cls)) 
+			return 0;
+
+		ptb_debug(bf, "%04x ============= Handling %s (%d of %d) =============", bf->curpos, h->name, l+1, nr_items);
+		bf->debug_level++;
 		item = NULL;
-		ret = ptb_section_handlers[i].handler(bf, ptb_section_handlers[i].name, (struct ptb_list **)&item);
+		ret = h->handler(bf, h->name, (struct ptb_list **)&item);
 		if (!ret) item = NULL;
-		debug_level--;
+		bf->debug_level--;
 
-		ptb_debug("%04x ============= END Handling %s (%d of %d) =============", bf->curpos, ptb_section_handlers[i].name, l+1, nr_items);
+		ptb_count_item(bf, cls, start, nested);
 
-		if(!item) {
-			fprintf(stderr, "Error parsing section '%s'\n", ptb_section_handlers[i].name);
+		ptb_debug(bf, "%04x ============= END Handling %s (%d of %d) =============", bf->curpos, h->name, l+1, nr_items);
+
+		if (bf->out_of_memory) {
+			return 0;
+		} else if(!item) {
+			fprintf(stderr, "Error parsing section '%s'\n", h->name);
+		} else if (bf->events) {
+			ptb_event_end(bf, cls, item);
+			/* Nothing in a top-level item is needed after it has been 
+			 * handled */
+			if (bf->debug_level == 0) ptb_arena_reset(bf->arena);
 		} else {
-			DLIST_ADD_END((*result), item, struct ptb_list *);
-		}
-		
-		if(l < nr_items - 1) {
-			ret+=ptb_data_uint16(bf, &next_thing);
-			if(!(next_thing & 0x8000)) {
-				ptb_error("Warning: got %04x, expected | 0x8000\n", next_thing);
-				ptb_assert(bf, 0);
-			}
+			DLIST_ADD_AFTER((*result), item, last);
+			last = item;
 		}
 	}
 
 	return 1;
 }
 
-static int generate_header_id(struct ptbf *bf, const char *assumed_type)
-{
-	static int i = 0;
-	/* FIXME */
-	return ++i;
-}
-
-static int ptb_write_items(struct ptbf *bf, const char *assumed_type, struct ptb_list **result) 
+static int ptb_write_items(struct ptbf *bf, enum ptb_class cls, struct ptb_list **result) 
 {
-	int i;
-	uint16_t length;
-	uint16_t header;
-	uint16_t id = 0x20;
+	const struct ptb_section_handler *h = &ptb_section_handlers[cls];
 	uint16_t nr_items;
 	struct ptb_list *gl;
 	int ret = 0;
@@ -474,90 +736,256 @@ static int ptb_write_items(struct ptbf *bf, const char *assumed_type, struct ptb
 	ret+=ptb_data_uint16(bf, &nr_items);	
 	if(nr_items == 0x0) return 1; 
 
-	header = generate_header_id(bf, assumed_type);
-	if (header == 0) header = 0xffff;
+	ptb_debug(bf, "Going to write %d items", nr_items);
 
-	ret+=ptb_data_uint16(bf, &header);
+	for (gl = *result; gl; gl = gl->next) {
+		ptb_write_class_tag(bf, cls);
 
-	ptb_debug("Going to write %d items", nr_items);
+		bf->debug_level++;
+		h->handler(bf, h->name, (struct ptb_list **)&gl);
+		bf->debug_level--;
+	}
 
-	if (header == 0xffff) {
-		uint16_t unknownval = 0x0001; /* FIXME */
+	return 1;
+}
 
-		ret+=ptb_data_uint16(bf, &unknownval);
-		length = strlen(assumed_type);
-		ret+=ptb_data_uint16(bf, &length);
-		ret+=ptb_data(bf, (void *)assumed_type, length);
+static int ptb_data_items(struct ptbf *bf, enum ptb_class cls, struct ptb_list **result)
+{
+	switch (bf->mode) {
+	case O_RDONLY: return ptb_read_items(bf, cls, result);
+	case O_WRONLY: return ptb_write_items(bf, cls, result);
+	default: ptb_assert(bf, 0);
 	}
+	return 0;
+}
 
 
-	for(i = 0; ptb_section_handlers[i].name; i++) {
-		if(!strcmp(ptb_section_handlers[i].name, assumed_type)) {
-			break;
-		}
+
+void ptb_init_parse_options(struct ptb_parse_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->error_fn = default_error_fn;
+}
+
+/* Options used by the calls that don't take any. The ptb_set_*() 
+ * functions write them without any locking, so they must not be called 
+ * while other threads are reading or writing files; threaded callers 
+ * should pass their own options to the _ex() functions instead. */
+static struct ptb_parse_options default_options = { 0, 0, 0, 0, 0, default_error_fn };
+
+void ptb_set_debug(int level) { default_options.debug = level; }
+
+void ptb_set_asserts_fatal(int y) { default_options.asserts_fatal = y; }
+
+void ptb_set_arena(int y) { default_options.use_arena = y; }
+
+void ptb_set_error_fn(void (*fn) (const char *, va_list)) { default_options.error_fn = fn; }
+
+static void ptb_set_options(struct ptbf *bf, const struct ptb_parse_options *opts)
+{
+	int i;
+
+	if (opts) 
+		bf->options = *opts;
+	else 
+		ptb_init_parse_options(&bf->options);
+
+	if (bf->options.stats && !bf->stats) {
+		bf->stats = mem_p(&bf->allocator, struct ptb_stats, 1);
+		for (i = 0; bf->stats && i < PTB_CLASS_MAX; i++) 
+			bf->stats->classes[i].name = ptb_section_handlers[i].name;
 	}
+}
 
-	if(!ptb_section_handlers[i].handler) {
-		fprintf(stderr, "Unable to find handler for section %s\n", assumed_type);
+/* A new document for reading, allocated with the allocator from opts */
+static struct ptbf *ptb_new(const struct ptb_parse_options *opts)
+{
+	const struct ptb_allocator *a = ptb_allocator(opts?opts->allocator:NULL);
+	struct ptbf *bf = mem_p(a, struct ptbf, 1);
+
+	if (bf == NULL) 
+		return NULL;
+
+	bf->allocator = *a;
+	ptb_set_options(bf, opts);
+	bf->mode = O_RDONLY;
+	bf->fd = -1;
+	return bf;
+}
+
+const struct ptb_stats *ptb_get_stats(struct ptbf *bf)
+{
+	return bf->stats;
+}
+
+/* Record where each section starts, without keeping any of them. This 
+ * still has to decode the sections, as their length is not stored. */
+static int ptb_index_sections(struct ptbf *bf, int i)
+{
+	const struct ptb_section_handler *h = &ptb_section_handlers[PTB_CLASS_SECTION];
+	struct ptb_section_index *index;
+	struct ptb_arena *arena = bf->arena;
+	uint16_t l, nr_items;
+
+	if (ptb_data_uint16(bf, &nr_items) < 2 || nr_items == 0) 
+		return 1;
+
+	index = ptb_alloc(bf, struct ptb_section_index, nr_items);
+	if (index == NULL) 
+		return 0;
+	bf->instrument[i].section_index = index;
+	bf->instrument[i].nr_sections = nr_items;
+
+	/* Anything decoded now is thrown away straight after */
+	bf->arena = ptb_arena_new(&bf->allocator);
+	if (bf->arena == NULL) {
+		ptb_error(bf, "Out of memory");
+		bf->out_of_memory = 1;
+		bf->arena = arena;
 		return 0;
 	}
+	bf->skipping = 1;
 
-	gl = *result;
-	while(gl) 
-	{
-		debug_level++;
-		ptb_section_handlers[i].handler(bf, ptb_section_handlers[i].name, (struct ptb_list **)&gl);
-		debug_level--;
+	for (l = 0; l < nr_items; l++) {
+		struct ptb_list *item = NULL;
 
-		if(gl->next) {
-			ret+=ptb_data_uint16(bf, &id);
-		}
-		gl = gl->next;
+		if (!ptb_read_class_tag(bf, PTB_CLASS_SECTION)) 
+			break;
+
+		index[l].offset = bf->curpos;
+		index[l].map_count = bf->map_count;
+
+		bf->debug_level++;
+		if (!h->handler(bf, h->name, &item)) 
+			fprintf(stderr, "Error parsing section '%s'\n", h->name);
+		bf->debug_level--;
+
+		ptb_arena_reset(bf->arena);
 	}
 
-	return 1;
+	ptb_arena_free(bf->arena);
+	bf->arena = arena;
+	bf->skipping = 0;
 
+	return (l == nr_items);
 }
 
-static int ptb_data_items(struct ptbf *bf, const char *assumed_type, struct ptb_list **result)
+struct ptb_section *ptb_get_section(struct ptbf *bf, int instrument, int n)
 {
-	switch (bf->mode) {
-	case O_RDONLY: return ptb_read_items(bf, assumed_type, result);
-	case O_WRONLY: return ptb_write_items(bf, assumed_type, result);
-	default: ptb_assert(bf, 0);
+	const struct ptb_section_handler *h = &ptb_section_handlers[PTB_CLASS_SECTION];
+	struct ptb_instrument *ins = &bf->instrument[instrument];
+	struct ptb_section_index *index;
+	struct ptb_section *section;
+	struct ptb_list *item = NULL;
+
+	if (n < 0) 
+		return NULL;
+
+	if (ins->section_index == NULL || ins->sections != NULL) {
+		for (section = ins->sections; section && n > 0; section = section->next) n--;
+		return section;
+	}
+
+	if (n >= ins->nr_sections) 
+		return NULL;
+
+	index = &ins->section_index[n];
+	if (index->section) 
+		return index->section;
+
+	/* The class ids seen during the first pass are still valid, only 
+	 * the archive map count has to be restored */
+	bf->curpos = index->offset;
+	bf->map_count = index->map_count;
+	bf->cur_instrument = instrument;
+	bf->nested_bytes = 0;
+
+	if (h->handler(bf, h->name, &item)) 
+		index->section = (struct ptb_section *)item;
+
+	/* The class tag was read during the first pass */
+	ptb_count_item(bf, PTB_CLASS_SECTION, index->offset, 0);
+
+	return index->section;
+}
+
+/* Make sure all lazily read sections are decoded and in the sections list */
+static void ptb_link_sections(struct ptbf *bf)
+{
+	int i, n;
+
+	for (i = 0; i < 2; i++) {
+		struct ptb_instrument *ins = &bf->instrument[i];
+		struct ptb_section *sections = NULL, *last = NULL;
+
+		if (ins->section_index == NULL || ins->sections != NULL) 
+			continue;
+
+		for (n = 0; n < ins->nr_sections; n++) {
+			struct ptb_section *section = ptb_get_section(bf, i, n);
+			if (!section) continue;
+			DLIST_ADD_AFTER(sections, section, last);
+			last = section;
+		}
+
+		ins->sections = sections;
 	}
-	return 0;
 }
 
+/* One of the lists of an instrument, timed if statistics are kept */
+static void ptb_data_list(struct ptbf *bf, int i, enum ptb_class cls, void *list)
+{
+	double start = 0;
 
+	if (ptb_stats_active(bf)) start = ptb_time();
 
-void ptb_set_debug(int level) { debugging = level; }
+	if (cls == PTB_CLASS_SECTION && bf->mode == O_RDONLY && 
+		bf->options.lazy_sections && !bf->events) 
+		ptb_index_sections(bf, i);
+	else 
+		ptb_data_items(bf, cls, (struct ptb_list **)list);
 
-void ptb_set_asserts_fatal(int y) { assert_is_fatal = y; }
+	if (ptb_stats_active(bf)) bf->stats->list_time[i][cls] += ptb_time() - start;
+}
 
 static void ptb_data_instrument(struct ptbf *bf, int i)
 {
-	ptb_data_items(bf, "CGuitar", (struct ptb_list **)&bf->instrument[i].guitars);
-	ptb_data_items(bf, "CChordDiagram",(struct ptb_list **) &bf->instrument[i].chorddiagrams);
-	ptb_data_items(bf, "CFloatingText",(struct ptb_list **) &bf->instrument[i].floatingtexts);
-	ptb_data_items(bf, "CGuitarIn",(struct ptb_list **) &bf->instrument[i].guitarins);
-	ptb_data_items(bf, "CTempoMarker", (struct ptb_list **)&bf->instrument[i].tempomarkers);
-	ptb_data_items(bf, "CDynamic", (struct ptb_list **)&bf->instrument[i].dynamics);
-	ptb_data_items(bf, "CSectionSymbol", (struct ptb_list **)&bf->instrument[i].sectionsymbols);
-	ptb_data_items(bf, "CSection", (struct ptb_list **)&bf->instrument[i].sections);
+	ptb_data_list(bf, i, PTB_CLASS_GUITAR, &bf->instrument[i].guitars);
+	ptb_data_list(bf, i, PTB_CLASS_CHORDDIAGRAM, &bf->instrument[i].chorddiagrams);
+	ptb_data_list(bf, i, PTB_CLASS_FLOATINGTEXT, &bf->instrument[i].floatingtexts);
+	ptb_data_list(bf, i, PTB_CLASS_GUITARIN, &bf->instrument[i].guitarins);
+	ptb_data_list(bf, i, PTB_CLASS_TEMPOMARKER, &bf->instrument[i].tempomarkers);
+	ptb_data_list(bf, i, PTB_CLASS_DYNAMIC, &bf->instrument[i].dynamics);
+	ptb_data_list(bf, i, PTB_CLASS_SECTIONSYMBOL, &bf->instrument[i].sectionsymbols);
+	ptb_data_list(bf, i, PTB_CLASS_SECTION, &bf->instrument[i].sections);
 }
 
 static ssize_t ptb_data_file(struct ptbf *bf)
 {
+	double start = 0;
 	int i;
+
+	if (ptb_stats_active(bf)) start = ptb_time();
+
+	/* Class ids are per file */
+	memset(bf->class_index, 0, sizeof(bf->class_index));
+	bf->map_count = 1;
+
 	if(ptb_data_header(bf, &bf->hdr) < 0) {
 		fprintf(stderr, "Error parsing header\n");	
 		return -1;
-	} else if(debugging) {
-		fprintf(stderr, "Header parsed correctly\n");
+	} else {
+		ptb_debug(bf, "Header parsed correctly");
+	}
+
+	if (bf->events) {
+		EVENT(bf, on_header)(bf->events_data, &bf->hdr);
+		ptb_arena_reset(bf->arena);
+		memset(&bf->hdr, 0, sizeof(bf->hdr));
 	}
 
 	for(i = 0; i < 2; i++) {
+		bf->cur_instrument = i;
 		ptb_data_instrument(bf, i);
 	}
 
@@ -568,516 +996,2095 @@ static ssize_t ptb_data_file(struct ptbf *bf)
 	ptb_data_uint32(bf, &bf->staff_line_space);
 	ptb_data_uint32(bf, &bf->fade_in);
 	ptb_data_uint32(bf, &bf->fade_out);
+
+	if (ptb_stats_active(bf)) bf->stats->time += ptb_time() - start;
 	return 0;
 }
 
-struct ptbf *ptb_read_mem(const char *data, size_t length)
+/* Load the complete contents of fd into memory, preferably by mapping it */
+static int ptb_load_data(struct ptbf *bf, int fd)
 {
-	struct ptbf *bf = malloc_p(struct ptbf, 1);
-
-	bf->mode = O_RDONLY;
-	bf->filename = NULL;
-	bf->curpos = 1;
-	if (ptb_data_file(bf) == -1) 
-		return NULL;
+	int ret = ptb_mem_load(&bf->allocator, fd, &bf->data, &bf->length, &bf->data_source);
 
-	close(bf->fd);
-	return bf;
+	if (ret == -1) 
+		perror("read");
+	return (ret == 0)?0:-1;
 }
 
-struct ptbf *ptb_read_file(const char *file)
+static void ptb_release_data(struct ptbf *bf)
 {
-	struct ptbf *bf = malloc_p(struct ptbf, 1);
+	ptb_mem_unload(&bf->allocator, bf->data, bf->length, bf->data_source);
 
-	bf->mode = O_RDONLY;
-	bf->fd = open(file, bf->mode
-#ifdef O_BINARY
-				  | O_BINARY
-#endif
-				  );
+	bf->data = NULL;
+	bf->length = 0;
+	bf->data_source = PTB_DATA_NONE;
+}
+
+struct ptbf *ptb_read_mem_ex(const char *data, size_t length, const struct ptb_parse_options *opts)
+{
+	struct ptbf *bf = ptb_new(opts);
 
-	bf->filename = strdup(file);
+	if (bf == NULL) 
+		return NULL;
 
-	if(bf->fd < 0) return NULL;
+	if (bf->options.use_arena) bf->arena = ptb_arena_new(&bf->allocator);
 
-	bf->curpos = 1;
+	/* The buffer is owned by the caller and is parsed in place */
+	bf->data = (char *)data;
+	bf->length = length;
+	bf->data_source = PTB_DATA_NONE;
+	bf->curpos = 0;
 
-	if (ptb_data_file(bf) == -1) 
+	if (ptb_data_file(bf) == -1 || bf->out_of_memory) {
+		ptb_free(bf);
 		return NULL;
+	}
 
-	close(bf->fd);
+	/* Still needed to decode the sections later on */
+	if (!bf->options.lazy_sections) 
+		ptb_release_data(bf);
 	return bf;
 }
 
-int ptb_write_file(const char *file, struct ptbf *bf)
+struct ptbf *ptb_read_mem(const char *data, size_t length)
 {
-	bf->mode = O_WRONLY;
-	bf->fd = creat(file, 0644);
-
-	bf->filename = strdup(file);
+	return ptb_read_mem_ex(data, length, &default_options);
+}
 
-	if(bf->fd < 0) return -1;
+/* Open file (or standard input for "-") and load its contents */
+static int ptb_load_file(struct ptbf *bf, const char *file)
+{
+	int ret;
 
-	bf->curpos = 1;
+	if (!strcmp(file, "-")) {
+		/* Standard input, which may well be a pipe */
+		bf->fd = 0;
+#ifdef _WIN32
+		_setmode(bf->fd, _O_BINARY);
+#endif
+	} else {
+		bf->fd = open(file, O_RDONLY
+#ifdef O_BINARY
+					  | O_BINARY
+#endif
+					  );
+	}
 
-	if (ptb_data_file(bf) == -1) 
+	if(bf->fd < 0) 
 		return -1;
 
-	close(bf->fd);
-	return 0;
-}
+	bf->filename = ptb_mem_strdup(&bf->allocator, file);
+
+	ret = ptb_load_data(bf, bf->fd);
 
-static int handle_unknown (struct ptbf *bf, const char *section, struct ptb_list **dest) {
-	fprintf(stderr, "Unknown section '%s'\n", section);	
-	return 1; 
+	if (bf->fd != 0) close(bf->fd);
+	bf->fd = -1;
+	bf->curpos = 0;
+
+	return ret;
 }
 
-static int handle_CGuitar (struct ptbf *bf, const char *section, struct ptb_list **dest) {
-	struct ptb_guitar *guitar = GET_ITEM(bf, dest, struct ptb_guitar);
+struct ptbf *ptb_read_file_ex(const char *file, const struct ptb_parse_options *opts)
+{
+	struct ptbf *bf = ptb_new(opts);
 
-	ptb_data_uint8(bf, &guitar->index);
-	ptb_data_string(bf, &guitar->title);
+	if (bf == NULL) 
+		return NULL;
 
-	ptb_data_uint8(bf, &guitar->midi_instrument);
-	ptb_data_uint8(bf, &guitar->initial_volume);
+	if (ptb_load_file(bf, file) < 0) {
+		ptb_free(bf);
+		return NULL;
+	}
+
+	if (bf->options.use_arena) bf->arena = ptb_arena_new(&bf->allocator);
+
+	if (ptb_data_file(bf) == -1 || bf->out_of_memory) {
+		ptb_free(bf);
+		return NULL;
+	}
+
+	/* Still needed to decode the sections later on */
+	if (!bf->options.lazy_sections) 
+		ptb_release_data(bf);
+	return bf;
+}
+
+struct ptbf *ptb_read_file(const char *file)
+{
+	return ptb_read_file_ex(file, &default_options);
+}
+
+/* Everything decoded while streaming comes from an arena that is reset 
+ * after each top-level item */
+static int ptb_parse(struct ptbf *bf, const struct ptb_events *events, void *data)
+{
+	int ret;
+
+	bf->events = events;
+	bf->events_data = data;
+	if (bf->arena == NULL) bf->arena = ptb_arena_new(&bf->allocator);
+	if (bf->arena == NULL) {
+		ptb_free(bf);
+		return -1;
+	}
+
+	ret = ptb_data_file(bf);
+	if (bf->out_of_memory) ret = -1;
+
+	ptb_free(bf);
+	return (ret == -1)?-1:0;
+}
+
+int ptb_parse_mem(const char *buf, size_t length, const struct ptb_events *events, void *data, const struct ptb_parse_options *opts)
+{
+	struct ptbf *bf = ptb_new(opts);
+
+	if (bf == NULL) 
+		return -1;
+
+	bf->data = (char *)buf;
+	bf->length = length;
+	bf->data_source = PTB_DATA_NONE;
+
+	return ptb_parse(bf, events, data);
+}
+
+int ptb_parse_file(const char *file, const struct ptb_events *events, void *data, const struct ptb_parse_options *opts)
+{
+	struct ptbf *bf = ptb_new(opts);
+
+	if (bf == NULL) 
+		return -1;
+
+	if (ptb_load_file(bf, file) < 0) {
+		ptb_free(bf);
+		return -1;
+	}
+
+	return ptb_parse(bf, events, data);
+}
+
+/* Serialize bf into a buffer of exactly the right size: a sizing pass 
+ * followed by the actual encoding pass */
+static char *ptb_encode(struct ptbf *bf, size_t *length, const struct ptb_parse_options *opts)
+{
+	const struct ptb_allocator *a = ptb_allocator(opts?opts->allocator:NULL);
+	struct ptb_parse_options oldoptions = bf->options;
+	int oldmode = bf->mode;
+	char *olddata = bf->data;
+	size_t oldlength = bf->length;
+	char *data = NULL;
+
+	ptb_link_sections(bf);
+
+	ptb_set_options(bf, opts);
+	bf->mode = O_WRONLY;
+	bf->data = NULL;
+	bf->curpos = 0;
+
+	if (ptb_data_file(bf) == -1) 
+		goto out;
+
+	bf->length = bf->curpos;
+	bf->data = mem_p(a, char, bf->length);
+	if (bf->data == NULL) 
+		goto out;
+	bf->curpos = 0;
+
+	if (ptb_data_file(bf) == -1) {
+		ptb_mem_free(a, bf->data);
+		goto out;
+	}
+
+	ptb_assert(bf, bf->curpos == bf->length);
+
+	data = bf->data;
+	*length = bf->length;
+
+out:
+	/* Lazily read documents keep their input around */
+	bf->data = olddata;
+	bf->length = oldlength;
+	bf->mode = oldmode;
+	bf->options = oldoptions;
+	return data;
+}
+
+char *ptb_write_mem_ex(struct ptbf *bf, size_t *length, const struct ptb_parse_options *opts)
+{
+	return ptb_encode(bf, length, opts);
+}
+
+char *ptb_write_mem(struct ptbf *bf, size_t *length)
+{
+	return ptb_encode(bf, length, &default_options);
+}
+
+/* Write data to file, or leave file untouched if that fails */
+static int ptb_write_atomic(const struct ptb_allocator *a, const char *file, const char *data, size_t length)
+{
+	char *tmpfile;
+	size_t done = 0;
+	ssize_t ret;
+	int fd = -1, i;
+
+	/* Write to a temporary file next to the destination and move it 
+	 * into place afterwards, so the destination is never left half-written */
+	tmpfile = mem_p(a, char, strlen(file) + 20);
+	if (tmpfile == NULL) 
+		return -1;
+
+	for (i = 0; fd < 0 && i < 100; i++) {
+		sprintf(tmpfile, "%s.tmp%d", file, i);
+		fd = open(tmpfile, O_WRONLY | O_CREAT | O_EXCL
+#ifdef O_BINARY
+				  | O_BINARY
+#endif
+				  , 0644);
+	}
+
+	if (fd < 0) {
+		ptb_mem_free(a, tmpfile);
+		return -1;
+	}
+
+	while (done < length) {
+		ret = write(fd, data + done, length - done);
+		if (ret <= 0) {
+			perror("write");
+			break;
+		}
+		done += ret;
+	}
+
+#ifdef HAVE_FSYNC
+	if (done == length && fsync(fd) < 0) {
+		perror("fsync");
+		done = 0;
+	}
+#endif
+
+	if (close(fd) < 0 || done != length) {
+		unlink(tmpfile);
+		ptb_mem_free(a, tmpfile);
+		return -1;
+	}
+
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	unlink(file);
+#endif
+
+	if (rename(tmpfile, file) < 0) {
+		perror("rename");
+		unlink(tmpfile);
+		ptb_mem_free(a, tmpfile);
+		return -1;
+	}
+
+	ptb_mem_free(a, tmpfile);
+	return 0;
+}
+
+int ptb_write_file_ex(const char *file, struct ptbf *bf, const struct ptb_parse_options *opts)
+{
+	const struct ptb_allocator *a = ptb_allocator(opts?opts->allocator:NULL);
+	char *data;
+	size_t length;
+	int ret;
+
+	data = ptb_encode(bf, &length, opts);
+	if (data == NULL) 
+		return -1;
+
+	ret = ptb_write_atomic(a, file, data, length);
+	ptb_mem_free(a, data);
+	if (ret < 0) 
+		return -1;
+
+	ptb_mem_free(&bf->allocator, bf->filename);
+	bf->filename = ptb_mem_strdup(&bf->allocator, file);
+
+	return 0;
+}
+
+int ptb_write_file(const char *file, struct ptbf *bf)
+{
+	return ptb_write_file_ex(file, bf, &default_options);
+}
+
+/* Cache images: a copy of a document that can be mapped and used as is. 
+ * Pointers are stored as if the image was mapped at base, and the 
+ * fixup table lists where they are so they can be adjusted when it 
+ * ends up somewhere else. */
+#define PTB_CACHE_MAGIC		"PTBCACHE"
+#define PTB_CACHE_VERSION	2
+#define PTB_CACHE_ALIGN		8
+
+#if defined(UINTPTR_MAX) && UINTPTR_MAX > 0xffffffffUL
+#  define PTB_CACHE_BASE	((uintptr_t)0x200000000000ULL)
+#else
+#  define PTB_CACHE_BASE	((uintptr_t)0)
+#endif
+
+struct ptb_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t layout; /* Changes with the size of the structures */
+	uint32_t checksum; /* Of the header */
+	uint32_t body_checksum; /* Of everything after the header */
+	uint32_t source_mtime_nsec;
+	uint64_t base;
+	uint64_t size;
+	uint64_t root;
+	uint64_t fixups;
+	uint64_t nr_fixups;
+	uint64_t source_size;
+	uint64_t source_mtime;
+};
+
+struct ptb_cache_writer {
+	char *buf;
+	size_t size, allocated;
+	char *strings;
+	size_t strings_size, strings_allocated;
+	struct ptb_cache_strref { uint64_t field, offset; } *strrefs;
+	size_t nr_strrefs, strrefs_allocated;
+	uint32_t *fixups;
+	size_t nr_fixups, fixups_allocated;
+	int failed;
+	const struct ptb_allocator *allocator;
+};
+
+#define CACHE_FIELD(off, type, field) ((off) + offsetof(type, field))
+
+static uint32_t ptb_cache_checksum(uint32_t sum, const void *data, size_t length)
+{
+	const unsigned char *p = data;
+	/* FNV-1a */
+	while (length--) {
+		sum ^= *p++;
+		sum *= 16777619;
+	}
+	return sum;
+}
+
+/* Modification times are only compared, so platforms without 
+ * nanoseconds just compare seconds */
+static uint32_t ptb_mtime_nsec(const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	return st->st_mtim.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+static uint32_t ptb_cache_layout(void)
+{
+	uint32_t sizes[] = { 
+		sizeof(struct ptb_cache_hdr), 
+		sizeof(void *), sizeof(struct ptbf), sizeof(struct ptb_hdr), 
+		sizeof(struct ptb_guitar), sizeof(struct ptb_chorddiagram), 
+		sizeof(struct ptb_floatingtext), sizeof(struct ptb_guitarin), 
+		sizeof(struct ptb_tempomarker), sizeof(struct ptb_dynamic), 
+		sizeof(struct ptb_sectionsymbol), sizeof(struct ptb_section), 
+		sizeof(struct ptb_staff), sizeof(struct ptb_position), 
+		sizeof(struct ptb_linedata), sizeof(struct ptb_chordtext), 
+		sizeof(struct ptb_rhythmslash), sizeof(struct ptb_direction), 
+		sizeof(struct ptb_musicbar)
+	};
+	return ptb_cache_checksum(2166136261U, sizes, sizeof(sizes));
+}
+
+static int ptb_cache_grow(struct ptb_cache_writer *w, void *ptr, size_t *allocated, size_t needed, size_t elsize)
+{
+	void **p = ptr;
+	size_t n = *allocated?*allocated:0x1000;
+	void *newp;
+
+	if (needed <= *allocated) return 1;
+	while (n < needed) n *= 2;
+
+	newp = ptb_mem_realloc(w->allocator, *p, n * elsize);
+	if (newp == NULL) {
+		w->failed = 1;
+		return 0;
+	}
+	*p = newp;
+	*allocated = n;
+	return 1;
+}
+
+static uint64_t ptb_cache_copy(struct ptb_cache_writer *w, const void *src, size_t size)
+{
+	uint64_t off = (w->size + PTB_CACHE_ALIGN - 1) & ~(uint64_t)(PTB_CACHE_ALIGN - 1);
+
+	if (!ptb_cache_grow(w, &w->buf, &w->allocated, off + size, 1)) 
+		return 0;
+
+	memset(w->buf + w->size, 0, off - w->size);
+	memcpy(w->buf + off, src, size);
+	w->size = off + size;
+	return off;
+}
+
+/* Point the pointer at offset field to offset target (0 for NULL) */
+static void ptb_cache_set_ptr(struct ptb_cache_writer *w, uint64_t field, uint64_t target)
+{
+	void *ptr = NULL;
+
+	if (target) {
+		if (!ptb_cache_grow(w, &w->fixups, &w->fixups_allocated, w->nr_fixups + 1, sizeof(uint32_t))) 
+			return;
+		w->fixups[w->nr_fixups++] = field;
+		ptr = (void *)(PTB_CACHE_BASE + (uintptr_t)target);
+	}
+
+	memcpy(w->buf + field, &ptr, sizeof(ptr));
+}
+
+static void ptb_cache_set_blob(struct ptb_cache_writer *w, uint64_t field, const void *src, size_t size)
+{
+	uint64_t target = 0;
+	if (src && size) target = ptb_cache_copy(w, src, size);
+	ptb_cache_set_ptr(w, field, target);
+}
+
+/* Strings go in a table at the end of the image, their pointers 
+ * are filled in once it is known where that is */
+static void ptb_cache_set_string(struct ptb_cache_writer *w, uint64_t field, const char *str)
+{
+	size_t len;
+
+	ptb_cache_set_ptr(w, field, 0);
+	if (str == NULL) return;
+
+	len = strlen(str) + 1;
+	if (!ptb_cache_grow(w, &w->strings, &w->strings_allocated, w->strings_size + len, 1) ||
+		!ptb_cache_grow(w, &w->strrefs, &w->strrefs_allocated, w->nr_strrefs + 1, sizeof(struct ptb_cache_strref))) 
+		return;
+
+	w->strrefs[w->nr_strrefs].field = field;
+	w->strrefs[w->nr_strrefs].offset = w->strings_size;
+	w->nr_strrefs++;
+	memcpy(w->strings + w->strings_size, str, len);
+	w->strings_size += len;
+}
+
+typedef void (*ptb_cache_fn) (struct ptb_cache_writer *, uint64_t off, const void *item);
+
+/* Copy a list, returning the offset of its first item */
+static uint64_t ptb_cache_list(struct ptb_cache_writer *w, const void *first, size_t size, ptb_cache_fn fn)
+{
+	const struct ptb_list *l;
+	uint64_t ret = 0, prev = 0, off;
+
+	for (l = first; l && !w->failed; l = l->next) {
+		off = ptb_cache_copy(w, l, size);
+		if (w->failed) break;
+
+		ptb_cache_set_ptr(w, CACHE_FIELD(off, struct ptb_list, prev), prev);
+		ptb_cache_set_ptr(w, CACHE_FIELD(off, struct ptb_list, next), 0);
+		if (prev) 
+			ptb_cache_set_ptr(w, CACHE_FIELD(prev, struct ptb_list, next), off);
+		else 
+			ret = off;
+
+		if (fn) fn(w, off, l);
+		prev = off;
+	}
+
+	return ret;
+}
+
+#define CACHE_LIST(w, off, type, field, item, fn) \
+	ptb_cache_set_ptr(w, CACHE_FIELD(off, type, field), \
+		ptb_cache_list(w, (item)->field, sizeof(*(item)->field), fn))
+
+static void ptb_cache_linedata(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_linedata *ld = item;
+	ptb_cache_set_blob(w, CACHE_FIELD(off, struct ptb_linedata, bends), ld->bends, sizeof(struct ptb_bend) * ld->conn_to_next);
+}
+
+static void ptb_cache_position(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_position *pos = item;
+	ptb_cache_set_blob(w, CACHE_FIELD(off, struct ptb_position, additional), pos->additional, 
+					   sizeof(struct ptb_position_additional) * pos->nr_additional_data);
+	CACHE_LIST(w, off, struct ptb_position, linedatas, pos, ptb_cache_linedata);
+}
+
+/* Offset of what the pointer at offset field points to, 0 for NULL */
+static uint64_t ptb_cache_get_ptr(struct ptb_cache_writer *w, uint64_t field)
+{
+	void *ptr;
+	memcpy(&ptr, w->buf + field, sizeof(ptr));
+	return ptr?(uintptr_t)ptr - PTB_CACHE_BASE:0;
+}
+
+/* The index points at the copies of the positions, so this has to 
+ * happen after they have been copied */
+static void ptb_cache_staff_index(struct ptb_cache_writer *w, uint64_t off, const struct ptb_staff *staff)
+{
+	const struct ptb_staff_index *idx = staff->index;
+	uint64_t ioff, pos;
+	size_t n, i;
+	int v;
+
+	ptb_cache_set_ptr(w, CACHE_FIELD(off, struct ptb_staff, index), 0);
+	if (idx == NULL) return;
+
+	n = idx->first[2];
+	ioff = ptb_cache_copy(w, idx, sizeof(*idx) + n * (sizeof(struct ptb_position *) + sizeof(uint32_t)));
+	if (w->failed) return;
+
+	ptb_cache_set_ptr(w, CACHE_FIELD(off, struct ptb_staff, index), ioff);
+	ptb_cache_set_ptr(w, CACHE_FIELD(ioff, struct ptb_staff_index, positions), ioff + sizeof(*idx));
+	ptb_cache_set_ptr(w, CACHE_FIELD(ioff, struct ptb_staff_index, start), 
+					  ioff + sizeof(*idx) + n * sizeof(struct ptb_position *));
+
+	for (i = 0, v = 0; v < 2; v++) {
+		pos = ptb_cache_get_ptr(w, CACHE_FIELD(off, struct ptb_staff, positions[v]));
+		for (; pos && i < n && !w->failed; i++) {
+			ptb_cache_set_ptr(w, ioff + sizeof(*idx) + i * sizeof(struct ptb_position *), pos);
+			pos = ptb_cache_get_ptr(w, CACHE_FIELD(pos, struct ptb_list, next));
+		}
+	}
+}
+
+static void ptb_cache_staff(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_staff *staff = item;
+	CACHE_LIST(w, off, struct ptb_staff, positions[0], staff, ptb_cache_position);
+	CACHE_LIST(w, off, struct ptb_staff, positions[1], staff, ptb_cache_position);
+	ptb_cache_staff_index(w, off, staff);
+}
+
+static void ptb_cache_musicbar(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_musicbar *bar = item;
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_musicbar, description), bar->description);
+}
+
+static void ptb_cache_section(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_section *section = item;
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_section, description), section->description);
+	CACHE_LIST(w, off, struct ptb_section, staffs, section, ptb_cache_staff);
+	CACHE_LIST(w, off, struct ptb_section, chordtexts, section, NULL);
+	CACHE_LIST(w, off, struct ptb_section, rhythmslashes, section, NULL);
+	CACHE_LIST(w, off, struct ptb_section, directions, section, NULL);
+	CACHE_LIST(w, off, struct ptb_section, musicbars, section, ptb_cache_musicbar);
+}
+
+static void ptb_cache_guitar(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_guitar *guitar = item;
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_guitar, title), guitar->title);
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_guitar, type), guitar->type);
+	ptb_cache_set_blob(w, CACHE_FIELD(off, struct ptb_guitar, strings), guitar->strings, guitar->nr_strings);
+}
+
+static void ptb_cache_chorddiagram(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_chorddiagram *cd = item;
+	ptb_cache_set_blob(w, CACHE_FIELD(off, struct ptb_chorddiagram, tones), cd->tones, sizeof(ptb_tone) * cd->nr_strings);
+}
+
+static void ptb_cache_floatingtext(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_floatingtext *ft = item;
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_floatingtext, text), ft->text);
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_floatingtext, font.family), ft->font.family);
+}
+
+static void ptb_cache_tempomarker(struct ptb_cache_writer *w, uint64_t off, const void *item)
+{
+	const struct ptb_tempomarker *tm = item;
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptb_tempomarker, description), tm->description);
+}
+
+#define CACHE_HDR_STRING(w, off, hdr, field) \
+	ptb_cache_set_string(w, CACHE_FIELD(off, struct ptbf, hdr.field), (hdr)->field)
+
+static void ptb_cache_hdr(struct ptb_cache_writer *w, uint64_t off, const struct ptb_hdr *hdr)
+{
+	if (hdr->classification == CLASSIFICATION_SONG) { 
+		switch (hdr->class_info.song.release_type) {
+		case RELEASE_TYPE_PR_AUDIO:
+			CACHE_HDR_STRING(w, off, hdr, class_info.song.release_info.pr_audio.album_title);
+			break;
+		case RELEASE_TYPE_PR_VIDEO:
+			CACHE_HDR_STRING(w, off, hdr, class_info.song.release_info.pr_video.video_title);
+			break;
+		case RELEASE_TYPE_BOOTLEG:
+			CACHE_HDR_STRING(w, off, hdr, class_info.song.release_info.bootleg.title);
+			break;
+		default: break;
+		}
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.title);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.artist);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.words_by);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.music_by);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.arranged_by);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.guitar_transcribed_by);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.bass_transcribed_by);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.lyrics);
+		CACHE_HDR_STRING(w, off, hdr, class_info.song.copyright);
+	} else if (hdr->classification == CLASSIFICATION_LESSON) {
+		CACHE_HDR_STRING(w, off, hdr, class_info.lesson.artist);
+		CACHE_HDR_STRING(w, off, hdr, class_info.lesson.title);
+		CACHE_HDR_STRING(w, off, hdr, class_info.lesson.author);
+		CACHE_HDR_STRING(w, off, hdr, class_info.lesson.copyright);
+	}
+
+	CACHE_HDR_STRING(w, off, hdr, guitar_notes);
+	CACHE_HDR_STRING(w, off, hdr, bass_notes);
+	CACHE_HDR_STRING(w, off, hdr, drum_notes);
+}
+
+int ptb_save_cache(const char *cache, struct ptbf *bf)
+{
+	struct ptb_cache_writer w;
+	struct ptb_cache_hdr hdr;
+	struct ptbf root;
+	struct stat st;
+	uint64_t off, strings;
+	size_t i;
+	int ret = -1;
+
+	ptb_link_sections(bf);
+
+	memset(&w, 0, sizeof(w));
+	w.allocator = &bf->allocator;
+	memset(&hdr, 0, sizeof(hdr));
+	ptb_cache_copy(&w, &hdr, sizeof(hdr));
+
+	/* Only the document itself, none of the parser state */
+	memset(&root, 0, sizeof(root));
+	root.fd = -1;
+	root.mode = O_RDONLY;
+	root.hdr = bf->hdr;
+	memcpy(root.instrument, bf->instrument, sizeof(root.instrument));
+	root.instrument[0].nr_sections = root.instrument[1].nr_sections = 0;
+	root.default_font = bf->default_font;
+	root.chord_name_font = bf->chord_name_font;
+	root.tablature_font = bf->tablature_font;
+	root.staff_line_space = bf->staff_line_space;
+	root.fade_in = bf->fade_in;
+	root.fade_out = bf->fade_out;
+
+	off = ptb_cache_copy(&w, &root, sizeof(root));
+	ptb_cache_hdr(&w, off, &bf->hdr);
+	ptb_cache_set_string(&w, CACHE_FIELD(off, struct ptbf, default_font.family), bf->default_font.family);
+	ptb_cache_set_string(&w, CACHE_FIELD(off, struct ptbf, chord_name_font.family), bf->chord_name_font.family);
+	ptb_cache_set_string(&w, CACHE_FIELD(off, struct ptbf, tablature_font.family), bf->tablature_font.family);
+
+	for (i = 0; i < 2; i++) {
+		const struct ptb_instrument *ins = &bf->instrument[i];
+		uint64_t ioff = off + offsetof(struct ptbf, instrument) + i * sizeof(struct ptb_instrument);
+		ptb_cache_set_ptr(&w, CACHE_FIELD(ioff, struct ptb_instrument, section_index), 0);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, guitars, ins, ptb_cache_guitar);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, sections, ins, ptb_cache_section);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, guitarins, ins, NULL);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, chorddiagrams, ins, ptb_cache_chorddiagram);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, tempomarkers, ins, ptb_cache_tempomarker);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, dynamics, ins, NULL);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, floatingtexts, ins, ptb_cache_floatingtext);
+		CACHE_LIST(&w, ioff, struct ptb_instrument, sectionsymbols, ins, NULL);
+	}
+
+	/* String table */
+	strings = w.strings_size?ptb_cache_copy(&w, w.strings, w.strings_size):0;
+	for (i = 0; i < w.nr_strrefs; i++) 
+		ptb_cache_set_ptr(&w, w.strrefs[i].field, strings + w.strrefs[i].offset);
+
+	memcpy(hdr.magic, PTB_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = PTB_CACHE_VERSION;
+	hdr.byte_order = 0x01020304;
+	hdr.layout = ptb_cache_layout();
+	hdr.base = PTB_CACHE_BASE;
+	hdr.root = off;
+	hdr.nr_fixups = w.nr_fixups;
+	hdr.fixups = ptb_cache_copy(&w, w.fixups, sizeof(uint32_t) * w.nr_fixups);
+	hdr.size = w.size;
+
+	/* Fixups are 32 bits */
+	if (hdr.fixups > 0xffffffffUL) 
+		w.failed = 1;
+
+	if (bf->filename && strcmp(bf->filename, "-") && stat(bf->filename, &st) == 0) {
+		hdr.source_size = st.st_size;
+		hdr.source_mtime = st.st_mtime;
+		hdr.source_mtime_nsec = ptb_mtime_nsec(&st);
+	}
+
+	if (!w.failed) 
+		hdr.body_checksum = ptb_cache_checksum(2166136261U, w.buf + sizeof(hdr), w.size - sizeof(hdr));
+	hdr.checksum = ptb_cache_checksum(2166136261U, &hdr, sizeof(hdr));
+
+	if (!w.failed) {
+		memcpy(w.buf, &hdr, sizeof(hdr));
+		ret = ptb_write_atomic(w.allocator, cache, w.buf, w.size);
+	}
+
+	ptb_mem_free(w.allocator, w.buf);
+	ptb_mem_free(w.allocator, w.strings);
+	ptb_mem_free(w.allocator, w.strrefs);
+	ptb_mem_free(w.allocator, w.fixups);
+	return ret;
+}
+
+/* Map a cache image, or return NULL if it is not usable (any more) */
+static struct ptbf *ptb_map_cache(const char *cache, const char *file, const struct ptb_parse_options *opts)
+{
+	const struct ptb_allocator *a = ptb_allocator(opts?opts->allocator:NULL);
+	struct ptb_cache_hdr hdr;
+	struct stat st;
+	struct ptbf *bf;
+	uint32_t *fixups;
+	uintptr_t delta;
+	uint32_t checksum;
+	char *image;
+	int fd, source, valid;
+	size_t i;
+
+	fd = open(cache, O_RDONLY
+#ifdef O_BINARY
+			  | O_BINARY
+#endif
+			  );
+	if (fd < 0) 
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	checksum = hdr.checksum;
+	hdr.checksum = 0;
+
+	if (checksum != ptb_cache_checksum(2166136261U, &hdr, sizeof(hdr)) || 
+		memcmp(hdr.magic, PTB_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != PTB_CACHE_VERSION || hdr.byte_order != 0x01020304 ||
+		hdr.layout != ptb_cache_layout() || hdr.size != (uint64_t)st.st_size ||
+		hdr.root + sizeof(struct ptbf) > hdr.fixups || 
+		hdr.fixups % sizeof(uint32_t) || hdr.nr_fixups > hdr.size / sizeof(uint32_t) ||
+		hdr.fixups + sizeof(uint32_t) * hdr.nr_fixups != hdr.size) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Stale? */
+	if (file && (stat(file, &st) < 0 || hdr.source_size != (uint64_t)st.st_size || 
+				 hdr.source_mtime != (uint64_t)st.st_mtime || 
+				 hdr.source_mtime_nsec != ptb_mtime_nsec(&st))) {
+		close(fd);
+		return NULL;
+	}
+
+#ifdef HAVE_MMAP
+	/* Pages stay shared with other processes unless they are written to, 
+	 * which is only necessary if the image can't be mapped at its base */
+	image = mmap((void *)(uintptr_t)hdr.base, hdr.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	source = PTB_DATA_MMAP;
+	if (image == MAP_FAILED) 
+		image = NULL;
+#else
+	image = ptb_mem_alloc(a, hdr.size);
+	source = PTB_DATA_HEAP;
+	if (image && (lseek(fd, 0, SEEK_SET) != 0 || read(fd, image, hdr.size) != (ssize_t)hdr.size)) {
+		ptb_mem_free(a, image);
+		image = NULL;
+	}
+#endif
+	close(fd);
+
+	if (image == NULL) 
+		return NULL;
+
+	/* The pointers in the body are followed as they are, so the whole 
+	 * image has to be intact */
+	valid = (ptb_cache_checksum(2166136261U, image + sizeof(hdr), hdr.size - sizeof(hdr)) == hdr.body_checksum);
+
+	/* Every pointer has to point into the image, even if it ended up 
+	 * at its base address and none of them need adjusting */
+	fixups = (uint32_t *)(image + hdr.fixups);
+	delta = (uintptr_t)image - (uintptr_t)hdr.base;
+	for (i = 0; valid && i < hdr.nr_fixups; i++) {
+		uintptr_t ptr;
+
+		if (fixups[i] % sizeof(void *) || fixups[i] + sizeof(void *) > hdr.fixups) 
+			break;
+
+		memcpy(&ptr, image + fixups[i], sizeof(ptr));
+		if (ptr - (uintptr_t)hdr.base >= hdr.fixups) 
+			break;
+
+		if (delta) {
+			ptr += delta;
+			memcpy(image + fixups[i], &ptr, sizeof(ptr));
+		}
+	}
+
+	/* The document lives in the image, so it can not release it */
+	if (!valid || i < hdr.nr_fixups) {
+#ifdef HAVE_MMAP
+		munmap(image, hdr.size);
+#else
+		ptb_mem_free(a, image);
+#endif
+		return NULL;
+	}
+
+	bf = (struct ptbf *)(image + hdr.root);
+	bf->data = image;
+	bf->length = hdr.size;
+	bf->data_source = source;
+	bf->allocator = *a;
+
+	ptb_set_options(bf, opts);
+	bf->cached = 1;
+	bf->filename = ptb_mem_strdup(a, file?file:cache);
+	return bf;
+}
+
+struct ptbf *ptb_open_cache(const char *cache, const char *file, const struct ptb_parse_options *opts)
+{
+	struct ptbf *bf = ptb_map_cache(cache, file, opts);
+
+	if (bf || file == NULL) 
+		return bf;
+
+	/* Parse the original and update the cache for next time */
+	bf = ptb_read_file_ex(file, opts);
+	if (bf) ptb_save_cache(cache, bf);
+	return bf;
+}
+
+static int handle_CGuitar (struct ptbf *bf, const char *section, struct ptb_list **dest) {
+	struct ptb_guitar *guitar = GET_ITEM(bf, dest, struct ptb_guitar);
+
+	if (guitar == NULL) return 0;
+
+	ptb_data_uint8(bf, &guitar->index);
+	ptb_data_string(bf, &guitar->title);
+
+	ptb_data_uint8(bf, &guitar->midi_instrument);
+	ptb_data_uint8(bf, &guitar->initial_volume);
 	ptb_data_uint8(bf, &guitar->pan);
 	ptb_data_uint8(bf, &guitar->reverb);
 	ptb_data_uint8(bf, &guitar->chorus);
 	ptb_data_uint8(bf, &guitar->tremolo);
 
-	ptb_data_uint8(bf, &guitar->simulate);
-	ptb_data_uint8(bf, &guitar->capo);
-		
-	ptb_data_string(bf, &guitar->type);
+	ptb_data_uint8(bf, &guitar->simulate);
+	ptb_data_uint8(bf, &guitar->capo);
+		
+	ptb_data_string(bf, &guitar->type);
+
+	ptb_data_uint8(bf, &guitar->half_up);
+	ptb_data_uint8(bf, &guitar->nr_strings);
+
+	if (bf->mode == O_RDONLY) {
+		guitar->strings = ptb_alloc(bf, uint8_t, guitar->nr_strings);
+		if (guitar->strings == NULL) guitar->nr_strings = 0;
+	}
+
+	ptb_data(bf, guitar->strings, guitar->nr_strings);
+
+	*dest = (struct ptb_list *)guitar;
+
+	return 1;
+}
+
+
+static int handle_CFloatingText (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_floatingtext *text = GET_ITEM(bf, dest, struct ptb_floatingtext);
+
+	if (text == NULL) return 0;
+
+	ptb_data_string(bf, &text->text);
+	ptb_data_rect(bf, &text->rect);
+	ptb_data_uint8(bf, &text->alignment);
+	ptb_debug(bf, "Align: %x", text->alignment);
+	ptb_assert(bf, (text->alignment &~ ALIGN_BORDER &~ ALIGN_CENTER 
+					&~ ALIGN_LEFT &~ ALIGN_RIGHT)  == 0);
+	ptb_data_font(bf, &text->font);
+	
+	*dest = (struct ptb_list *)text;
+
+	return 1;
+}
+
+static int handle_CSection (struct ptbf *bf, const char *sectionname, struct ptb_list **dest) { 
+	struct ptb_section *section = GET_ITEM(bf, dest, struct ptb_section);
+
+	if (section == NULL) return 0;
+
+	ptb_data_constant(bf, 0x32);
+	ptb_data_unknown(bf, 11, "FIXME");
+	ptb_data_uint16(bf, &section->properties);
+	ptb_data_unknown(bf, 2, "FIXME");
+	ptb_data_uint8(bf, &section->end_mark);
+	ptb_assert(bf, (section->end_mark &~ END_MARK_TYPE_NORMAL 
+			   & ~END_MARK_TYPE_DOUBLELINE
+			   & ~END_MARK_TYPE_REPEAT) < 24);
+	ptb_data_uint8(bf, &section->position_width);
+	ptb_data_unknown(bf, 5, "FIXME");
+	ptb_data_uint8(bf, &section->key_extra);
+	ptb_data_unknown(bf, 1, "FIXME");
+	ptb_data_uint16(bf, &section->meter_type);
+	ptb_data_uint8(bf, &section->beat_info);
+	ptb_data_uint8(bf, &section->metronome_pulses_per_measure);
+	ptb_data_uint8(bf, &section->letter);
+	ptb_data_string(bf, &section->description);
+
+	if (bf->events) ptb_event_begin(bf, PTB_CLASS_SECTION, section);
+
+	ptb_data_items(bf, PTB_CLASS_DIRECTION, (struct ptb_list **)&section->directions);
+	ptb_data_items(bf, PTB_CLASS_CHORDTEXT, (struct ptb_list **)&section->chordtexts);
+	ptb_data_items(bf, PTB_CLASS_RHYTHMSLASH, (struct ptb_list **)&section->rhythmslashes);
+	ptb_data_items(bf, PTB_CLASS_STAFF, (struct ptb_list **)&section->staffs);
+	/* FIXME: Barlinearray */
+	/* FIXME: Barline */
+	ptb_data_items(bf, PTB_CLASS_MUSICBAR, (struct ptb_list **)&section->musicbars);
+
+	*dest = (struct ptb_list *)section;
+	return 1;
+}
+
+static int handle_CTempoMarker (struct ptbf *bf, const char *section, struct ptb_list **dest) {
+	struct ptb_tempomarker *tempomarker = GET_ITEM(bf, dest, struct ptb_tempomarker);
+
+	if (tempomarker == NULL) return 0;
+
+	ptb_data_uint8(bf, &tempomarker->section);
+	ptb_data_constant(bf, 0);
+	ptb_data_uint8(bf, &tempomarker->offset);
+	ptb_data_uint8(bf, &tempomarker->bpm);
+	ptb_data_constant(bf, 0);
+	ptb_data_uint16(bf, &tempomarker->type);
+	ptb_data_string(bf, &tempomarker->description);
+
+	*dest = (struct ptb_list *)tempomarker;
+	return 1;
+}
+
+static int ptb_data_chordname(struct ptbf *bf, struct ptb_chordname *dest)
+{
+	int ret = 0;
+	ret += ptb_data(bf, dest->name, 2);
+	ret += ptb_data_uint8(bf, &dest->formula);
+	ret += ptb_data_uint16(bf, &dest->formula_mods);
+	ptb_data_uint8(bf, &dest->type);
+	return ret;
+}
+
+static int handle_CChordDiagram (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_chorddiagram *chorddiagram = GET_ITEM(bf, dest, struct ptb_chorddiagram);
+
+	if (chorddiagram == NULL) return 0;
+
+	ptb_data_chordname(bf, &chorddiagram->name);
+	ptb_data_uint8(bf, &chorddiagram->frets);
+	ptb_data_uint8(bf, &chorddiagram->nr_strings);
+	if (bf->mode == O_RDONLY) {
+		chorddiagram->tones = ptb_alloc(bf, uint8_t, chorddiagram->nr_strings);
+		if (chorddiagram->tones == NULL) chorddiagram->nr_strings = 0;
+	}
+	ptb_data(bf, chorddiagram->tones, chorddiagram->nr_strings);
+
+	*dest = (struct ptb_list *)chorddiagram;
+	return 1;
+}
+
+static int handle_CLineData (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_linedata *linedata = GET_ITEM(bf, dest, struct ptb_linedata);
+
+	if (linedata == NULL) return 0;
+
+	ptb_data_uint8(bf, &linedata->tone);
+	ptb_data_uint8(bf, &linedata->properties);
+	ptb_assert_0(bf, linedata->properties
+			   & ~LINEDATA_PROPERTY_GHOST_NOTE
+			   & ~LINEDATA_PROPERTY_PULLOFF_FROM
+			   & ~LINEDATA_PROPERTY_HAMMERON_FROM
+			   & ~LINEDATA_PROPERTY_DEST_NOWHERE
+			   & ~LINEDATA_PROPERTY_TIE
+			   & ~LINEDATA_PROPERTY_NATURAL_HARMONIC
+			   & ~LINEDATA_PROPERTY_CONTINUES
+			   & ~LINEDATA_PROPERTY_MUTED);
+	ptb_data_uint8(bf, &linedata->transcribe);
+	ptb_assert(bf, linedata->transcribe == LINEDATA_TRANSCRIBE_8VA 
+			   ||  linedata->transcribe == LINEDATA_TRANSCRIBE_15MA
+			   ||  linedata->transcribe == LINEDATA_TRANSCRIBE_8VB
+			   ||  linedata->transcribe == LINEDATA_TRANSCRIBE_15MB
+			   ||  linedata->transcribe == 0);
+			   
+	ptb_data_uint8(bf, &linedata->conn_to_next);
+	
+	if(linedata->conn_to_next) { 
+		if (bf->mode == O_RDONLY) {
+			linedata->bends = ptb_alloc(bf, struct ptb_bend, linedata->conn_to_next);
+			if (linedata->bends == NULL) linedata->conn_to_next = 0;
+		}
+		ptb_data(bf, linedata->bends, 4*linedata->conn_to_next);
+	} else {
+		linedata->bends = NULL;
+	}
+
+	*dest = (struct ptb_list *)linedata;
+	return 1;
+}
+
+
+static int handle_CChordText (struct ptbf *bf, const char *section, struct ptb_list **dest) {
+	struct ptb_chordtext *chordtext = GET_ITEM(bf, dest, struct ptb_chordtext);
+
+	if (chordtext == NULL) return 0;
+
+	ptb_data_uint8(bf, &chordtext->offset);
+	ptb_data_uint16(bf, chordtext->name);
+
+	ptb_data_uint8(bf, &chordtext->properties);
+	ptb_assert_0(bf, chordtext->properties 
+			   & ~CHORDTEXT_PROPERTY_NOCHORD
+			   & ~CHORDTEXT_PROPERTY_PARENTHESES
+			   & ~0x0F /* Formula */
+			   & ~0xC0 /*FIXME*/);
+	ptb_data_uint8(bf, &chordtext->additions);
+	ptb_assert_0(bf, chordtext->additions 
+			   & ~CHORDTEXT_EXT_7_9
+			   & ~CHORDTEXT_EXT_7_13
+			   & ~CHORDTEXT_ADD_2
+			   & ~CHORDTEXT_ADD_9
+			   & ~CHORDTEXT_ADD_11
+			   & ~CHORDTEXT_PLUS_5);
+	ptb_data_uint8(bf, &chordtext->alterations);
+	ptb_data_uint8(bf, &chordtext->VII);
+	ptb_assert_0(bf, chordtext->VII 
+				 & ~CHORDTEXT_VII 
+				 & ~CHORDTEXT_VII_VI
+				 & ~CHORDTEXT_VII_OPEN
+				 & ~CHORDTEXT_VII_TYPE_2
+				 & ~CHORDTEXT_VII_TYPE_3
+				 	);
+
+	*dest = (struct ptb_list *)chordtext;
+	return 1;
+}
+
+static int handle_CGuitarIn (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_guitarin *guitarin = GET_ITEM(bf, dest, struct ptb_guitarin);
+
+	if (guitarin == NULL) return 0;
+
+	ptb_data_uint8(bf, &guitarin->section);
+	ptb_data_constant(bf, 0x0); 
+	ptb_data_uint8(bf, &guitarin->staff);
+	ptb_data_uint8(bf, &guitarin->offset);
+	ptb_data_uint8(bf, &guitarin->rhythm_slash);
+	ptb_data_uint8(bf, &guitarin->staff_in);
+
+	*dest = (struct ptb_list *)guitarin;
+	return 1;
+}
+
+
+static int handle_CStaff (struct ptbf *bf, const char *section, struct ptb_list **dest)
+{ 
+	uint16_t next;
+	struct ptb_staff *staff = GET_ITEM(bf, dest, struct ptb_staff);
+
+	if (staff == NULL) return 0;
+
+	ptb_data_uint8(bf, &staff->properties);
+	ptb_debug(bf, "Properties: %02x", staff->properties);
+	ptb_data_uint8(bf, &staff->highest_note_space);
+	ptb_data_uint8(bf, &staff->lowest_note_space);
+	ptb_data_uint8(bf, &staff->symbol_space);
+	ptb_data_uint8(bf, &staff->tab_staff_space);
+
+	if (bf->events) ptb_event_begin(bf, PTB_CLASS_STAFF, staff);
+
+	/* FIXME! */
+	bf->cur_voice = 0;
+	ptb_data_items(bf, PTB_CLASS_POSITION, (struct ptb_list **)&staff->positions[0]);
+	/* A class tag rather than a count means the next staff starts here */
+	if (bf->mode == O_RDONLY) {
+		ptb_peek_uint16(bf, &next);
+		if(next & 0x8000) {
+			staff->positions[1] = NULL;
+			goto done;
+		}
+	}
+
+	bf->cur_voice = 1;
+	ptb_data_items(bf, PTB_CLASS_POSITION, (struct ptb_list **)&staff->positions[1]);
+
+done:
+	/* Positions are not kept when streaming or skipping */
+	if (bf->mode == O_RDONLY && !bf->events && !bf->skipping) 
+		ptb_index_staff(bf, staff);
+
+	*dest = (struct ptb_list *)staff;
+	return 1;
+}
+
+
+static int handle_CPosition (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_position *position = GET_ITEM(bf, dest, struct ptb_position);
+	int i;
+
+	if (position == NULL) return 0;
+
+	ptb_data_uint8(bf, &position->offset);
+	ptb_data_uint16(bf, &position->properties); 
+	ptb_assert_0(bf, position->properties 
+			   & ~POSITION_PROPERTY_IRREGULAR_GROUPING
+			   & ~POSITION_PROPERTY_IN_SINGLE_BEAM
+			   & ~POSITION_PROPERTY_IN_DOUBLE_BEAM
+			   & ~POSITION_PROPERTY_IN_TRIPLE_BEAM
+			   & ~POSITION_PROPERTY_FIRST_IN_BEAM
+			   & ~POSITION_PROPERTY_PARTIAL_BEAM
+			   & ~POSITION_PROPERTY_MIDDLE_IN_BEAM
+			   & ~POSITION_PROPERTY_LAST_IN_BEAM);
+	ptb_data_uint8(bf, &position->dots);
+	ptb_assert_0(bf, position->dots 
+				 	&~ POSITION_DOTS_1 
+				 	& ~POSITION_DOTS_2 
+					& ~POSITION_DOTS_REST 
+					& ~POSITION_DOTS_ARPEGGIO_UP 
+					& ~POSITION_DOTS_ARPEGGIO_DOWN
+					& ~POSITION_DOTS_WIDE_VIBRATO
+					& ~POSITION_DOTS_VIBRATO);
+	ptb_data_uint8(bf, &position->palm_mute);
+	ptb_assert_0(bf, position->palm_mute 
+				 & ~POSITION_PALM_MUTE 
+				 & ~POSITION_STACCATO 
+				 & ~POSITION_ACCENT
+				 & ~POSITION_HEAVY_ACCENT
+				 & ~POSITION_PICKSTROKE_DOWN
+				 & ~POSITION_TREMOLO_PICKING
+				 );
+	ptb_data_uint8(bf, &position->fermenta);
+	ptb_assert_0(bf, position->fermenta
+					& ~POSITION_FERMENTA_ACCIACCATURA
+					& ~POSITION_FERMENTA_LET_RING
+					& ~POSITION_FERMENTA_TRIPLET_FEEL_FIRST
+					& ~POSITION_FERMENTA_TRIPLET_FEEL_SECOND
+					& ~POSITION_FERMENTA_TRIPLET_1
+					& ~POSITION_FERMENTA_TRIPLET_2
+					& ~POSITION_FERMENTA_TRIPLET_3
+					& ~POSITION_FERMENTA_FERMENTA);
+	ptb_data_uint8(bf, &position->length);
+	
+	ptb_data_uint8(bf, &position->nr_additional_data);
+
+	if (bf->mode == O_RDONLY) {
+		position->additional = ptb_alloc(bf, struct ptb_position_additional, position->nr_additional_data);
+		if (position->additional == NULL) position->nr_additional_data = 0;
+	}
+	
+	for (i = 0; i < position->nr_additional_data; i++) {
+		ptb_data_uint8(bf, &position->additional[i].start_volume);
+		ptb_data_uint8(bf, &position->additional[i].end_volume);
+		ptb_data_uint8(bf, &position->additional[i].duration);
+		ptb_data_unknown(bf, 1, "FIXME");
+	}
+
+	if (bf->events) ptb_event_begin(bf, PTB_CLASS_POSITION, position);
+
+	ptb_data_items(bf, PTB_CLASS_LINEDATA, (struct ptb_list **)&position->linedatas);
+
+	*dest = (struct ptb_list *)position;
+	return 1;
+}
+
+static int handle_CDynamic (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_dynamic *dynamic = GET_ITEM(bf, dest, struct ptb_dynamic);
+
+	if (dynamic == NULL) return 0;
+
+	ptb_data_uint16(bf, &dynamic->section);
+	ptb_data_uint8(bf, &dynamic->staff);
+	ptb_data_uint8(bf, &dynamic->position);
+	ptb_data_uint16(bf, &dynamic->volume);
+
+	*dest = (struct ptb_list *)dynamic;
+	return 1;
+}
+
+static int handle_CSectionSymbol (struct ptbf *bf, const char *section, struct ptb_list **dest) {
+	struct ptb_sectionsymbol *sectionsymbol = GET_ITEM(bf, dest, struct ptb_sectionsymbol);
+
+	if (sectionsymbol == NULL) return 0;
+
+	ptb_data_uint16(bf, &sectionsymbol->section);
+	ptb_data_uint8(bf, &sectionsymbol->position);
+	ptb_data_uint32(bf, &sectionsymbol->data);
+
+	*dest = (struct ptb_list *)sectionsymbol;
+	return 1;
+}
+
+static int handle_CMusicBar (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_musicbar *musicbar = GET_ITEM(bf, dest, struct ptb_musicbar);
+
+	if (musicbar == NULL) return 0;
+											 
+	ptb_data_uint8(bf, &musicbar->offset);
+	ptb_data_uint8(bf, &musicbar->properties);
+	ptb_data_unknown(bf, 6, "FIXME");
+	ptb_data_uint8(bf, &musicbar->letter);
+	ptb_data_string(bf, &musicbar->description);
+
+	*dest = (struct ptb_list *)musicbar; 
+	return 1;
+}
+
+static int handle_CRhythmSlash (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_rhythmslash *rhythmslash = GET_ITEM(bf, dest, struct ptb_rhythmslash);
+
+	if (rhythmslash == NULL) return 0;
+	
+	ptb_data_uint8(bf, &rhythmslash->offset);
+	ptb_data_uint8(bf, &rhythmslash->properties);
+	ptb_assert_0(bf, rhythmslash->properties 
+				 & ~RHYTHMSLASH_PROPERTY_FIRST_IN_BEAM
+				 & ~RHYTHMSLASH_PROPERTY_IN_SINGLE_BEAM
+				 & ~RHYTHMSLASH_PROPERTY_IN_DOUBLE_BEAM
+				 & ~RHYTHMSLASH_PROPERTY_LAST_IN_BEAM
+				 & ~RHYTHMSLASH_PROPERTY_PARTIAL_BEAM
+				 & ~RHYTHMSLASH_PROPERTY_TRIPLET_FIRST
+				 & ~RHYTHMSLASH_PROPERTY_TRIPLET_SECOND
+				 & ~RHYTHMSLASH_PROPERTY_TRIPLET_THIRD
+				 );
+	ptb_data_uint8(bf, &rhythmslash->dotted);
+	ptb_data_uint8(bf, &rhythmslash->extra);
+	ptb_assert_0(bf, rhythmslash->extra 
+				 & ~RHYTHMSLASH_EXTRA_ARPEGGIO_UP
+				 & ~RHYTHMSLASH_EXTRA_ACCENT
+				 & ~RHYTHMSLASH_EXTRA_HEAVY_ACCENT
+				 & ~0x18 /* FIXME */);
+	ptb_data_uint8(bf, &rhythmslash->length);
+	ptb_data_uint8(bf, &rhythmslash->singlenote);
+
+	*dest = (struct ptb_list *)rhythmslash;
+	return 1;
+}
+
+static int handle_CDirection (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
+	struct ptb_direction *direction = GET_ITEM(bf, dest, struct ptb_direction);
+
+	if (direction == NULL) return 0;
+
+	ptb_data_unknown(bf, 1, "FIXME");
+	ptb_data_uint8(bf, &direction->nr_items);
+	ptb_data_unknown(bf, 2 * direction->nr_items, "FIXME");
+
+	*dest = (struct ptb_list *)direction;
+	return 1;
+}
 
-	ptb_data_uint8(bf, &guitar->half_up);
-	ptb_data_uint8(bf, &guitar->nr_strings);
+/* Indexed by enum ptb_class */
+const struct ptb_section_handler ptb_section_handlers[PTB_CLASS_MAX] = {
+	{"CGuitar", handle_CGuitar },
+	{"CFloatingText", handle_CFloatingText },
+	{"CChordDiagram", handle_CChordDiagram },
+	{"CTempoMarker", handle_CTempoMarker },
+	{"CLineData", handle_CLineData },
+	{"CChordText", handle_CChordText },
+	{"CGuitarIn", handle_CGuitarIn },
+	{"CStaff", handle_CStaff },
+	{"CPosition", handle_CPosition },
+	{"CSection", handle_CSection },
+	{"CDynamic", handle_CDynamic },
+	{"CSectionSymbol", handle_CSectionSymbol },
+	{"CMusicBar", handle_CMusicBar },
+	{"CRhythmSlash", handle_CRhythmSlash },
+	{"CDirection", handle_CDirection },
+};
 
-	if (bf->mode == O_RDONLY) {
-		guitar->strings = malloc_p(uint8_t, guitar->nr_strings);
-	}
+/* Structural checks on a file, without decoding it. This follows the 
+ * same layout as the handlers above, but only looks at the counts, 
+ * class tags and string lengths that determine where everything is. */
+struct ptb_validator {
+	const unsigned char *data;
+	size_t length;
+	size_t pos;
+	uint32_t class_index[PTB_CLASS_MAX];
+	uint32_t map_count;
+	struct ptb_validation *result;
+};
 
-	ptb_data(bf, guitar->strings, guitar->nr_strings);
+static int pv_fail(struct ptb_validator *v, size_t offset, const char *error)
+{
+	if (v->result) {
+		v->result->offset = offset;
+		v->result->error = error;
+	}
+	return 0;
+}
 
-	*dest = (struct ptb_list *)guitar;
+static int pv_skip(struct ptb_validator *v, size_t n)
+{
+	if (n > v->length - v->pos) 
+		return pv_fail(v, v->pos, "Unexpected end of file");
+	v->pos += n;
+	return 1;
+}
 
+static int pv_uint8(struct ptb_validator *v, uint8_t *dest)
+{
+	if (v->pos >= v->length) 
+		return pv_fail(v, v->pos, "Unexpected end of file");
+	*dest = v->data[v->pos++];
 	return 1;
 }
 
+static int pv_uint16(struct ptb_validator *v, uint16_t *dest)
+{
+	if (2 > v->length - v->pos) 
+		return pv_fail(v, v->pos, "Unexpected end of file");
+	memcpy(dest, v->data + v->pos, 2);
+	v->pos += 2;
+	return 1;
+}
 
-static int handle_CFloatingText (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_floatingtext *text = GET_ITEM(bf, dest, struct ptb_floatingtext);
+static int pv_string(struct ptb_validator *v)
+{
+	size_t start = v->pos;
+	uint8_t shortlength;
+	uint16_t length;
 
-	ptb_data_string(bf, &text->text);
-	ptb_data_rect(bf, &text->rect);
-	ptb_data_uint8(bf, &text->alignment);
-	ptb_debug("Align: %x", text->alignment);
-	ptb_assert(bf, (text->alignment &~ ALIGN_BORDER &~ ALIGN_CENTER 
-					&~ ALIGN_LEFT &~ ALIGN_RIGHT)  == 0);
-	ptb_data_font(bf, &text->font);
-	
-	*dest = (struct ptb_list *)text;
+	if (!pv_uint8(v, &shortlength)) return 0;
+	if (shortlength == 0xff) {
+		if (!pv_uint16(v, &length)) return 0;
+	} else {
+		length = shortlength;
+	}
 
+	if (length > v->length - v->pos) 
+		return pv_fail(v, start, "String runs past end of file");
+	v->pos += length;
 	return 1;
 }
 
-static int handle_CSection (struct ptbf *bf, const char *sectionname, struct ptb_list **dest) { 
-	struct ptb_section *section = GET_ITEM(bf, dest, struct ptb_section);
+static int pv_font(struct ptb_validator *v)
+{
+	return pv_string(v) && pv_skip(v, 4 + 4 + 3 + 4);
+}
 
-	ptb_data_constant(bf, 0x32);
-	ptb_data_unknown(bf, 11, "FIXME");
-	ptb_data_uint16(bf, &section->properties);
-	ptb_data_unknown(bf, 2, "FIXME");
-	ptb_data_uint8(bf, &section->end_mark);
-	ptb_assert(bf, (section->end_mark &~ END_MARK_TYPE_NORMAL 
-			   & ~END_MARK_TYPE_DOUBLELINE
-			   & ~END_MARK_TYPE_REPEAT) < 24);
-	ptb_data_uint8(bf, &section->position_width);
-	ptb_data_unknown(bf, 5, "FIXME");
-	ptb_data_uint8(bf, &section->key_extra);
-	ptb_data_unknown(bf, 1, "FIXME");
-	ptb_data_uint16(bf, &section->meter_type);
-	ptb_data_uint8(bf, &section->beat_info);
-	ptb_data_uint8(bf, &section->metronome_pulses_per_measure);
-	ptb_data_uint8(bf, &section->letter);
-	ptb_data_string(bf, &section->description);
+/* Same rules as ptb_read_class_tag() */
+static int pv_class_tag(struct ptb_validator *v, enum ptb_class cls)
+{
+	const char *name = ptb_section_handlers[cls].name;
+	size_t start = v->pos;
+	uint16_t tag, schema, length;
+	uint32_t obtag;
+
+	if (!pv_uint16(v, &tag)) return 0;
+
+	if (tag == PTB_NEW_CLASS_TAG) {
+		if (!pv_uint16(v, &schema) || !pv_uint16(v, &length)) return 0;
+		if (schema != 0x0001) 
+			return pv_fail(v, start, "Unknown class schema");
+		if (length > v->length - v->pos || length != strlen(name) || 
+			memcmp(v->data + v->pos, name, length) != 0) 
+			return pv_fail(v, start, "Unexpected class definition");
+		v->pos += length;
+		v->class_index[cls] = v->map_count++;
+		v->map_count++;
+		return 1;
+	}
 
-	ptb_data_items(bf, "CDirection", (struct ptb_list **)&section->directions);
-	ptb_data_items(bf, "CChordText", (struct ptb_list **)&section->chordtexts);
-	ptb_data_items(bf, "CRhythmSlash", (struct ptb_list **)&section->rhythmslashes);
-	ptb_data_items(bf, "CStaff", (struct ptb_list **)&section->staffs);
-	/* FIXME: Barlinearray */
-	/* FIXME: Barline */
-	ptb_data_items(bf, "CMusicBar", (struct ptb_list **)&section->musicbars);
+	if (tag == PTB_BIG_OBJECT_TAG) {
+		if (4 > v->length - v->pos) 
+			return pv_fail(v, v->pos, "Unexpected end of file");
+		memcpy(&obtag, v->data + v->pos, 4);
+		v->pos += 4;
+	} else {
+		obtag = ((uint32_t)(tag & PTB_CLASS_TAG) << 16) | (tag & ~PTB_CLASS_TAG);
+	}
 
-	*dest = (struct ptb_list *)section;
+	if (!(obtag & PTB_BIG_CLASS_TAG)) 
+		return pv_fail(v, start, "Expected class tag");
+
+	if ((obtag & ~PTB_BIG_CLASS_TAG) != v->class_index[cls]) 
+		return pv_fail(v, start, "Reference to wrong class");
+
+	v->map_count++;
 	return 1;
 }
 
-static int handle_CTempoMarker (struct ptbf *bf, const char *section, struct ptb_list **dest) {
-	struct ptb_tempomarker *tempomarker = GET_ITEM(bf, dest, struct ptb_tempomarker);
+static int pv_items(struct ptb_validator *v, enum ptb_class cls);
 
-	ptb_data_uint8(bf, &tempomarker->section);
-	ptb_data_constant(bf, 0);
-	ptb_data_uint8(bf, &tempomarker->offset);
-	ptb_data_uint8(bf, &tempomarker->bpm);
-	ptb_data_constant(bf, 0);
-	ptb_data_uint16(bf, &tempomarker->type);
-	ptb_data_string(bf, &tempomarker->description);
+static int pv_item(struct ptb_validator *v, enum ptb_class cls)
+{
+	uint16_t next;
+	uint8_t n;
+
+	switch (cls) {
+	case PTB_CLASS_GUITAR:
+		return pv_skip(v, 1) && pv_string(v) && pv_skip(v, 8) && 
+			pv_string(v) && pv_skip(v, 1) && pv_uint8(v, &n) && pv_skip(v, n);
+	case PTB_CLASS_FLOATINGTEXT:
+		return pv_string(v) && pv_skip(v, 16 + 1) && pv_font(v);
+	case PTB_CLASS_CHORDDIAGRAM:
+		return pv_skip(v, 6 + 1) && pv_uint8(v, &n) && pv_skip(v, n);
+	case PTB_CLASS_TEMPOMARKER:
+		return pv_skip(v, 7) && pv_string(v);
+	case PTB_CLASS_LINEDATA:
+		return pv_skip(v, 3) && pv_uint8(v, &n) && pv_skip(v, 4 * n);
+	case PTB_CLASS_CHORDTEXT:
+		return pv_skip(v, 7);
+	case PTB_CLASS_GUITARIN:
+	case PTB_CLASS_DYNAMIC:
+	case PTB_CLASS_RHYTHMSLASH:
+		return pv_skip(v, 6);
+	case PTB_CLASS_SECTIONSYMBOL:
+		return pv_skip(v, 7);
+	case PTB_CLASS_MUSICBAR:
+		return pv_skip(v, 9) && pv_string(v);
+	case PTB_CLASS_DIRECTION:
+		return pv_skip(v, 1) && pv_uint8(v, &n) && pv_skip(v, 2 * n);
+	case PTB_CLASS_POSITION:
+		return pv_skip(v, 7) && pv_uint8(v, &n) && pv_skip(v, 4 * n) && 
+			pv_items(v, PTB_CLASS_LINEDATA);
+	case PTB_CLASS_STAFF:
+		if (!pv_skip(v, 5) || !pv_items(v, PTB_CLASS_POSITION)) return 0;
+		/* See handle_CStaff() */
+		if (2 <= v->length - v->pos) {
+			memcpy(&next, v->data + v->pos, 2);
+			if (next & 0x8000) return 1;
+		}
+		return pv_items(v, PTB_CLASS_POSITION);
+	case PTB_CLASS_SECTION:
+		return pv_skip(v, 30) && pv_string(v) && 
+			pv_items(v, PTB_CLASS_DIRECTION) && 
+			pv_items(v, PTB_CLASS_CHORDTEXT) && 
+			pv_items(v, PTB_CLASS_RHYTHMSLASH) && 
+			pv_items(v, PTB_CLASS_STAFF) && 
+			pv_items(v, PTB_CLASS_MUSICBAR);
+	default:
+		return pv_fail(v, v->pos, "Unknown class");
+	}
+}
+
+static int pv_items(struct ptb_validator *v, enum ptb_class cls)
+{
+	uint16_t l, nr_items;
+
+	if (!pv_uint16(v, &nr_items)) return 0;
+
+	for (l = 0; l < nr_items; l++) {
+		if (!pv_class_tag(v, cls) || !pv_item(v, cls)) 
+			return 0;
+	}
 
-	*dest = (struct ptb_list *)tempomarker;
 	return 1;
 }
 
-static int ptb_data_chordname(struct ptbf *bf, struct ptb_chordname *dest)
+static int pv_header(struct ptb_validator *v)
 {
-	int ret = 0;
-	ret += ptb_data(bf, dest->name, 2);
-	ret += ptb_data_uint8(bf, &dest->formula);
-	ret += ptb_data_uint16(bf, &dest->formula_mods);
-	ptb_data_uint8(bf, &dest->type);
+	uint8_t classification, release_type;
+	int i;
+
+	if (v->length < 4 || memcmp(v->data, "ptab", 4) != 0) 
+		return pv_fail(v, 0, "Not a PowerTab file");
+	v->pos = 4;
+
+	if (!pv_skip(v, 2) || !pv_uint8(v, &classification)) return 0;
+
+	switch (classification) {
+	case CLASSIFICATION_SONG:
+		if (!pv_skip(v, 1) || !pv_string(v) || !pv_string(v)) return 0;
+		if (!pv_uint8(v, &release_type)) return 0;
+		switch (release_type) {
+		case RELEASE_TYPE_PR_AUDIO:
+			if (!pv_skip(v, 1) || !pv_string(v) || !pv_skip(v, 3)) return 0;
+			break;
+		case RELEASE_TYPE_PR_VIDEO:
+			if (!pv_string(v) || !pv_skip(v, 1)) return 0;
+			break;
+		case RELEASE_TYPE_BOOTLEG:
+			if (!pv_string(v) || !pv_skip(v, 6)) return 0;
+			break;
+		case RELEASE_TYPE_UNRELEASED:
+			break;
+		default:
+			return pv_fail(v, v->pos - 1, "Unknown release type");
+		}
+		if (!pv_skip(v, 1)) return 0;
+		/* Authors, copyright, lyrics and notes */
+		for (i = 0; i < 9; i++) 
+			if (!pv_string(v)) return 0;
+		return 1;
+	case CLASSIFICATION_LESSON:
+		return pv_string(v) && pv_string(v) && pv_skip(v, 3) && 
+			pv_string(v) && pv_string(v) && pv_string(v);
+	default:
+		return pv_fail(v, v->pos - 1, "Unknown classification");
+	}
+}
+
+int ptb_validate(const char *data, size_t length, struct ptb_validation *result)
+{
+	static const enum ptb_class lists[] = {
+		PTB_CLASS_GUITAR, PTB_CLASS_CHORDDIAGRAM, PTB_CLASS_FLOATINGTEXT, 
+		PTB_CLASS_GUITARIN, PTB_CLASS_TEMPOMARKER, PTB_CLASS_DYNAMIC, 
+		PTB_CLASS_SECTIONSYMBOL, PTB_CLASS_SECTION
+	};
+	struct ptb_validator v;
+	size_t l;
+	int i;
+
+	memset(&v, 0, sizeof(v));
+	v.data = (const unsigned char *)data;
+	v.length = length;
+	v.map_count = 1;
+	v.result = result;
+	if (result) {
+		result->offset = 0;
+		result->error = NULL;
+	}
+
+	if (!pv_header(&v)) return -1;
+
+	for (i = 0; i < 2; i++) 
+		for (l = 0; l < sizeof(lists) / sizeof(lists[0]); l++) 
+			if (!pv_items(&v, lists[l])) return -1;
+
+	/* Fonts and the settings at the end */
+	if (!pv_font(&v) || !pv_font(&v) || !pv_font(&v) || !pv_skip(&v, 12)) 
+		return -1;
+
+	if (v.pos != v.length) {
+		pv_fail(&v, v.pos, "Trailing data after end of file");
+		return -1;
+	}
+
+	return 0;
+}
+
+int ptb_validate_file(const char *file, struct ptb_validation *result)
+{
+	struct ptbf *bf = ptb_new(NULL);
+	int ret;
+
+	if (result) {
+		result->offset = 0;
+		result->error = "Unable to read file";
+	}
+
+	if (bf == NULL) 
+		return -1;
+
+	ret = -1;
+	if (ptb_load_file(bf, file) == 0) 
+		ret = ptb_validate(bf->data, bf->length, result);
+
+	ptb_free(bf);
 	return ret;
 }
 
-static int handle_CChordDiagram (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_chorddiagram *chorddiagram = GET_ITEM(bf, dest, struct ptb_chorddiagram);
+const char *ptb_get_tone(ptb_tone id)
+{
+	const char *chords[] = { "", "", "", "", "", "", "", "", "", "", "", "", "", "", "", "", "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B", NULL };
+	if((sizeof(chords)/sizeof(chords[0])) < id) return "_UNKNOWN_CHORD_";
+	return chords[id];
+}
 
-	ptb_data_chordname(bf, &chorddiagram->name);
-	ptb_data_uint8(bf, &chorddiagram->frets);
-	ptb_data_uint8(bf, &chorddiagram->nr_strings);
-	chorddiagram->tones = malloc_p(uint8_t, chorddiagram->nr_strings);
-	ptb_data(bf, chorddiagram->tones, chorddiagram->nr_strings);
+const char *ptb_get_tone_full(ptb_tone id)
+{
+	const char *chords[] = { "c", "cis", "d", "dis", "e", "f", "fis", "g", "gis", "a", "ais", "b", NULL };
+	if(id < 16 || sizeof(chords) < id-16) return "_UNKNOWN_CHORD_";
+	return chords[id-16];
+}
 
-	*dest = (struct ptb_list *)chorddiagram;
-	return 1;
+static uint32_t ptb_position_units(struct ptb_position *p)
+{
+	return p->length?0x100 / p->length:0;
 }
 
-static int handle_CLineData (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_linedata *linedata = GET_ITEM(bf, dest, struct ptb_linedata);
+int ptb_index_staff(struct ptbf *bf, struct ptb_staff *staff)
+{
+	struct ptb_staff_index *idx;
+	struct ptb_position *p;
+	unsigned long n = 0;
+	uint32_t i, ticks;
+	int v;
+
+	/* Items in a cache image can not be replaced */
+	if (bf->cached) 
+		return -1;
 
-	ptb_data_uint8(bf, &linedata->tone);
-	ptb_data_uint8(bf, &linedata->properties);
-	ptb_assert_0(bf, linedata->properties
-			   & ~LINEDATA_PROPERTY_GHOST_NOTE
-			   & ~LINEDATA_PROPERTY_PULLOFF_FROM
-			   & ~LINEDATA_PROPERTY_HAMMERON_FROM
-			   & ~LINEDATA_PROPERTY_DEST_NOWHERE
-			   & ~LINEDATA_PROPERTY_TIE
-			   & ~LINEDATA_PROPERTY_NATURAL_HARMONIC
-			   & ~LINEDATA_PROPERTY_CONTINUES
-			   & ~LINEDATA_PROPERTY_MUTED);
-	ptb_data_uint8(bf, &linedata->transcribe);
-	ptb_assert(bf, linedata->transcribe == LINEDATA_TRANSCRIBE_8VA 
-			   ||  linedata->transcribe == LINEDATA_TRANSCRIBE_15MA
-			   ||  linedata->transcribe == LINEDATA_TRANSCRIBE_8VB
-			   ||  linedata->transcribe == LINEDATA_TRANSCRIBE_15MB
-			   ||  linedata->transcribe == 0);
-			   
-	ptb_data_uint8(bf, &linedata->conn_to_next);
-	
-	if(linedata->conn_to_next) { 
-		linedata->bends = malloc_p(struct ptb_bend, 1);
-		ptb_data(bf, linedata->bends, 4*linedata->conn_to_next);
-	} else {
-		linedata->bends = NULL;
+	if (!bf->arena) ptb_mem_free(&bf->allocator, staff->index);
+	staff->index = NULL;
+
+	for (v = 0; v < 2; v++) 
+		for (p = staff->positions[v]; p; p = p->next) 
+			n++;
+
+	/* Looked up by walking the lists instead */
+	if (n >= 0xffff) 
+		return -1;
+
+	idx = ptb_doc_alloc(bf, sizeof(*idx) + n * (sizeof(struct ptb_position *) + sizeof(uint32_t)));
+	if (idx == NULL) 
+		return -1;
+
+	idx->positions = (struct ptb_position **)(idx + 1);
+	idx->start = (uint32_t *)(idx->positions + n);
+
+	for (i = 0, v = 0; v < 2; v++) {
+		idx->first[v] = i;
+		idx->sorted[v] = 1;
+		for (ticks = 0, p = staff->positions[v]; p; p = p->next, i++) {
+			idx->positions[i] = p;
+			idx->start[i] = ticks;
+			ticks += ptb_position_units(p);
+			if (p->prev && p->prev->offset > p->offset) 
+				idx->sorted[v] = 0;
+		}
+		idx->end[v] = ticks;
 	}
+	idx->first[2] = i;
 
-	*dest = (struct ptb_list *)linedata;
-	return 1;
+	/* Backwards, so the first position with an offset wins */
+	while (i-- > 0) 
+		idx->by_offset[idx->positions[i]->offset] = i + 1;
+
+	staff->index = idx;
+	return 0;
 }
 
+struct ptb_position *ptb_get_position(struct ptb_staff *staff, int offset)
+{
+	int i;
 
-static int handle_CChordText (struct ptbf *bf, const char *section, struct ptb_list **dest) {
-	struct ptb_chordtext *chordtext = GET_ITEM(bf, dest, struct ptb_chordtext);
+	if (offset < 0 || offset > 0xff) 
+		return NULL;
 
-	ptb_data_uint8(bf, &chordtext->offset);
-	ptb_data_uint16(bf, chordtext->name);
+	if (staff->index) {
+		i = staff->index->by_offset[offset];
+		return i?staff->index->positions[i - 1]:NULL;
+	}
 
-	ptb_data_uint8(bf, &chordtext->properties);
-	ptb_assert_0(bf, chordtext->properties 
-			   & ~CHORDTEXT_PROPERTY_NOCHORD
-			   & ~CHORDTEXT_PROPERTY_PARENTHESES
-			   & ~0x0F /* Formula */
-			   & ~0xC0 /*FIXME*/);
-	ptb_data_uint8(bf, &chordtext->additions);
-	ptb_assert_0(bf, chordtext->additions 
-			   & ~CHORDTEXT_EXT_7_9
-			   & ~CHORDTEXT_EXT_7_13
-			   & ~CHORDTEXT_ADD_2
-			   & ~CHORDTEXT_ADD_9
-			   & ~CHORDTEXT_ADD_11
-			   & ~CHORDTEXT_PLUS_5);
-	ptb_data_uint8(bf, &chordtext->alterations);
-	ptb_data_uint8(bf, &chordtext->VII);
-	ptb_assert_0(bf, chordtext->VII 
-				 & ~CHORDTEXT_VII 
-				 & ~CHORDTEXT_VII_VI
-				 & ~CHORDTEXT_VII_OPEN
-				 & ~CHORDTEXT_VII_TYPE_2
-				 & ~CHORDTEXT_VII_TYPE_3
-				 	);
+	for(i = 0; i < 2; i++) {
+		struct ptb_position *p = staff->positions[i];
+		while(p) {
+			if(p->offset == offset) return p;
+			p = p->next;
+		}
+	}
+	return NULL;
+}
+
+/* Sum of 0x100 / length from the position at offset start up to the 
+ * first position at or after offset end in the same voice, -1 if 
+ * there is no position at start */
+static long ptb_staff_difference(struct ptb_staff *staff, int start, int end)
+{
+	struct ptb_staff_index *idx = staff->index;
+	struct ptb_position *gl;
+	uint32_t k, j, lo, hi;
+	long l = 0;
+	int v;
+
+	if (idx == NULL) {
+		gl = ptb_get_position(staff, start);
+		if (gl == NULL) return -1;
+		for (; gl && gl->offset < end; gl = gl->next) 
+			l += ptb_position_units(gl);
+		return l;
+	}
 
-	*dest = (struct ptb_list *)chordtext;
-	return 1;
-}
+	if (start < 0 || start > 0xff || idx->by_offset[start] == 0) 
+		return -1;
 
-static int handle_CGuitarIn (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_guitarin *guitarin = GET_ITEM(bf, dest, struct ptb_guitarin);
+	k = idx->by_offset[start] - 1;
+	v = (k >= idx->first[1]);
+	lo = k; hi = idx->first[v + 1];
 
-	ptb_data_uint8(bf, &guitarin->section);
-	ptb_data_constant(bf, 0x0); 
-	ptb_data_uint8(bf, &guitarin->staff);
-	ptb_data_uint8(bf, &guitarin->offset);
-	ptb_data_uint8(bf, &guitarin->rhythm_slash);
-	ptb_data_uint8(bf, &guitarin->staff_in);
+	if (idx->sorted[v]) {
+		while (lo < hi) {
+			j = lo + (hi - lo) / 2;
+			if (idx->positions[j]->offset < end) lo = j + 1;
+			else hi = j;
+		}
+		j = lo;
+	} else {
+		for (j = lo; j < hi && idx->positions[j]->offset < end; j++);
+	}
 
-	*dest = (struct ptb_list *)guitarin;
-	return 1;
+	return (j < idx->first[v + 1]?idx->start[j]:idx->end[v]) - idx->start[k];
 }
 
+/* Walk the sections of an instrument, whether they have been read 
+ * lazily or not */
+static struct ptb_section *ptb_next_section(struct ptbf *bf, int i, int n, struct ptb_section *prev)
+{
+	if (bf->instrument[i].section_index && !bf->instrument[i].sections) 
+		return ptb_get_section(bf, i, n);
 
-static int handle_CStaff (struct ptbf *bf, const char *section, struct ptb_list **dest)
-{ 
-	uint16_t next;
-	struct ptb_staff *staff = GET_ITEM(bf, dest, struct ptb_staff);
+	return prev?prev->next:bf->instrument[i].sections;
+}
 
-	ptb_data_uint8(bf, &staff->properties);
-	ptb_debug("Properties: %02x", staff->properties);
-	ptb_data_uint8(bf, &staff->highest_note_space);
-	ptb_data_uint8(bf, &staff->lowest_note_space);
-	ptb_data_uint8(bf, &staff->symbol_space);
-	ptb_data_uint8(bf, &staff->tab_staff_space);
+#define FLAT_ARRAY(flat,p,field,n) { (flat)->field = (void *)(p); (p) += sizeof(*(flat)->field) * (n); }
 
-	/* FIXME! */
-	ptb_data_items(bf, "CPosition", (struct ptb_list **)&staff->positions[0]);
-	/* This is ugly, but at least it works... */
-	if (bf->mode == O_RDONLY) {
-		ptb_data_uint16(bf, &next);
-		lseek(bf->fd, -2, SEEK_CUR); bf->curpos-=2;
-		if(next & 0x8000) {
-			*dest = (struct ptb_list *)staff;
-			staff->positions[1] = NULL;
-			return 1;
+struct ptb_flat *ptb_flatten(struct ptbf *bf)
+{
+	struct ptb_flat *flat, counts;
+	struct ptb_section *section;
+	struct ptb_staff *staff;
+	struct ptb_position *pos;
+	struct ptb_linedata *ld;
+	uint32_t s, p, nn;
+	char *mem;
+	int i, n, v;
+
+	/* Count everything first, so it can all go in one block */
+	memset(&counts, 0, sizeof(counts));
+	for (i = 0; i < 2; i++) {
+		for (n = 0, section = NULL; (section = ptb_next_section(bf, i, n, section)); n++) {
+			for (staff = section->staffs; staff; staff = staff->next) {
+				counts.nr_staffs++;
+				for (v = 0; v < 2; v++) {
+					for (pos = staff->positions[v]; pos; pos = pos->next) {
+						counts.nr_positions++;
+						for (ld = pos->linedatas; ld; ld = ld->next) 
+							counts.nr_notes++;
+					}
+				}
+			}
 		}
 	}
 
-	ptb_data_items(bf, "CPosition", (struct ptb_list **)&staff->positions[1]);
-	/* This is ugly, but at least it works... */
-	if (bf->mode == O_RDONLY) {
-		ptb_data_uint16(bf, &next);
-		lseek(bf->fd, -2, SEEK_CUR);bf->curpos-=2;
-		if(next & 0x8000) {
-			*dest = (struct ptb_list *)staff;
-			return 1;
+	/* Largest members first, to keep everything aligned */
+	mem = ptb_mem_alloc(&bf->allocator, sizeof(struct ptb_flat) 
+				 + sizeof(struct ptb_flat_staff) * counts.nr_staffs
+				 + sizeof(uint32_t) * (counts.nr_positions + 1)
+				 + sizeof(uint16_t) * counts.nr_positions
+				 + 3 * counts.nr_positions
+				 + 3 * counts.nr_notes);
+	if (mem == NULL) 
+		return NULL;
+
+	flat = (struct ptb_flat *)mem;
+	*flat = counts;
+	flat->allocator = bf->allocator;
+	mem += sizeof(struct ptb_flat);
+	FLAT_ARRAY(flat, mem, staffs, counts.nr_staffs);
+	FLAT_ARRAY(flat, mem, first_note, counts.nr_positions + 1);
+	FLAT_ARRAY(flat, mem, properties, counts.nr_positions);
+	FLAT_ARRAY(flat, mem, offset, counts.nr_positions);
+	FLAT_ARRAY(flat, mem, length, counts.nr_positions);
+	FLAT_ARRAY(flat, mem, dots, counts.nr_positions);
+	FLAT_ARRAY(flat, mem, string, counts.nr_notes);
+	FLAT_ARRAY(flat, mem, fret, counts.nr_notes);
+	FLAT_ARRAY(flat, mem, note_properties, counts.nr_notes);
+
+	s = p = nn = 0;
+	for (i = 0; i < 2; i++) {
+		for (n = 0, section = NULL; (section = ptb_next_section(bf, i, n, section)); n++) {
+			for (staff = section->staffs; staff; staff = staff->next, s++) {
+				flat->staffs[s].instrument = i;
+				flat->staffs[s].section = n;
+				for (v = 0; v < 2; v++) {
+					flat->staffs[s].first_position[v] = p;
+					for (pos = staff->positions[v]; pos; pos = pos->next, p++) {
+						flat->offset[p] = pos->offset;
+						flat->length[p] = pos->length;
+						flat->dots[p] = pos->dots;
+						flat->properties[p] = pos->properties;
+						flat->first_note[p] = nn;
+						for (ld = pos->linedatas; ld; ld = ld->next, nn++) {
+							flat->string[nn] = ld->detailed.string;
+							flat->fret[nn] = ld->detailed.fret;
+							flat->note_properties[nn] = ld->properties;
+						}
+					}
+					flat->staffs[s].nr_positions[v] = p - flat->staffs[s].first_position[v];
+				}
+			}
 		}
 	}
+	flat->first_note[p] = nn;
 
-	*dest = (struct ptb_list *)staff;
-	return 1;
+	return flat;
 }
 
+void ptb_free_flat(struct ptb_flat *flat)
+{
+	struct ptb_allocator allocator = flat->allocator;
+	ptb_mem_free(&allocator, flat);
+}
 
-static int handle_CPosition (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_position *position = GET_ITEM(bf, dest, struct ptb_position);
-	int i;
+/* Length of a position in ticks, taking dots, triplets and other 
+ * irregular groupings into account */
+uint32_t ptb_get_position_ticks(struct ptb_position *pos)
+{
+	uint64_t num = (uint64_t)PTB_TICKS_PER_QUARTER * 4, den = pos->length;
+	int grouping = pos->properties & POSITION_PROPERTY_IRREGULAR_GROUPING;
 
-	ptb_data_uint8(bf, &position->offset);
-	ptb_data_uint16(bf, &position->properties); 
-	ptb_assert_0(bf, position->properties 
-			   & ~POSITION_PROPERTY_IRREGULAR_GROUPING
-			   & ~POSITION_PROPERTY_IN_SINGLE_BEAM
-			   & ~POSITION_PROPERTY_IN_DOUBLE_BEAM
-			   & ~POSITION_PROPERTY_IN_TRIPLE_BEAM
-			   & ~POSITION_PROPERTY_FIRST_IN_BEAM
-			   & ~POSITION_PROPERTY_PARTIAL_BEAM
-			   & ~POSITION_PROPERTY_MIDDLE_IN_BEAM
-			   & ~POSITION_PROPERTY_LAST_IN_BEAM);
-	ptb_data_uint8(bf, &position->dots);
-	ptb_assert_0(bf, position->dots 
-				 	&~ POSITION_DOTS_1 
-				 	& ~POSITION_DOTS_2 
-					& ~POSITION_DOTS_REST 
-					& ~POSITION_DOTS_ARPEGGIO_UP 
-					& ~POSITION_DOTS_ARPEGGIO_DOWN
-					& ~POSITION_DOTS_WIDE_VIBRATO
-					& ~POSITION_DOTS_VIBRATO);
-	ptb_data_uint8(bf, &position->palm_mute);
-	ptb_assert_0(bf, position->palm_mute 
-				 & ~POSITION_PALM_MUTE 
-				 & ~POSITION_STACCATO 
-				 & ~POSITION_ACCENT
-				 & ~POSITION_HEAVY_ACCENT
-				 & ~POSITION_PICKSTROKE_DOWN
-				 & ~POSITION_TREMOLO_PICKING
-				 );
-	ptb_data_uint8(bf, &position->fermenta);
-	ptb_assert_0(bf, position->fermenta
-					& ~POSITION_FERMENTA_ACCIACCATURA
-					& ~POSITION_FERMENTA_LET_RING
-					& ~POSITION_FERMENTA_TRIPLET_FEEL_FIRST
-					& ~POSITION_FERMENTA_TRIPLET_FEEL_SECOND
-					& ~POSITION_FERMENTA_TRIPLET_1
-					& ~POSITION_FERMENTA_TRIPLET_2
-					& ~POSITION_FERMENTA_TRIPLET_3
-					& ~POSITION_FERMENTA_FERMENTA);
-	ptb_data_uint8(bf, &position->length);
-	
-	ptb_data_uint8(bf, &position->nr_additional_data);
+	if (den == 0) 
+		return 0;
 
-	position->additional = malloc_p(struct ptb_position_additional, position->nr_additional_data);
-	
-	for (i = 0; i < position->nr_additional_data; i++) {
-		ptb_data_uint8(bf, &position->additional[i].start_volume);
-		ptb_data_uint8(bf, &position->additional[i].end_volume);
-		ptb_data_uint8(bf, &position->additional[i].duration);
-		ptb_data_unknown(bf, 1, "FIXME");
+	if (pos->dots & POSITION_DOTS_2) { num *= 7; den *= 4; }
+	else if (pos->dots & POSITION_DOTS_1) { num *= 3; den *= 2; }
+
+	if (pos->fermenta & (POSITION_FERMENTA_TRIPLET_1 | POSITION_FERMENTA_TRIPLET_2 | POSITION_FERMENTA_TRIPLET_3)) {
+		num *= 2; den *= 3;
+	} else if (grouping) {
+		/* x notes in the time of y */
+		num *= grouping % 8 + 1;
+		den *= grouping / 8 + 1;
 	}
 
-	ptb_data_items(bf, "CLineData", (struct ptb_list **)&position->linedatas);
+	return (num + den / 2) / den;
+}
+
+static int ptb_timeline_cmp(const void *a, const void *b)
+{
+	const struct ptb_timeline_event *x = a, *y = b;
 
-	*dest = (struct ptb_list *)position;
-	return 1;
+	if (x->tick != y->tick) return x->tick < y->tick?-1:1;
+	if (x->staff != y->staff) return x->staff - y->staff;
+	if (x->voice != y->voice) return x->voice - y->voice;
+	return x->position->offset - y->position->offset;
 }
 
-static int handle_CDynamic (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_dynamic *dynamic = GET_ITEM(bf, dest, struct ptb_dynamic);
+/* Where the last search for an offset in a section ended */
+struct ptb_timeline_cursor {
+	uint32_t section;
+	uint32_t event;
+	int offset;
+};
 
-	ptb_data_uint16(bf, &dynamic->section);
-	ptb_data_uint8(bf, &dynamic->staff);
-	ptb_data_uint8(bf, &dynamic->position);
-	ptb_data_uint16(bf, &dynamic->volume);
+/* Tick of the first position at or after offset in a section that has 
+ * already been added to the timeline, or the end of the section if 
+ * there is none. The events are sorted by tick, so that is the first 
+ * event far enough along; increasing offsets in the same section 
+ * continue where the previous search stopped. */
+static uint32_t ptb_timeline_offset(struct ptb_timeline *tl, struct ptb_timeline_cursor *c, uint32_t s, int offset)
+{
+	struct ptb_timeline_section *ts = &tl->sections[s];
+	uint32_t end = ts->first_event + ts->nr_events;
 
-	*dest = (struct ptb_list *)dynamic;
-	return 1;
-}
+	if (ts->nr_events == 0) 
+		return ts->start;
 
-static int handle_CSectionSymbol (struct ptbf *bf, const char *section, struct ptb_list **dest) {
-	struct ptb_sectionsymbol *sectionsymbol = GET_ITEM(bf, dest, struct ptb_sectionsymbol);
+	if (c->section != s || c->event < ts->first_event || offset < c->offset) 
+		c->event = ts->first_event;
+	c->section = s;
+	c->offset = offset;
 
-	ptb_data_uint16(bf, &sectionsymbol->section);
-	ptb_data_uint8(bf, &sectionsymbol->position);
-	ptb_data_uint32(bf, &sectionsymbol->data);
+	while (c->event < end && tl->events[c->event].position->offset < offset) 
+		c->event++;
 
-	*dest = (struct ptb_list *)sectionsymbol;
-	return 1;
+	return c->event < end?tl->events[c->event].tick:ts->start + ts->length;
 }
 
-static int handle_CMusicBar (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_musicbar *musicbar = GET_ITEM(bf, dest, struct ptb_musicbar);
-											 
-	ptb_data_uint8(bf, &musicbar->offset);
-	ptb_data_uint8(bf, &musicbar->properties);
-	ptb_data_unknown(bf, 6, "FIXME");
-	ptb_data_uint8(bf, &musicbar->letter);
-	ptb_data_string(bf, &musicbar->description);
-
-	*dest = (struct ptb_list *)musicbar; 
-	return 1;
+/* Length of a bar in the time signature of a section. A section that 
+ * has none (1/1) gets a whole note, same as 4/4. */
+static uint32_t ptb_bar_ticks(struct ptb_section *section)
+{
+	return (section->detailed.beat_value + 1) * 4 * PTB_TICKS_PER_QUARTER 
+		/ (1 << section->detailed.beat);
 }
 
-static int handle_CRhythmSlash (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_rhythmslash *rhythmslash = GET_ITEM(bf, dest, struct ptb_rhythmslash);
-	
-	ptb_data_uint8(bf, &rhythmslash->offset);
-	ptb_data_uint8(bf, &rhythmslash->properties);
-	ptb_assert_0(bf, rhythmslash->properties 
-				 & ~RHYTHMSLASH_PROPERTY_FIRST_IN_BEAM
-				 & ~RHYTHMSLASH_PROPERTY_IN_SINGLE_BEAM
-				 & ~RHYTHMSLASH_PROPERTY_IN_DOUBLE_BEAM
-				 & ~RHYTHMSLASH_PROPERTY_LAST_IN_BEAM
-				 & ~RHYTHMSLASH_PROPERTY_PARTIAL_BEAM
-				 & ~RHYTHMSLASH_PROPERTY_TRIPLET_FIRST
-				 & ~RHYTHMSLASH_PROPERTY_TRIPLET_SECOND
-				 & ~RHYTHMSLASH_PROPERTY_TRIPLET_THIRD
-				 );
-	ptb_data_uint8(bf, &rhythmslash->dotted);
-	ptb_data_uint8(bf, &rhythmslash->extra);
-	ptb_assert_0(bf, rhythmslash->extra 
-				 & ~RHYTHMSLASH_EXTRA_ARPEGGIO_UP
-				 & ~RHYTHMSLASH_EXTRA_ACCENT
-				 & ~RHYTHMSLASH_EXTRA_HEAVY_ACCENT
-				 & ~0x18 /* FIXME */);
-	ptb_data_uint8(bf, &rhythmslash->length);
-	ptb_data_uint8(bf, &rhythmslash->singlenote);
+struct ptb_timeline *ptb_get_timeline(struct ptbf *bf, int instrument)
+{
+	struct ptb_timeline *tl, counts;
+	struct ptb_section *section;
+	struct ptb_staff *staff;
+	struct ptb_position *pos;
+	struct ptb_musicbar *bar;
+	struct ptb_tempomarker *tm;
+	struct ptb_timeline_cursor cursor;
+	uint32_t e, b, t, tick, end, bar_ticks;
+	char *mem;
+	int n, st, v;
+
+	if (instrument < 0 || instrument > 1) 
+		return NULL;
 
-	*dest = (struct ptb_list *)rhythmslash;
-	return 1;
-}
+	memset(&counts, 0, sizeof(counts));
+	for (n = 0, section = NULL; (section = ptb_next_section(bf, instrument, n, section)); n++) {
+		counts.nr_sections++;
+		counts.nr_bars++;
+		for (bar = section->musicbars; bar; bar = bar->next) 
+			counts.nr_bars++;
+		for (staff = section->staffs; staff; staff = staff->next) 
+			for (v = 0; v < 2; v++) 
+				for (pos = staff->positions[v]; pos; pos = pos->next) 
+					counts.nr_events++;
+	}
+	counts.nr_tempos = 1;
+	for (tm = bf->instrument[instrument].tempomarkers; tm; tm = tm->next) 
+		counts.nr_tempos++;
+
+	/* Largest members first, to keep everything aligned */
+	mem = ptb_mem_alloc(&bf->allocator, sizeof(struct ptb_timeline) 
+				 + sizeof(struct ptb_timeline_event) * counts.nr_events
+				 + sizeof(struct ptb_timeline_tempo) * counts.nr_tempos
+				 + sizeof(struct ptb_timeline_section) * counts.nr_sections
+				 + sizeof(uint32_t) * counts.nr_bars);
+	if (mem == NULL) 
+		return NULL;
 
-static int handle_CDirection (struct ptbf *bf, const char *section, struct ptb_list **dest) { 
-	struct ptb_direction *direction = GET_ITEM(bf, dest, struct ptb_direction);
+	tl = (struct ptb_timeline *)mem;
+	*tl = counts;
+	tl->allocator = bf->allocator;
+	mem += sizeof(struct ptb_timeline);
+	FLAT_ARRAY(tl, mem, events, counts.nr_events);
+	FLAT_ARRAY(tl, mem, tempos, counts.nr_tempos);
+	FLAT_ARRAY(tl, mem, sections, counts.nr_sections);
+	FLAT_ARRAY(tl, mem, bars, counts.nr_bars);
+
+	/* Sections follow each other, and last as long as their longest 
+	 * voice */
+	e = b = tick = 0;
+	for (n = 0, section = NULL; (section = ptb_next_section(bf, instrument, n, section)); n++) {
+		struct ptb_timeline_section *ts = &tl->sections[n];
+
+		ts->section = section;
+		ts->start = tick;
+		ts->first_event = e;
+		for (st = 0, staff = section->staffs; staff; staff = staff->next, st++) {
+			for (v = 0; v < 2; v++) {
+				for (end = tick, pos = staff->positions[v]; pos; pos = pos->next, e++) {
+					tl->events[e].tick = end;
+					tl->events[e].duration = ptb_get_position_ticks(pos);
+					tl->events[e].section = n;
+					tl->events[e].staff = st;
+					tl->events[e].voice = v;
+					tl->events[e].position = pos;
+					end += tl->events[e].duration;
+				}
+				if (end - tick > ts->length) ts->length = end - tick;
+			}
+		}
+		ts->nr_events = e - ts->first_event;
 
-	ptb_data_unknown(bf, 1, "FIXME");
-	ptb_data_uint8(bf, &direction->nr_items);
-	ptb_data_unknown(bf, 2 * direction->nr_items, "FIXME");
+		/* Whole bars, and at least one */
+		bar_ticks = ptb_bar_ticks(section);
+		ts->length = ts->length?(ts->length + bar_ticks - 1) / bar_ticks * bar_ticks:bar_ticks;
 
-	*dest = (struct ptb_list *)direction;
-	return 1;
+		qsort(tl->events + ts->first_event, ts->nr_events, sizeof(struct ptb_timeline_event), ptb_timeline_cmp);
+
+		tl->bars[b++] = tick;
+		memset(&cursor, 0, sizeof(cursor));
+		for (bar = section->musicbars; bar; bar = bar->next) 
+			tl->bars[b++] = ptb_timeline_offset(tl, &cursor, n, bar->offset);
+
+		tick += ts->length;
+	}
+	tl->length = tick;
+
+	/* Tempo markers apply from their position onwards, before the first 
+	 * one the tempo is PTB_DEFAULT_BPM */
+	tl->tempos[0].bpm = PTB_DEFAULT_BPM;
+	memset(&cursor, 0, sizeof(cursor));
+	for (t = 1, tm = bf->instrument[instrument].tempomarkers; tm; tm = tm->next) {
+		struct ptb_timeline_tempo tmp;
+		uint32_t i;
+
+		if (tm->bpm == 0) continue;
+		tmp.tick = tm->section < tl->nr_sections?ptb_timeline_offset(tl, &cursor, tm->section, tm->offset):tl->length;
+		tmp.bpm = tm->bpm;
+
+		/* Keep them sorted; there are only a few */
+		for (i = t++; i > 0 && tl->tempos[i - 1].tick > tmp.tick; i--) 
+			tl->tempos[i] = tl->tempos[i - 1];
+		tl->tempos[i] = tmp;
+	}
+	tl->nr_tempos = t;
+
+	for (t = 1; t < tl->nr_tempos; t++) {
+		struct ptb_timeline_tempo *prev = &tl->tempos[t - 1];
+		tl->tempos[t].seconds = prev->seconds + 
+			(double)(tl->tempos[t].tick - prev->tick) * 60.0 / (prev->bpm * PTB_TICKS_PER_QUARTER);
+	}
+
+	return tl;
 }
 
-struct ptb_section_handler ptb_section_handlers[] = {
-	{"CGuitar", handle_CGuitar },
-	{"CFloatingText", handle_CFloatingText },
-	{"CChordDiagram", handle_CChordDiagram },
-	{"CTempoMarker", handle_CTempoMarker},
-	{"CLineData", handle_CLineData },
-	{"CChordText", handle_CChordText },
-	{"CGuitarIn", handle_CGuitarIn },
-	{"CStaff", handle_CStaff },
-	{"CPosition", handle_CPosition },
-	{"CSection", handle_CSection },
-	{"CDynamic", handle_CDynamic },
-	{"CSectionSymbol", handle_CSectionSymbol },
-	{"CMusicBar", handle_CMusicBar },
-	{"CRhythmSlash", handle_CRhythmSlash },
-	{"CDirection", handle_CDirection },
-	{ 0, handle_unknown}
-};
+void ptb_free_timeline(struct ptb_timeline *tl)
+{
+	struct ptb_allocator allocator = tl->allocator;
+	ptb_mem_free(&allocator, tl);
+}
 
-const char *ptb_get_tone(ptb_tone id)
+long ptb_timeline_find(const struct ptb_timeline *tl, uint32_t tick)
 {
-	const char *chords[] = { "", "", "", "", "", "", "", "", "", "", "", "", "", "", "", "", "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B", NULL };
-	if((sizeof(chords)/sizeof(chords[0])) < id) return "_UNKNOWN_CHORD_";
-	return chords[id];
+	uint32_t lo = 0, hi = tl->nr_events, mid;
+
+	/* First event after tick */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->events[mid].tick <= tick) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return (long)lo - 1;
 }
 
-const char *ptb_get_tone_full(ptb_tone id)
+/* Last tempo change at or before tick */
+static const struct ptb_timeline_tempo *ptb_timeline_tempo(const struct ptb_timeline *tl, uint32_t tick)
 {
-	const char *chords[] = { "c", "cis", "d", "dis", "e", "f", "fis", "g", "gis", "a", "ais", "b", NULL };
-	if(id < 16 || sizeof(chords) < id-16) return "_UNKNOWN_CHORD_";
-	return chords[id-16];
+	uint32_t lo = 1, hi = tl->nr_tempos, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->tempos[mid].tick <= tick) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return &tl->tempos[lo - 1];
 }
 
-static struct ptb_position *get_position(struct ptb_staff *staff, int offset)
+double ptb_timeline_seconds(const struct ptb_timeline *tl, uint32_t tick)
 {
-	int i;
-	for(i = 0; i < 2; i++) {
-		struct ptb_position *p = staff->positions[i];
-		while(p) {
-			if(p->offset == offset) return p;
-			p = p->next;
-		}
+	const struct ptb_timeline_tempo *tempo = ptb_timeline_tempo(tl, tick);
+
+	return tempo->seconds + (double)(tick - tempo->tick) * 60.0 / (tempo->bpm * PTB_TICKS_PER_QUARTER);
+}
+
+uint32_t ptb_timeline_ticks(const struct ptb_timeline *tl, double seconds)
+{
+	uint32_t lo = 1, hi = tl->nr_tempos, mid;
+	const struct ptb_timeline_tempo *tempo;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->tempos[mid].seconds <= seconds) lo = mid + 1;
+		else hi = mid;
 	}
-	return NULL;
+
+	tempo = &tl->tempos[lo - 1];
+	if (seconds <= tempo->seconds) 
+		return tempo->tick;
+	return tempo->tick + (uint32_t)((seconds - tempo->seconds) * tempo->bpm * PTB_TICKS_PER_QUARTER / 60.0);
 }
 
 void ptb_get_position_difference(struct ptb_section *section, int start, int end, int *bars, int *length)
 {
 	long l = 0;
-	struct ptb_staff *staff = section->staffs;
-	struct ptb_position *gl = NULL;
+	struct ptb_staff *staff;
 
-	while(staff) { 
-		gl = get_position(staff, start);
-		if(gl) break;
-		staff = staff->next;
+	for (staff = section->staffs; staff; staff = staff->next) {
+		l = ptb_staff_difference(staff, start, end);
+		if (l >= 0) break;
 	}
 
-	while(gl) {
-		if(gl->offset >= end) break;
-		l += 0x100 / gl->length;
-		gl = gl->next;
-	}
+	if (l < 0) l = 0;
 
 	*bars = l / 0x100;
 
@@ -1085,46 +3092,48 @@ void ptb_get_position_difference(struct ptb_section *section, int start, int end
 	if(l % 0x100) *length = 0x100 / (l % 0x100) ;
 }	
 
-static void ptb_free_hdr(struct ptb_hdr *hdr)
+static void ptb_free_hdr(const struct ptb_allocator *a, struct ptb_hdr *hdr)
 {
 	if (hdr->classification == CLASSIFICATION_SONG) { 
 		switch (hdr->class_info.song.release_type) {
 		case RELEASE_TYPE_PR_AUDIO:
-			free(hdr->class_info.song.release_info.pr_audio.album_title);
+			ptb_mem_free(a, hdr->class_info.song.release_info.pr_audio.album_title);
 			break;
 		case RELEASE_TYPE_PR_VIDEO:
-			free(hdr->class_info.song.release_info.pr_video.video_title);
+			ptb_mem_free(a, hdr->class_info.song.release_info.pr_video.video_title);
 			break;
 		case RELEASE_TYPE_BOOTLEG:
-			free(hdr->class_info.song.release_info.bootleg.title);
+			ptb_mem_free(a, hdr->class_info.song.release_info.bootleg.title);
 			break;
 		default: break;
 		}
-		free (hdr->class_info.song.title);
-		free (hdr->class_info.song.artist);
-		free (hdr->class_info.song.words_by);
-		free (hdr->class_info.song.music_by);
-		free (hdr->class_info.song.arranged_by);
-		free (hdr->class_info.song.guitar_transcribed_by);
-		free (hdr->class_info.song.lyrics);
-		free (hdr->class_info.song.copyright);
+		ptb_mem_free(a, hdr->class_info.song.title);
+		ptb_mem_free(a, hdr->class_info.song.artist);
+		ptb_mem_free(a, hdr->class_info.song.words_by);
+		ptb_mem_free(a, hdr->class_info.song.music_by);
+		ptb_mem_free(a, hdr->class_info.song.arranged_by);
+		ptb_mem_free(a, hdr->class_info.song.guitar_transcribed_by);
+		ptb_mem_free(a, hdr->class_info.song.bass_transcribed_by);
+		ptb_mem_free(a, hdr->class_info.song.lyrics);
+		ptb_mem_free(a, hdr->class_info.song.copyright);
 	} else if (hdr->classification == CLASSIFICATION_LESSON) {
-		free(hdr->class_info.lesson.artist);
-		free(hdr->class_info.lesson.title);
-		free(hdr->class_info.lesson.author);
-		free(hdr->class_info.lesson.copyright);
+		ptb_mem_free(a, hdr->class_info.lesson.artist);
+		ptb_mem_free(a, hdr->class_info.lesson.title);
+		ptb_mem_free(a, hdr->class_info.lesson.author);
+		ptb_mem_free(a, hdr->class_info.lesson.copyright);
 	}
 
-	free(hdr->guitar_notes);
-	free(hdr->bass_notes);
-	free(hdr->drum_notes);
+	ptb_mem_free(a, hdr->guitar_notes);
+	ptb_mem_free(a, hdr->bass_notes);
+	ptb_mem_free(a, hdr->drum_notes);
 }
 
-static void ptb_free_font(struct ptb_font *f)
+static void ptb_free_font(const struct ptb_allocator *a, struct ptb_font *f)
 {
-	free(f->family);
+	ptb_mem_free(a, f->family);
 }
 
+/* Items are released with allocator a */
 #define FREE_LIST(ls, em, type) \
 { \
 	type tmp; \
@@ -1132,78 +3141,166 @@ static void ptb_free_font(struct ptb_font *f)
 	for (tmp = ls; tmp; tmp = tmp_next) { \
 		em; \
 		tmp_next = tmp->next; \
-		if (tmp->prev) free(tmp); \
+		ptb_mem_free(a, tmp); \
 	} \
 }
 
-static void ptb_free_position(struct ptb_position *pos)
+static void ptb_free_position(const struct ptb_allocator *a, struct ptb_position *pos)
 {
-	free(pos->additional);
-	FREE_LIST(pos->linedatas, free(tmp->bends), struct ptb_linedata *);
+	ptb_mem_free(a, pos->additional);
+	FREE_LIST(pos->linedatas, ptb_mem_free(a, tmp->bends), struct ptb_linedata *);
 }
 
-static void ptb_free_staff(struct ptb_staff *staff)
+static void ptb_free_staff(const struct ptb_allocator *a, struct ptb_staff *staff)
 {
 	int i;
+	ptb_mem_free(a, staff->index);
 	for (i = 0; i < 2; i++) {
-		FREE_LIST( staff->positions[i], ptb_free_position(tmp), struct ptb_position *);
+		FREE_LIST( staff->positions[i], ptb_free_position(a, tmp), struct ptb_position *);
 	}
 }
 
-static void ptb_free_section(struct ptb_section *section)
+static void ptb_free_section(const struct ptb_allocator *a, struct ptb_section *section)
 {
-	FREE_LIST(section->staffs, ptb_free_staff(tmp), struct ptb_staff *);
+	FREE_LIST(section->staffs, ptb_free_staff(a, tmp), struct ptb_staff *);
 	FREE_LIST(section->chordtexts, {} , struct ptb_chordtext *);
 	FREE_LIST(section->rhythmslashes, {}, struct ptb_rhythmslash *);
 	FREE_LIST(section->directions, {}, struct ptb_direction *);
-	FREE_LIST(section->musicbars, free(tmp->description), struct ptb_musicbar *);
+	FREE_LIST(section->musicbars, ptb_mem_free(a, tmp->description), struct ptb_musicbar *);
 }
 
 void ptb_free(struct ptbf *bf)
 {
+	struct ptb_allocator allocator = bf->allocator;
+	const struct ptb_allocator *a = &allocator;
 	int i;
-	ptb_free_hdr(&bf->hdr);
-	ptb_free_font(&bf->default_font);
-	ptb_free_font(&bf->chord_name_font);
-	ptb_free_font(&bf->tablature_font);
 
-	free(bf->filename);
+	ptb_mem_free(a, bf->stats);
+
+	/* The document is part of the cache image */
+	if (bf->cached) {
+		struct ptbf image = *bf;
+		ptb_mem_free(a, bf->filename);
+		ptb_release_data(&image);
+		return;
+	}
+
+	ptb_release_data(bf);
+	ptb_mem_free(a, bf->filename);
+
+	/* Everything else was allocated from the arena, no need 
+	 * to walk the document */
+	if (bf->arena) {
+		ptb_arena_free(bf->arena);
+		ptb_mem_free(a, bf);
+		return;
+	}
+
+	ptb_free_hdr(a, &bf->hdr);
+	ptb_free_font(a, &bf->default_font);
+	ptb_free_font(a, &bf->chord_name_font);
+	ptb_free_font(a, &bf->tablature_font);
 
 	for (i = 0; i < 2; i++) 
 	{
 		FREE_LIST(
 			bf->instrument[i].floatingtexts, 
-			free(tmp->text); ptb_free_font(&tmp->font);,
+			ptb_mem_free(a, tmp->text); ptb_free_font(a, &tmp->font);,
 			struct ptb_floatingtext *);
 		
 		FREE_LIST(
 			bf->instrument[i].guitars,
-			free(tmp->title); free(tmp->type),
+			ptb_mem_free(a, tmp->title); ptb_mem_free(a, tmp->type); ptb_mem_free(a, tmp->strings),
 			struct ptb_guitar *);
 
+		FREE_LIST(
+			bf->instrument[i].guitarins,
+			{},
+			struct ptb_guitarin *);
+
 		FREE_LIST(
 			bf->instrument[i].tempomarkers,
-			free(tmp->description),
+			ptb_mem_free(a, tmp->description),
 			struct ptb_tempomarker *);
 
+		FREE_LIST(
+			bf->instrument[i].dynamics,
+			{},
+			struct ptb_dynamic *);
+
 		FREE_LIST(
 			bf->instrument[i].chorddiagrams,
-			free(tmp->tones),
+			ptb_mem_free(a, tmp->tones),
 			struct ptb_chorddiagram *);
 			
+		/* Lazily read sections that never made it into the list */
+		if (bf->instrument[i].section_index && !bf->instrument[i].sections) {
+			int n;
+			for (n = 0; n < bf->instrument[i].nr_sections; n++) {
+				struct ptb_section *section = bf->instrument[i].section_index[n].section;
+				if (section == NULL) continue;
+				ptb_mem_free(a, section->description);
+				ptb_free_section(a, section);
+				ptb_mem_free(a, section);
+			}
+		}
+
 		FREE_LIST(
 			bf->instrument[i].sections,
-			free(tmp->description);
-			ptb_free_section(tmp),
+			ptb_mem_free(a, tmp->description);
+			ptb_free_section(a, tmp),
 			struct ptb_section *);
 
+		ptb_mem_free(a, bf->instrument[i].section_index);
+
 		FREE_LIST(
 			bf->instrument[i].sectionsymbols,
 		{},
 			struct ptb_sectionsymbol *);
 	}
 	
-	free(bf);
+	ptb_mem_free(a, bf);
+}
+
+void ptb_init_pitch_table(struct ptb_pitch_table *table, struct ptb_guitar *gtr, int sounding)
+{
+	int string, fret, open;
+
+	memset(table, 0, sizeof(*table));
+
+	for (string = 0; string < gtr->nr_strings && string < PTB_PITCH_STRINGS; string++) {
+		open = gtr->strings[string];
+		if (sounding) open += gtr->capo + (int8_t)gtr->half_up;
+
+		for (fret = 0; fret < PTB_PITCH_FRETS; fret++) {
+			int pitch = open + fret;
+			table->pitch[string][fret] = pitch < 0?0:(pitch > 127?127:pitch);
+		}
+	}
+}
+
+size_t ptb_get_section_pitches(const struct ptb_pitch_table *tables, int nr_tables, struct ptb_section *section, uint8_t *pitches, size_t n)
+{
+	const struct ptb_pitch_table *table;
+	struct ptb_staff *staff;
+	struct ptb_position *pos;
+	struct ptb_linedata *ld;
+	size_t i = 0;
+	int v, nr_staff = 0;
+
+	for (staff = section->staffs; staff; staff = staff->next, nr_staff++) {
+		table = nr_staff < nr_tables?&tables[nr_staff]:NULL;
+		for (v = 0; v < 2; v++) {
+			for (pos = staff->positions[v]; pos; pos = pos->next) {
+				for (ld = pos->linedatas; ld; ld = ld->next, i++) {
+					if (i >= n) continue;
+					pitches[i] = table?table->pitch[ld->detailed.string][ld->detailed.fret]:0;
+				}
+			}
+		}
+	}
+
+	return i;
 }
 
 uint8_t ptb_get_octave(struct ptb_guitar *gtr, uint8_t string, uint8_t fret)
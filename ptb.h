@@ -22,6 +22,7 @@
 
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #if defined(_MSC_VER) && !defined(PTB_CORE)
 #pragma comment(lib,"ptb.lib")
@@ -350,6 +351,9 @@ struct ptb_staff {
 	 * second is for low melody
 	 */
 	struct ptb_position *positions[2];
+
+	/* Finds positions by offset, see ptb_index_staff() */
+	struct ptb_staff_index *index;
 };
 
 struct ptb_bend
@@ -415,6 +419,7 @@ struct ptb_section {
 	/* Number of times to repeat OR-ed with end mark type */
 	uint8_t end_mark;
 	uint16_t meter_type;
+	/* Time signature: beat_value + 1 beats of a 1 << beat note */
 	union {
 		uint8_t beat_info;
 		struct {
@@ -484,11 +489,101 @@ struct ptb_direction {
 	uint8_t nr_items;
 };
 
+/* The MFC classes that make up a PowerTab file */
+enum ptb_class {
+	PTB_CLASS_GUITAR = 0,
+	PTB_CLASS_FLOATINGTEXT,
+	PTB_CLASS_CHORDDIAGRAM,
+	PTB_CLASS_TEMPOMARKER,
+	PTB_CLASS_LINEDATA,
+	PTB_CLASS_CHORDTEXT,
+	PTB_CLASS_GUITARIN,
+	PTB_CLASS_STAFF,
+	PTB_CLASS_POSITION,
+	PTB_CLASS_SECTION,
+	PTB_CLASS_DYNAMIC,
+	PTB_CLASS_SECTIONSYMBOL,
+	PTB_CLASS_MUSICBAR,
+	PTB_CLASS_RHYTHMSLASH,
+	PTB_CLASS_DIRECTION,
+	PTB_CLASS_MAX
+};
+
+/* Memory management hooks, so the library can use a different 
+ * allocator than malloc(). alloc and realloc return NULL if no memory 
+ * is available; data is passed along to every call. An allocator that 
+ * is all zeroes stands for malloc(), realloc() and free(). */
+struct ptb_allocator {
+	void *(*alloc) (void *data, size_t size);
+	void *(*realloc) (void *data, void *ptr, size_t size);
+	void (*free) (void *data, void *ptr);
+	void *data;
+};
+
+/* Settings for a single read or write. All state used while parsing 
+ * lives either in here or in struct ptbf, so different files can be 
+ * handled from different threads at the same time. */
+struct ptb_parse_options {
+	int debug;
+	int asserts_fatal;
+	int use_arena; /* See ptb_set_arena() */
+	int lazy_sections; /* Only decode sections when ptb_get_section() asks for them */
+	int stats; /* Collect statistics, see ptb_get_stats() */
+	void (*error_fn) (const char *, va_list); /* NULL to ignore errors */
+	/* Allocator for the document and anything returned by the call, 
+	 * NULL for the one set with ptb_set_allocator() */
+	const struct ptb_allocator *allocator;
+};
+
+/* What went into reading a document */
+struct ptb_stats {
+	struct ptb_class_stats {
+		const char *name; /* MFC class name (CSection, CPosition, ...) */
+		unsigned long items;
+		unsigned long bytes; /* Not counting the items it contains */
+	} classes[PTB_CLASS_MAX];
+	unsigned long allocs; /* Allocations made for the document */
+	unsigned long alloc_bytes;
+	/* Seconds spent reading each list of the two instruments, e.g. 
+	 * list_time[0][PTB_CLASS_SECTION] for the guitar sections. Sections 
+	 * that are decoded later on (lazy_sections) are not included. */
+	double list_time[2][PTB_CLASS_MAX];
+	double time; /* Seconds spent reading the whole file */
+};
+
+/* Where to find a section that has not been decoded yet */
+struct ptb_section_index {
+	off_t offset;
+	uint32_t map_count;
+	struct ptb_section *section; /* NULL until decoded */
+};
+
 struct ptbf {
 	int fd;
 	int mode;
 	char *filename;
-	char *data;
+	char *data; /* Input buffer, only valid while parsing */
+	size_t length;
+	int data_source;
+	struct ptb_arena *arena;
+	struct ptb_allocator allocator; /* Everything in the document comes from here */
+	struct ptb_parse_options options;
+	int debug_level;
+	uint32_t class_index[PTB_CLASS_MAX]; /* MFC class id of each class, 0 if not seen yet */
+	uint32_t map_count; /* Next MFC class/object id */
+	int skipping; /* Only looking for the start of each section */
+	int out_of_memory; /* The allocator failed, reading is aborted */
+	int cached; /* Part of a cache image, see ptb_open_cache() */
+	struct ptb_stats *stats; /* Only with the stats option */
+	off_t nested_bytes; /* Size of the items contained in the current one */
+	/* Only used by ptb_parse_file() and ptb_parse_mem() */
+	const struct ptb_events *events;
+	void *events_data;
+	int cur_instrument;
+	int cur_voice;
+	struct ptb_section *cur_section;
+	struct ptb_staff *cur_staff;
+	struct ptb_position *cur_position;
 	struct ptb_hdr hdr;
 	struct ptb_instrument {
 		struct ptb_guitar *guitars;
@@ -499,6 +594,9 @@ struct ptbf {
 		struct ptb_dynamic *dynamics;
 		struct ptb_floatingtext *floatingtexts;
 		struct ptb_sectionsymbol *sectionsymbols;
+		/* Only set when reading with lazy_sections */
+		struct ptb_section_index *section_index;
+		uint16_t nr_sections;
 	} instrument[2];
 	off_t curpos;
 	struct ptb_font default_font;
@@ -509,19 +607,233 @@ struct ptbf {
 	uint32_t fade_out; /* amount of fade-out at end of song */
 };
 
+/* The buffer is parsed in place and only needs to remain valid for the 
+ * duration of the call, except when the lazy_sections option is used 
+ * (see ptb_read_mem_ex()): ptb_get_section() then decodes sections from 
+ * it, so it has to remain valid until ptb_free() */
 extern struct ptbf *ptb_read_mem(const char *data, size_t length);
 extern struct ptbf *ptb_read_file(const char *ptb);
 extern int ptb_write_file(const char *ptb, struct ptbf *);
+/* Returns a newly allocated buffer with the encoded file */
+extern char *ptb_write_mem(struct ptbf *, size_t *length);
 extern void ptb_free(struct ptbf *);
 
+/* Same as the above, but with explicit options rather than the ones set 
+ * with the ptb_set_*() functions below. opts may be NULL for the defaults. 
+ * A single document should still only be used by one thread at a time. */
+extern void ptb_init_parse_options(struct ptb_parse_options *opts);
+extern struct ptbf *ptb_read_mem_ex(const char *data, size_t length, const struct ptb_parse_options *opts);
+extern struct ptbf *ptb_read_file_ex(const char *ptb, const struct ptb_parse_options *opts);
+extern int ptb_write_file_ex(const char *ptb, struct ptbf *, const struct ptb_parse_options *opts);
+extern char *ptb_write_mem_ex(struct ptbf *, size_t *length, const struct ptb_parse_options *opts);
+
+/* Save a copy of a document that can be loaded again by simply mapping 
+ * it. Cache files are specific to the platform and ptabtools version. */
+extern int ptb_save_cache(const char *cache, struct ptbf *);
+/* Open a cache written by ptb_save_cache(). If file is not NULL, it 
+ * is the .ptb file the cache was made from; it is parsed instead 
+ * (and the cache updated) if the cache is missing or out of date. 
+ * As with arenas, the items in the document can not be freed or 
+ * replaced individually. */
+extern struct ptbf *ptb_open_cache(const char *cache, const char *file, const struct ptb_parse_options *opts);
+
+/* Where ptb_validate() found a problem */
+struct ptb_validation {
+	size_t offset; /* In the file */
+	const char *error; /* NULL if there was no problem */
+};
+
+/* Check that the lists, class tags and strings in a file are consistent 
+ * with each other and the size of the file, without building a document 
+ * or allocating memory. Field values are not checked. Returns 0 if the 
+ * file is fine; otherwise the first problem is described in result 
+ * (which may be NULL). */
+extern int ptb_validate(const char *data, size_t length, struct ptb_validation *result);
+extern int ptb_validate_file(const char *ptb, struct ptb_validation *result);
+
+/* Statistics gathered while reading a document with the stats option, 
+ * NULL if there are none. Remains valid until ptb_free(). */
+extern const struct ptb_stats *ptb_get_stats(struct ptbf *);
+
+/* Callbacks for ptb_parse_file() and ptb_parse_mem(), any of which may 
+ * be NULL. Items are passed in file order, parents before their children; 
+ * on_section_end is called once the complete section has been read. */
+struct ptb_events {
+	void (*on_header) (void *data, struct ptb_hdr *);
+	void (*on_guitar) (void *data, int instrument, struct ptb_guitar *);
+	void (*on_chorddiagram) (void *data, int instrument, struct ptb_chorddiagram *);
+	void (*on_floatingtext) (void *data, int instrument, struct ptb_floatingtext *);
+	void (*on_guitarin) (void *data, int instrument, struct ptb_guitarin *);
+	void (*on_tempomarker) (void *data, int instrument, struct ptb_tempomarker *);
+	void (*on_dynamic) (void *data, int instrument, struct ptb_dynamic *);
+	void (*on_sectionsymbol) (void *data, int instrument, struct ptb_sectionsymbol *);
+	void (*on_section_begin) (void *data, int instrument, struct ptb_section *);
+	void (*on_direction) (void *data, struct ptb_section *, struct ptb_direction *);
+	void (*on_chordtext) (void *data, struct ptb_section *, struct ptb_chordtext *);
+	void (*on_rhythmslash) (void *data, struct ptb_section *, struct ptb_rhythmslash *);
+	void (*on_staff) (void *data, struct ptb_section *, struct ptb_staff *);
+	void (*on_position) (void *data, struct ptb_staff *, int voice, struct ptb_position *);
+	void (*on_linedata) (void *data, struct ptb_position *, struct ptb_linedata *);
+	void (*on_musicbar) (void *data, struct ptb_section *, struct ptb_musicbar *);
+	void (*on_section_end) (void *data, int instrument, struct ptb_section *);
+};
+
+/* Decode a file in a single pass, calling the callbacks in events rather 
+ * than building a document. The lists in the items passed are never 
+ * filled in, and an item is only valid until the top-level item 
+ * (section, guitar, ...) it is part of has been handled, so memory 
+ * use does not grow with the size of the file. Returns 0 on success. */
+extern int ptb_parse_file(const char *ptb, const struct ptb_events *events, void *data, const struct ptb_parse_options *opts);
+extern int ptb_parse_mem(const char *buf, size_t length, const struct ptb_events *events, void *data, const struct ptb_parse_options *opts);
+
+/* The ptb_set_*() functions change process-wide defaults and must not be 
+ * called while other threads are using the library; use the _ex() 
+ * functions with a struct ptb_parse_options of their own instead. */
 extern void ptb_set_debug(int level);
 extern void ptb_set_asserts_fatal(int yes);
+/* Allocate documents read from now on from a single arena. This makes 
+ * reading and ptb_free() a lot cheaper, but means the strings and items 
+ * in the document can not be freed or replaced individually */
+extern void ptb_set_arena(int yes);
+extern void ptb_set_error_fn(void (*fn) (const char *, va_list));
+/* Allocator used from now on by calls that are not given one, NULL to 
+ * go back to malloc(). This covers documents, buffers returned by 
+ * ptb_write_mem(), ptb_flatten(), tuning dictionaries and Guitar Pro 
+ * files. Items added to a document have to come from the allocator 
+ * it was read with, as ptb_free() releases them using it. */
+extern void ptb_set_allocator(const struct ptb_allocator *);
+
+/* MIDI pitch of every string and fret of a guitar, so notes can be 
+ * resolved with a single lookup. Indexed by the string and fret of a 
+ * line data item. */
+#define PTB_PITCH_STRINGS	8
+#define PTB_PITCH_FRETS		32
+struct ptb_pitch_table {
+	uint8_t pitch[PTB_PITCH_STRINGS][PTB_PITCH_FRETS];
+};
+
+/* With sounding set, the pitches include the capo and half_up (as 
+ * a signed number of half steps); otherwise they are the ones 
+ * returned by ptb_get_octave() and ptb_get_step(). */
+extern void ptb_init_pitch_table(struct ptb_pitch_table *, struct ptb_guitar *, int sounding);
+/* Store the pitch of every note in a section in pitches, in the same 
+ * order as ptb_flatten(), filling in at most n of them. tables holds 
+ * one table per staff, indexed by staff number as in ptb_guitarin; 
+ * notes on staffs without a table get pitch 0. Returns the number of 
+ * notes in the section. */
+extern size_t ptb_get_section_pitches(const struct ptb_pitch_table *tables, int nr_tables, struct ptb_section *, uint8_t *pitches, size_t n);
 
 extern uint8_t ptb_get_octave(struct ptb_guitar *guitar, uint8_t string, uint8_t fret);
 extern uint8_t ptb_get_step(struct ptb_guitar *guitar, uint8_t string, uint8_t fret);
 extern const char *ptb_get_tone(ptb_tone);
 extern const char *ptb_get_tone_full(ptb_tone);
 
+/* Returns section n of an instrument, decoding it first if the file 
+ * was read with lazy_sections, or NULL if there is no such section. 
+ * With lazy_sections the input data has to remain available until 
+ * ptb_free(), and the sections list of the instrument is only filled 
+ * in once the document is written. */
+extern struct ptb_section *ptb_get_section(struct ptbf *, int instrument, int n);
+
+/* Flat view of all positions and notes in a document, as arrays rather 
+ * than lists. The positions of each staff and voice are consecutive, 
+ * as are the notes of each position. */
+struct ptb_flat {
+	uint32_t nr_staffs;
+	struct ptb_flat_staff {
+		uint8_t instrument;
+		uint16_t section; /* Index of the section in the instrument */
+		uint32_t first_position[2]; /* Per voice */
+		uint32_t nr_positions[2];
+	} *staffs;
+
+	/* Positions */
+	uint32_t nr_positions;
+	uint8_t *offset;
+	uint8_t *length;
+	uint8_t *dots;
+	uint16_t *properties;
+	uint32_t *first_note; /* Has nr_positions + 1 entries */
+
+	/* Notes (line data) */
+	uint32_t nr_notes;
+	uint8_t *string;
+	uint8_t *fret;
+	uint8_t *note_properties;
+
+	struct ptb_allocator allocator; /* Used by ptb_free_flat() */
+};
+
+/* The result is allocated as a single block and independent of the 
+ * document it was created from */
+extern struct ptb_flat *ptb_flatten(struct ptbf *);
+extern void ptb_free_flat(struct ptb_flat *);
+
+/* Absolute time of the positions of an instrument. Sections are laid 
+ * out one after the other, each lasting as long as its longest voice 
+ * rounded up to whole bars of its time signature (one bar if it has 
+ * no notes). Times are in ticks, PTB_TICKS_PER_QUARTER to a quarter 
+ * note. */
+#define PTB_TICKS_PER_QUARTER	960
+#define PTB_DEFAULT_BPM			120
+
+struct ptb_timeline {
+	uint32_t nr_events;
+	struct ptb_timeline_event {
+		uint32_t tick;
+		uint32_t duration;
+		uint16_t section;
+		uint8_t staff;
+		uint8_t voice;
+		struct ptb_position *position;
+	} *events; /* All positions, ordered by tick */
+
+	uint32_t nr_tempos;
+	struct ptb_timeline_tempo {
+		uint32_t tick;
+		uint8_t bpm; /* Quarter notes per minute */
+		double seconds; /* Time at which the tempo changes */
+	} *tempos; /* The first one is PTB_DEFAULT_BPM at tick 0 */
+
+	uint32_t nr_sections;
+	struct ptb_timeline_section {
+		struct ptb_section *section;
+		uint32_t start;
+		uint32_t length;
+		uint32_t first_event;
+		uint32_t nr_events;
+	} *sections;
+
+	uint32_t nr_bars;
+	uint32_t *bars; /* Tick at which each bar starts */
+
+	uint32_t length; /* Of the whole instrument */
+
+	struct ptb_allocator allocator; /* Used by ptb_free_timeline() */
+};
+
+/* The timeline is allocated as a single block, and refers to the 
+ * sections and positions of the document it was created from */
+extern struct ptb_timeline *ptb_get_timeline(struct ptbf *, int instrument);
+extern void ptb_free_timeline(struct ptb_timeline *);
+/* Index of the last event that starts at or before tick, -1 if none */
+extern long ptb_timeline_find(const struct ptb_timeline *, uint32_t tick);
+/* Convert between ticks and seconds, following the tempo markers */
+extern double ptb_timeline_seconds(const struct ptb_timeline *, uint32_t tick);
+extern uint32_t ptb_timeline_ticks(const struct ptb_timeline *, double seconds);
+/* Length of a single position in ticks */
+extern uint32_t ptb_get_position_ticks(struct ptb_position *);
+
+/* Position at an offset in either voice of a staff (the first voice 
+ * is searched first), NULL if there is none */
+extern struct ptb_position *ptb_get_position(struct ptb_staff *, int offset);
+/* Staffs that are read from a file have an index of their positions, 
+ * so that ptb_get_position() and ptb_get_position_difference() don't 
+ * have to walk the lists. It has to be 
+ * built again after adding, removing or moving positions. Returns 
+ * 0 on success; without an index the lists are walked. */
+extern int ptb_index_staff(struct ptbf *, struct ptb_staff *);
+
 extern void ptb_get_position_difference(struct ptb_section *, int start, int end, int *bars, int *length);
 
 /* Reading tuning data files (tunings.dat) */
@@ -535,6 +847,8 @@ struct ptb_tuning_dict {
 		uint8_t nr_strings;
 		uint8_t *strings;
 	} *tunings;
+
+	struct ptb_allocator allocator; /* Used by ptb_free_tuning_dict() */
 };
 
 extern struct ptb_tuning_dict *ptb_read_tuning_dict(const char *);
@@ -31,6 +31,7 @@
 #endif
 
 #include "ptb.h"
+#include "batch.h"
 
 void abc_write_header(FILE *out, struct ptbf *ret) 
 {
@@ -134,47 +135,14 @@ int abc_write_lyrics(FILE *out, struct ptbf *ret)
 	return 1;
 }
 
-int main(int argc, const char **argv) 
+static int instrument = 0;
+
+static int convert(const char *input, const char *output, void *data)
 {
 	FILE *out;
 	struct ptbf *ret;
-	int debugging = 0;
 	struct ptb_section *section;
-	int instrument = 0;
-	int c;
-	int version = 0;
-	const char *input;
-	char *output = NULL;
-	poptContext pc;
-	struct poptOption options[] = {
-		POPT_AUTOHELP
-		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
-		{"outputfile", 'o', POPT_ARG_STRING, &output, 0, "Write to specified file", "FILE" },
-		{"regular", 'r', POPT_ARG_NONE, &instrument, 0, "Write tabs for regular guitar" },
-		{"bass", 'b', POPT_ARG_NONE, &instrument, 1, "Write tabs for bass guitar"},
-		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
-		POPT_TABLEEND
-	};
 
-	pc = poptGetContext(argv[0], argc, argv, options, 0);
-	poptSetOtherOptionHelp(pc, "file.ptb");
-	while((c = poptGetNextOpt(pc)) >= 0) {
-		switch(c) {
-		case 'v':
-			printf("ptb2abc Version "PACKAGE_VERSION"\n");
-			printf("(C) 2005-2006 Jelmer Vernooij <jelmer@samba.org>\n");
-			exit(0);
-			break;
-		}
-	}
-			
-	ptb_set_debug(debugging);
-	
-	if(!poptPeekArg(pc)) {
-		poptPrintUsage(pc, stderr, 0);
-		return -1;
-	}
-	input = poptGetArg(pc);
 	ret = ptb_read_file(input);
 	
 	if(!ret) {
@@ -182,22 +150,13 @@ int main(int argc, const char **argv)
 		return -1;
 	} 
 
-	if(!output) {
-		int baselength = strlen(input);
-		if (!strcmp(input + strlen(input) - 4, ".ptb")) {
-			baselength -= 4;
-		}
-		output = malloc(baselength + 6);
-		strncpy(output, input, baselength);
-		strcpy(output + baselength, ".abc");
-	}
-
 	if(!strcmp(output, "-")) {
 		out = stdout;
 	} else {
 		out = fopen(output, "w+");
 		if(!out) {
 			perror("open");
+			ptb_free(ret);
 			return -1;
 		}
 	} 
@@ -220,7 +179,51 @@ int main(int argc, const char **argv)
 		section = section->next;
 	}
 
-	if(output)fclose(out);
+	if(out != stdout)fclose(out);
+	else fflush(out);
+
+	ptb_free(ret);
 	
-	return (ret?0:1);
+	return 0;
+}
+
+int main(int argc, const char **argv) 
+{
+	int debugging = 0;
+	int c;
+	int version = 0;
+	struct batch batch = { NULL, ".ptb", ".abc", 1, 0, convert, NULL };
+	poptContext pc;
+	struct poptOption options[] = {
+		POPT_AUTOHELP
+		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
+		{"outputfile", 'o', POPT_ARG_STRING, &batch.output, 0, "Write to specified file (or template, for several files)", "FILE" },
+		{"jobs", 'j', POPT_ARG_INT, &batch.jobs, 0, "Convert N files at the same time (0 for one per CPU)", "N" },
+		{"regular", 'r', POPT_ARG_NONE, &instrument, 0, "Write tabs for regular guitar" },
+		{"bass", 'b', POPT_ARG_NONE, &instrument, 1, "Write tabs for bass guitar"},
+		{"quiet", 'q', POPT_ARG_NONE, &batch.quiet, 1, "Be quiet (no output to stderr)" },
+		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, options, 0);
+	poptSetOtherOptionHelp(pc, "file.ptb|- ...");
+	while((c = poptGetNextOpt(pc)) >= 0) {
+		switch(c) {
+		case 'v':
+			printf("ptb2abc Version "PACKAGE_VERSION"\n");
+			printf("(C) 2005-2006 Jelmer Vernooij <jelmer@samba.org>\n");
+			exit(0);
+			break;
+		}
+	}
+			
+	ptb_set_debug(debugging);
+	
+	if(!poptPeekArg(pc)) {
+		poptPrintUsage(pc, stderr, 0);
+		return -1;
+	}
+
+	return batch_convert(&batch, poptGetArgs(pc));
 }
@@ -38,6 +38,7 @@
 #endif
 
 #include "ptb.h"
+#include "batch.h"
 
 #define LILYPOND_VERSION "2.4.0"
 
@@ -71,39 +72,38 @@ char *note_names[12] = {
 	 "c", "cis", "d", "dis", "e", "f", "fis", "g", "gis", "a", "ais", "b"
 };
 
-char *ly_escape(char *data)
+/* Write a header field, escaping the value for LilyPond */
+void ly_write_field(FILE *out, const char *name, const char *prefix, const char *value)
 {
-	static char tmp[2000];
-	int i, j = 0;
-	for(i = 0; data[i]; i++) {
-		switch(data[i]) {
-		case '&':
-			tmp[j] = '\\'; j++;
-		default:
-			tmp[j] = data[i];j++;
-		}
+	fprintf(out, "  %s = \"%s", name, prefix);
+	for (; *value; value++) {
+		if (*value == '&') fputc('\\', out);
+		fputc(*value, out);
 	}
-	tmp[j] = '\0';
-	return tmp;
+	fprintf(out, "\"\n");
 }
 
 void ly_write_header(FILE *out, struct ptbf *ret) 
 {
 	fprintf(out, "\\header {\n");
 	if(ret->hdr.classification == CLASSIFICATION_SONG) {
-		if(ret->hdr.class_info.song.title) 	fprintf(out, "  title = \"%s\"\n", ly_escape(ret->hdr.class_info.song.title));
-		if(ret->hdr.class_info.song.music_by) fprintf(out, "  composer = \"%s\"\n", ly_escape(ret->hdr.class_info.song.music_by));
-		if(ret->hdr.class_info.song.words_by) fprintf(out, "  poet = \"%s\"\n", ly_escape(ret->hdr.class_info.song.words_by));
-		if(ret->hdr.class_info.song.copyright) fprintf(out, "  copyright = \"%s\"\n", ly_escape(ret->hdr.class_info.song.copyright));
-		if(ret->hdr.class_info.song.guitar_transcribed_by) fprintf(out, "  arranger = \"%s\"\n", ly_escape(ret->hdr.class_info.song.guitar_transcribed_by));
-		if(ret->hdr.class_info.song.artist) fprintf(out, "  subtitle = \"As recorded by %s\"\n", ly_escape(ret->hdr.class_info.song.artist));
+		if(ret->hdr.class_info.song.title) 	ly_write_field(out, "title", "", ret->hdr.class_info.song.title);
+		if(ret->hdr.class_info.song.music_by) ly_write_field(out, "composer", "", ret->hdr.class_info.song.music_by);
+		if(ret->hdr.class_info.song.words_by) ly_write_field(out, "poet", "", ret->hdr.class_info.song.words_by);
+		if(ret->hdr.class_info.song.copyright) ly_write_field(out, "copyright", "", ret->hdr.class_info.song.copyright);
+		if(ret->hdr.class_info.song.guitar_transcribed_by) ly_write_field(out, "arranger", "", ret->hdr.class_info.song.guitar_transcribed_by);
+		if(ret->hdr.class_info.song.artist) ly_write_field(out, "subtitle", "As recorded by ", ret->hdr.class_info.song.artist);
 		if(ret->hdr.class_info.song.release_type == RELEASE_TYPE_PR_AUDIO &&
-		   ret->hdr.class_info.song.release_info.pr_audio.album_title) fprintf(out, "  subsubtitle = \"From the %d album %s\"\n", ret->hdr.class_info.song.release_info.pr_audio.year, ly_escape(ret->hdr.class_info.song.release_info.pr_audio.album_title));
+		   ret->hdr.class_info.song.release_info.pr_audio.album_title) {
+			char prefix[40];
+			snprintf(prefix, sizeof(prefix), "From the %d album ", ret->hdr.class_info.song.release_info.pr_audio.year);
+			ly_write_field(out, "subsubtitle", prefix, ret->hdr.class_info.song.release_info.pr_audio.album_title);
+		}
 	} else if(ret->hdr.classification == CLASSIFICATION_LESSON) {
-		if(ret->hdr.class_info.lesson.title) 	fprintf(out, "  title = \"%s\"\n", ly_escape(ret->hdr.class_info.lesson.title));
-		if(ret->hdr.class_info.lesson.artist) fprintf(out, "  composer = \"%s\"\n", ly_escape(ret->hdr.class_info.lesson.artist));
-		if(ret->hdr.class_info.lesson.author) fprintf(out, "  arranger = \"%s\"\n", ly_escape(ret->hdr.class_info.lesson.author));
-		if(ret->hdr.class_info.lesson.copyright) fprintf(out, "  copyright = \"%s\"\n", ly_escape(ret->hdr.class_info.lesson.copyright));
+		if(ret->hdr.class_info.lesson.title) 	ly_write_field(out, "title", "", ret->hdr.class_info.lesson.title);
+		if(ret->hdr.class_info.lesson.artist) ly_write_field(out, "composer", "", ret->hdr.class_info.lesson.artist);
+		if(ret->hdr.class_info.lesson.author) ly_write_field(out, "arranger", "", ret->hdr.class_info.lesson.author);
+		if(ret->hdr.class_info.lesson.copyright) ly_write_field(out, "copyright", "", ret->hdr.class_info.lesson.copyright);
 	}
 	fprintf(out, "  tagline = \"Engraved by lilypond, generated by ptb2ly\"\n");
 	fprintf(out, "}\n");
@@ -549,54 +549,18 @@ int ly_write_main_single(FILE *out, struct ptb_instrument *instrument)
 	return 0;
 }	
 
-int main(int argc, const char **argv) 
+static int instrument = 0;
+static int singlepiece = 0;
+static int quiet = 0;
+
+static int convert(const char *input, const char *output, void *data)
 {
 	FILE *out;
 	int have_lyrics;
 	struct ptbf *ret;
-	int debugging = 0;
-	int instrument = 0;
-	int c, i = 0;
-	int version = 0;
-	int singlepiece = 0;
-	int quiet = 0;
-	const char *input;
+	int i = 0;
 	struct ptb_section *section;
-	char *output = NULL;
-	poptContext pc;
-	struct poptOption options[] = {
-		POPT_AUTOHELP
-		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
-		{"outputfile", 'o', POPT_ARG_STRING, &output, 0, "Write to specified file", "FILE" },
-		{"regular", 'r', POPT_ARG_NONE, &instrument, 0, "Write tabs for regular guitar" },
-		{"warn-unsupported", 'u', POPT_ARG_NONE, &warn_unsupported, 1, "Warn about unsupported PTB elements" },
-		{"bass", 'b', POPT_ARG_NONE, &instrument, 1, "Write tabs for bass guitar"},
-		{"quiet", 'q', POPT_ARG_NONE, &quiet, 1, "Be quiet (no output to stderr)" },
-		{"single", 's', POPT_ARG_NONE, &singlepiece, 1, "Write single piece instead of \\book (experimental)" },
-		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
-		POPT_TABLEEND
-	};
 
-	pc = poptGetContext(argv[0], argc, argv, options, 0);
-	poptSetOtherOptionHelp(pc, "file.ptb");
-	while((c = poptGetNextOpt(pc)) >= 0) {
-		switch(c) {
-		case 'v':
-			printf("ptb2ly Version "PACKAGE_VERSION"\n");
-			printf("(C) 2004 Jelmer Vernooij <jelmer@samba.org>\n");
-			exit(0);
-			break;
-		}
-	}
-			
-	ptb_set_debug(debugging);
-	
-	if(!poptPeekArg(pc)) {
-		poptPrintUsage(pc, stderr, 0);
-		return -1;
-	}
-	input = poptGetArg(pc);
-	
 	if (!quiet) fprintf(stderr, "Parsing %s... \n", input);
 					
 	ret = ptb_read_file(input);
@@ -606,16 +570,6 @@ int main(int argc, const char **argv)
 		return -1;
 	} 
 
-	if(!output) {
-		int baselength = strlen(input);
-		if (!strcmp(input + strlen(input) - 4, ".ptb")) {
-			baselength -= 4;
-		}
-		output = malloc(baselength + 5);
-		strncpy(output, input, baselength);
-		strcpy(output + baselength, ".ly");
-	}
-
 	if (!quiet) fprintf(stderr, "Generating lilypond file in %s...\n", output);
 
 	if (!strcmp(output, "-")) {
@@ -624,6 +578,7 @@ int main(int argc, const char **argv)
 		out = fopen(output, "w+");
 		if(!out) {
 			perror("open");
+			ptb_free(ret);
 			return -1;
 		}
 	}
@@ -682,9 +637,54 @@ int main(int argc, const char **argv)
 	 	ly_write_main_single(out, &ret->instrument[instrument]);
 	}
 	
-	if(output)fclose(out);
+	if(out != stdout)fclose(out);
+	else fflush(out);
 
 	ptb_free(ret); ret = NULL;
 	
 	return 0;
 }
+
+int main(int argc, const char **argv) 
+{
+	int debugging = 0;
+	int c;
+	int version = 0;
+	struct batch batch = { NULL, ".ptb", ".ly", 1, 0, convert, NULL };
+	poptContext pc;
+	struct poptOption options[] = {
+		POPT_AUTOHELP
+		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
+		{"outputfile", 'o', POPT_ARG_STRING, &batch.output, 0, "Write to specified file (or template, for several files)", "FILE" },
+		{"jobs", 'j', POPT_ARG_INT, &batch.jobs, 0, "Convert N files at the same time (0 for one per CPU)", "N" },
+		{"regular", 'r', POPT_ARG_NONE, &instrument, 0, "Write tabs for regular guitar" },
+		{"warn-unsupported", 'u', POPT_ARG_NONE, &warn_unsupported, 1, "Warn about unsupported PTB elements" },
+		{"bass", 'b', POPT_ARG_NONE, &instrument, 1, "Write tabs for bass guitar"},
+		{"quiet", 'q', POPT_ARG_NONE, &quiet, 1, "Be quiet (no output to stderr)" },
+		{"single", 's', POPT_ARG_NONE, &singlepiece, 1, "Write single piece instead of \\book (experimental)" },
+		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, options, 0);
+	poptSetOtherOptionHelp(pc, "file.ptb|- ...");
+	while((c = poptGetNextOpt(pc)) >= 0) {
+		switch(c) {
+		case 'v':
+			printf("ptb2ly Version "PACKAGE_VERSION"\n");
+			printf("(C) 2004 Jelmer Vernooij <jelmer@samba.org>\n");
+			exit(0);
+			break;
+		}
+	}
+			
+	ptb_set_debug(debugging);
+	
+	if(!poptPeekArg(pc)) {
+		poptPrintUsage(pc, stderr, 0);
+		return -1;
+	}
+
+	batch.quiet = quiet;
+	return batch_convert(&batch, poptGetArgs(pc));
+}
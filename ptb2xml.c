@@ -35,6 +35,7 @@
 #endif
 
 #include "ptb.h"
+#include "batch.h"
 
 #ifdef HAVE_XSLT
 #  include <libxslt/xslt.h>
@@ -522,53 +523,20 @@ xmlNodePtr xml_write_header(struct ptb_hdr *hdr)
 	return header;
 }
 
-int main(int argc, const char **argv) 
+static int musicxml = 0;
+static int quiet = 0;
+static int format_output = 1;
+
+static int convert(const char *input, const char *output, void *data)
 {
 	struct ptbf *ret;
-	int debugging = 0;
 	xmlNodePtr root_node;
 	xmlDocPtr doc;
 	xmlNodePtr comment;
 	xmlNodePtr fonts;
 	xmlDtdPtr dtd;
-	int c, i, musicxml = 0;
-	int version = 0;
-	const char *input = NULL;
-	char *output = NULL;
-	poptContext pc;
-	int quiet = 0;
-	int format_output = 1;
-	struct poptOption options[] = {
-		POPT_AUTOHELP
-		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
-		{"outputfile", 'o', POPT_ARG_STRING, &output, 0, "Write to specified file", "FILE" },
-		{"musicxml", 'm', POPT_ARG_NONE, &musicxml, 'm', "Output MusicXML" },
-		{"no-format", 'f', POPT_ARG_NONE, &format_output, 0, "Don't format output" },
-		{"quiet", 'q', POPT_ARG_NONE, &quiet, 1, "Be quiet (no output to stderr)" },
-		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
-		POPT_TABLEEND
-	};
+	int i;
 
-	pc = poptGetContext(argv[0], argc, argv, options, 0);
-	poptSetOtherOptionHelp(pc, "file.ptb");
-	while((c = poptGetNextOpt(pc)) >= 0) {
-		switch(c) {
-		case 'v':
-			printf("ptb2xml Version "PACKAGE_VERSION"\n");
-			printf("(C) 2004-2006 Jelmer Vernooij <jelmer@samba.org>\n");
-			exit(0);
-			break;
-		}
-	}
-			
-	ptb_set_debug(debugging);
-	
-	if(!poptPeekArg(pc)) {
-		poptPrintUsage(pc, stderr, 0);
-		return -1;
-	}
-	
-	input = poptGetArg(pc);
 	if (!quiet) fprintf(stderr, "Parsing %s...\n", input);
 	ret = ptb_read_file(input);
 	
@@ -577,16 +545,6 @@ int main(int argc, const char **argv)
 		return -1;
 	} 
 
-	if(!output) {
-		int baselength = strlen(input);
-		if (!strcmp(input + strlen(input) - 4, ".ptb")) {
-			baselength -= 4;
-		}
-		output = malloc(baselength + 6);
-		strncpy(output, input, baselength);
-		strcpy(output + baselength, ".xml");
-	}
-
 	if (!quiet) fprintf(stderr, "Building DOM tree...\n");
 
 	doc = xmlNewDoc(BAD_CAST "1.0");
@@ -611,15 +569,20 @@ int main(int argc, const char **argv)
 	xmlAddChild(fonts, xml_write_font("chord_name_font", &ret->chord_name_font));
 	xmlAddChild(fonts, xml_write_font("tablature_font", &ret->tablature_font));
 
+	ptb_free(ret);
+
 	if (musicxml)
 	{
 		if (!quiet) fprintf(stderr, "Converting to MusicXML...\n");
 #ifdef HAVE_XSLT
 		xsltStylesheetPtr stylesheet = xsltParseStylesheetFile(MUSICXMLSTYLESHEET);
-		doc = xsltApplyStylesheet(stylesheet, doc, NULL);
+		xmlDocPtr result = xsltApplyStylesheet(stylesheet, doc, NULL);
 		xsltFreeStylesheet(stylesheet);
+		xmlFreeDoc(doc);
+		doc = result;
 #else
 		fprintf(stderr, "Conversion to MusicXML not possible in this version: libxslt not compiled in\n");
+		xmlFreeDoc(doc);
 		return -1;
 #endif
 	}
@@ -627,12 +590,57 @@ int main(int argc, const char **argv)
 	if (!quiet) fprintf(stderr, "Writing output to %s...\n", output);
 
 	if (xmlSaveFormatFile(output, doc, format_output) < 0) {
+		xmlFreeDoc(doc);
 		return -1;
 	}
 
 	xmlFreeDoc(doc);
 
+	return 0;
+}
+
+int main(int argc, const char **argv) 
+{
+	int debugging = 0;
+	int c, ret;
+	int version = 0;
+	struct batch batch = { NULL, ".ptb", ".xml", 1, 0, convert, NULL };
+	poptContext pc;
+	struct poptOption options[] = {
+		POPT_AUTOHELP
+		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
+		{"outputfile", 'o', POPT_ARG_STRING, &batch.output, 0, "Write to specified file (or template, for several files)", "FILE" },
+		{"jobs", 'j', POPT_ARG_INT, &batch.jobs, 0, "Convert N files at the same time (0 for one per CPU)", "N" },
+		{"musicxml", 'm', POPT_ARG_NONE, &musicxml, 'm', "Output MusicXML" },
+		{"no-format", 'f', POPT_ARG_NONE, &format_output, 0, "Don't format output" },
+		{"quiet", 'q', POPT_ARG_NONE, &quiet, 1, "Be quiet (no output to stderr)" },
+		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, options, 0);
+	poptSetOtherOptionHelp(pc, "file.ptb|- ...");
+	while((c = poptGetNextOpt(pc)) >= 0) {
+		switch(c) {
+		case 'v':
+			printf("ptb2xml Version "PACKAGE_VERSION"\n");
+			printf("(C) 2004-2006 Jelmer Vernooij <jelmer@samba.org>\n");
+			exit(0);
+			break;
+		}
+	}
+			
+	ptb_set_debug(debugging);
+	
+	if(!poptPeekArg(pc)) {
+		poptPrintUsage(pc, stderr, 0);
+		return -1;
+	}
+
+	batch.quiet = quiet;
+	ret = batch_convert(&batch, poptGetArgs(pc));
+
 	xmlCleanupParser();
 
-	return 0;
+	return ret;
 }
@@ -321,10 +321,59 @@ void write_lesson_info(struct ptb_hdr *hdr)
 	COND_PRINTF("Copyright", hdr->class_info.lesson.copyright);
 }
 
+static void write_stats(const struct ptb_stats *stats)
+{
+	static const char *instruments[] = { "Guitar", "Bass" };
+	unsigned long items = 0, bytes = 0;
+	int i, j;
+
+	printf("\n%-16s %10s %12s\n", "Class", "Items", "Bytes");
+	for (i = 0; i < PTB_CLASS_MAX; i++) {
+		if (stats->classes[i].items == 0) continue;
+		printf("%-16s %10lu %12lu\n", stats->classes[i].name, 
+			   stats->classes[i].items, stats->classes[i].bytes);
+		items += stats->classes[i].items;
+		bytes += stats->classes[i].bytes;
+	}
+	printf("%-16s %10lu %12lu\n", "Total", items, bytes);
+
+	printf("\nAllocations: %lu (%lu bytes)\n", stats->allocs, stats->alloc_bytes);
+	printf("Parse time: %.6fs\n", stats->time);
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < PTB_CLASS_MAX; j++) {
+			if (stats->list_time[i][j] == 0) continue;
+			printf("  %-6s %-14s %.6fs\n", instruments[i], stats->classes[j].name, stats->list_time[i][j]);
+		}
+	}
+}
+
+/* Returns 1 if any of the files has a problem */
+static int check_files(poptContext pc)
+{
+	struct ptb_validation result;
+	const char *file;
+	int failed = 0;
+
+	while ((file = poptGetArg(pc))) {
+		if (ptb_validate_file(file, &result) == 0) {
+			printf("%s: OK\n", file);
+			continue;
+		}
+		printf("%s: 0x%lx: %s\n", file, (unsigned long)result.offset, result.error);
+		failed++;
+	}
+
+	return failed?1:0;
+}
+
 int main(int argc, const char **argv) 
 {
+	struct ptb_parse_options opts;
 	struct ptbf *ret;
 	int tree = 0;
+	int stats = 0;
+	int check = 0;
 	int debugging = 0;
 	int c, tmp1, tmp2;
 	int version = 0;
@@ -333,12 +382,14 @@ int main(int argc, const char **argv)
 		POPT_AUTOHELP
 		{"debug", 'd', POPT_ARG_NONE, &debugging, 0, "Turn on debugging output" },
 		{"tree", 't', POPT_ARG_NONE, &tree, 't', "Print tree of PowerTab file" },
+		{"stats", 's', POPT_ARG_NONE, &stats, 's', "Print what went into parsing the file" },
+		{"check", 'c', POPT_ARG_NONE, &check, 'c', "Only check the structure of the files" },
 		{"version", 'v', POPT_ARG_NONE, &version, 'v', "Show version information" },
 		POPT_TABLEEND
 	};
 
 	pc = poptGetContext(argv[0], argc, argv, options, 0);
-	poptSetOtherOptionHelp(pc, "file.ptb");
+	poptSetOtherOptionHelp(pc, "file.ptb|-");
 	while((c = poptGetNextOpt(pc)) >= 0) {
 		switch(c) {
 		case 'v':
@@ -349,14 +400,19 @@ int main(int argc, const char **argv)
 		}
 	}
 			
-	ptb_set_debug(debugging);
-	ptb_set_asserts_fatal(0);
+	ptb_init_parse_options(&opts);
+	opts.debug = debugging;
+	opts.stats = stats;
 	
 	if(!poptPeekArg(pc)) {
 		poptPrintUsage(pc, stderr, 0);
 		return -1;
 	}
-	ret = ptb_read_file(poptGetArg(pc));
+
+	if (check) 
+		return check_files(pc);
+
+	ret = ptb_read_file_ex(poptGetArg(pc), &opts);
 	
 	if(!ret) {
 		perror("Read error: ");
@@ -441,6 +497,9 @@ int main(int argc, const char **argv)
 		printf("Tablature Font: "); write_font(&ret->tablature_font); printf("\n");
 	}
 
+	if (stats) 
+		write_stats(ptb_get_stats(ret));
+
 	ptb_free(ret);
 
 	return (ret?0:1);
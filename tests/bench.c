@@ -0,0 +1,282 @@
+/*
+    benchmarks for ptabtools
+    (c) 2007 Jelmer Vernooij <jelmer@samba.org>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* Every benchmark runs in a child process of its own, so the peak RSS
+ * that is reported belongs to that benchmark alone. Results are
+ * written as tab separated lines:
+ *
+ *   benchmark file bytes iterations seconds MB/s files/s maxrss_kb allocs alloc_bytes
+ *
+ * where seconds, allocs and alloc_bytes are per iteration. Allocations
+ * are counted by wrapping malloc() and friends at link time, so they
+ * only cover calls made by the library itself. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "ptb.h"
+#include "gp.h"
+
+static unsigned long nr_allocs, alloc_bytes;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t size)
+{
+	nr_allocs++; alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	nr_allocs++; alloc_bytes += n * size;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	nr_allocs++; alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+static double min_time = 0.5;
+static FILE *results;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char *name, const char *file, size_t bytes, int iterations, double seconds, long maxrss, long allocs, long allocated)
+{
+	seconds /= iterations;
+	fprintf(results, "%s\t%s\t%lu\t%d\t%.6f\t%.2f\t%.2f\t%ld\t%ld\t%ld\n",
+			name, file, (unsigned long)bytes, iterations, seconds,
+			bytes / 1048576.0 / seconds, 1 / seconds, maxrss,
+			allocs < 0?-1:allocs / iterations, allocated < 0?-1:allocated / iterations);
+	fflush(results);
+}
+
+/* Run fn until min_time has passed, in a child process */
+static void bench(const char *name, const char *file, int (*fn) (const char *file, void *data), void *data)
+{
+	struct rusage ru;
+	struct stat st;
+	double start, elapsed;
+	int iterations = 0;
+	pid_t pid;
+
+	if (stat(file, &st) < 0) {
+		perror(file);
+		return;
+	}
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return;
+	}
+
+	if (pid > 0) {
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fprintf(stderr, "%s failed on %s\n", name, file);
+		return;
+	}
+
+	/* Warm up (and let fn set itself up) outside of the measurement */
+	if (fn(file, data) < 0) exit(1);
+
+	nr_allocs = alloc_bytes = 0;
+	start = now();
+	do {
+		if (fn(file, data) < 0) exit(1);
+		iterations++;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	getrusage(RUSAGE_SELF, &ru);
+	report(name, file, st.st_size, iterations, elapsed, ru.ru_maxrss, nr_allocs, alloc_bytes);
+	exit(0);
+}
+
+static int bench_read_file(const char *file, void *data)
+{
+	struct ptbf *bf = ptb_read_file(file);
+	if (!bf) return -1;
+	ptb_free(bf);
+	return 0;
+}
+
+static int bench_read_file_arena(const char *file, void *data)
+{
+	struct ptb_parse_options opts;
+	struct ptbf *bf;
+	ptb_init_parse_options(&opts);
+	opts.use_arena = 1;
+	bf = ptb_read_file_ex(file, &opts);
+	if (!bf) return -1;
+	ptb_free(bf);
+	return 0;
+}
+
+static int bench_parse_file(const char *file, void *data)
+{
+	struct ptb_events events;
+	memset(&events, 0, sizeof(events));
+	return ptb_parse_file(file, &events, NULL, NULL);
+}
+
+/* The file is parsed by the first (warm-up) call */
+static int bench_write_mem(const char *file, void *data)
+{
+	static struct ptbf *bf;
+	size_t length;
+	char *buf;
+
+	if (!bf) bf = ptb_read_file(file);
+	if (!bf) return -1;
+	buf = ptb_write_mem(bf, &length);
+	if (!buf) return -1;
+	free(buf);
+	return 0;
+}
+
+static int bench_gp_read_file(const char *file, void *data)
+{
+	struct gpf *gp = gp_read_file(file);
+	if (!gp) return -1;
+	gp_free(gp);
+	return 0;
+}
+
+/* Run a converter from the build directory, timing the whole process */
+static void bench_converter(const char *dir, const char *converter, const char *file)
+{
+	char *path = malloc(strlen(dir) + strlen(converter) + 2);
+	struct rusage ru;
+	struct stat st;
+	double start, elapsed;
+	long maxrss = 0;
+	int iterations = 0;
+
+	sprintf(path, "%s/%s", dir, converter);
+	if (access(path, X_OK) < 0 || stat(file, &st) < 0) {
+		free(path);
+		return;
+	}
+
+	start = now();
+	do {
+		int status;
+		pid_t pid;
+
+		fflush(NULL);
+		pid = fork();
+		if (pid == 0) {
+			int fd = open("/dev/null", O_WRONLY);
+			dup2(fd, 1); dup2(fd, 2);
+			execl(path, converter, "-q", "-o", "/dev/null", file, NULL);
+			_exit(127);
+		}
+
+		if (pid < 0 || wait4(pid, &status, 0, &ru) < 0 ||
+			!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s failed on %s\n", converter, file);
+			free(path);
+			return;
+		}
+
+		if (ru.ru_maxrss > maxrss) maxrss = ru.ru_maxrss;
+		iterations++;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	report(converter, file, st.st_size, iterations, elapsed, maxrss, -1, -1);
+	free(path);
+}
+
+static int is_gp(const char *file)
+{
+	const char *ext = strrchr(file, '.');
+	return ext && !strncmp(ext, ".gp", 3);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t seconds] [-C converter-dir] [-o results] file.ptb|file.gp4 ...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *converters[] = { "ptb2ly", "ptb2xml", "ptb2ascii", "ptb2abc", NULL };
+	const char *converter_dir = ".";
+	int c, i, j;
+
+	results = stdout;
+
+	while ((c = getopt(argc, argv, "t:C:o:h")) != -1) {
+		switch (c) {
+		case 't': min_time = atof(optarg); break;
+		case 'C': converter_dir = optarg; break;
+		case 'o':
+			results = fopen(optarg, "w");
+			if (!results) { perror(optarg); return 1; }
+			break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) usage(argv[0]);
+
+	fprintf(results, "benchmark\tfile\tbytes\titerations\tseconds\tMB/s\tfiles/s\tmaxrss_kb\tallocs\talloc_bytes\n");
+
+	for (i = optind; i < argc; i++) {
+		if (is_gp(argv[i])) {
+			bench("gp_read_file", argv[i], bench_gp_read_file, NULL);
+			bench_converter(converter_dir, "gp2ly", argv[i]);
+			continue;
+		}
+
+		bench("ptb_read_file", argv[i], bench_read_file, NULL);
+		bench("ptb_read_file_arena", argv[i], bench_read_file_arena, NULL);
+		bench("ptb_parse_file", argv[i], bench_parse_file, NULL);
+		bench("ptb_write_mem", argv[i], bench_write_mem, NULL);
+		for (j = 0; converters[j]; j++)
+			bench_converter(converter_dir, converters[j], argv[i]);
+	}
+
+	if (results != stdout) fclose(results);
+
+	return 0;
+}
@@ -20,15 +20,242 @@
 #include <check.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "gp.h"
+
+/* Write a small file with gp_write_file() and return its contents */
+static char *gp_test_data(size_t *length)
+{
+	char filename[] = "/tmp/gptestXXXXXX";
+	struct gpf *gpf = calloc(1, sizeof(struct gpf));
+	struct gp_track_string strings[6];
+	struct gp_track track;
+	struct gp_bar_track bar_track;
+	struct gp_beat beat;
+	struct gp_note note;
+	struct gp_bar bar;
+	char *data;
+	FILE *f;
+	int fd;
+
+	memset(strings, 0, sizeof(strings));
+	memset(&track, 0, sizeof(track));
+	memset(&bar_track, 0, sizeof(bar_track));
+	memset(&beat, 0, sizeof(beat));
+	memset(&bar, 0, sizeof(bar));
+
+	gpf->version = 4.0;
+	gpf->version_string = "FICHIER GUITAR PRO v4.00";
+	gpf->title = "Title";
+	gpf->subtitle = gpf->artist = gpf->album = gpf->author = "";
+	gpf->copyright = gpf->tab_by = gpf->instruction = "";
+	gpf->bpm = 90;
+
+	track.name = "Guitar";
+	track.num_frets = 24;
+	track.num_strings = 6;
+	track.strings = strings;
+	strings[0].pitch = 64;
+	gpf->num_tracks = 1;
+	gpf->tracks = &track;
+
+	memset(&note, 0, sizeof(note));
+	note.string = 2;
+	note.properties = GP_NOTE_PROPERTY_ALTERATION;
+	note.alteration = 1;
+	note.value = 3;
+	beat.strings_present = 1 << 2;
+	beat.num_notes = 1;
+	beat.notes = &note;
+	bar_track.num_beats = 1;
+	bar_track.beats = &beat;
+	bar.rhythm_1 = bar.rhythm_2 = 4;
+	bar.tracks = &bar_track;
+	gpf->num_bars = 1;
+	gpf->bars = &bar;
+
+	fd = mkstemp(filename);
+	fail_unless(fd >= 0, "unable to create temporary file");
+	close(fd);
+	fail_unless(gp_write_file(filename, gpf) == 0, "unable to write file");
+	free(gpf);
+
+	f = fopen(filename, "rb");
+	fseek(f, 0, SEEK_END);
+	*length = ftell(f);
+	rewind(f);
+	data = malloc(*length);
+	fail_unless(fread(data, 1, *length, f) == *length, "short read");
+	fclose(f);
+	unlink(filename);
+	return data;
+}
 
 START_TEST(test_get_step)
 END_TEST
 
+START_TEST(test_read_mem)
+	size_t length;
+	char *data = gp_test_data(&length);
+	struct gpf *gpf = gp_read_mem(data, length);
+
+	/* The buffer may go away after parsing */
+	memset(data, 0, length);
+	free(data);
+
+	fail_unless(gpf != NULL, "parsing failed");
+	fail_unless(gpf->version == 4.0, "got version %f", gpf->version);
+	fail_unless(!strcmp(gpf->title, "Title"), "got title %s", gpf->title);
+	fail_unless(gpf->bpm == 90, "got bpm %d", gpf->bpm);
+	fail_unless(gpf->num_tracks == 1 && gpf->num_bars == 1, "wrong number of tracks or bars");
+	fail_unless(!strcmp(gpf->tracks[0].name, "Guitar"), "got track %s", gpf->tracks[0].name);
+	fail_unless(gpf->tracks[0].strings[0].pitch == 64, "wrong tuning");
+	fail_unless(gpf->bars[0].tracks[0].num_beats == 1, "wrong number of beats");
+	fail_unless(gpf->bars[0].tracks[0].beats[0].num_notes == 1, "wrong number of notes");
+	fail_unless(gpf->bars[0].tracks[0].beats[0].notes[0].string == 2, "wrong string");
+	fail_unless(gpf->bars[0].tracks[0].beats[0].notes[0].value == 3, "wrong fret");
+	fail_unless(gpf->bars[0].tracks[0].beats[0].notes[0].effect == NULL, "effect for plain note");
+	fail_unless(gp_get_note(&gpf->bars[0].tracks[0].beats[0], 2) != NULL, "note not found");
+	fail_unless(gp_get_note(&gpf->bars[0].tracks[0].beats[0], 0) == NULL, "note on empty string");
+	fail_unless(gpf->data == NULL, "input still referenced");
+	gp_free(gpf);
+END_TEST
+
+struct counts {
+	int allocs, frees;
+};
+
+static void *count_alloc(void *data, size_t size)
+{
+	((struct counts *)data)->allocs++;
+	return malloc(size);
+}
+
+static void *count_realloc(void *data, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void count_free(void *data, void *ptr)
+{
+	((struct counts *)data)->frees++;
+	free(ptr);
+}
+
+START_TEST(test_free)
+	struct ptb_allocator allocator = { count_alloc, count_realloc, count_free, NULL };
+	struct counts counts;
+	size_t length;
+	char *data = gp_test_data(&length);
+	struct gpf *gpf;
+
+	memset(&counts, 0, sizeof(counts));
+	allocator.data = &counts;
+	gpf = gp_read_mem_ex(data, length, &allocator, NULL);
+	fail_unless(gpf != NULL, "parsing failed");
+	/* The document, its arena and a single chunk */
+	fail_unless(counts.allocs == 3, "%d allocations", counts.allocs);
+	gp_free(gpf);
+	fail_unless(counts.allocs == counts.frees, "%d allocations, %d frees", counts.allocs, counts.frees);
+
+	/* Failed reads do not leak either */
+	memset(&counts, 0, sizeof(counts));
+	fail_unless(gp_read_mem_ex(data, length - 1, &allocator, NULL) == NULL, "truncated file accepted");
+	fail_unless(counts.allocs == counts.frees, "%d allocations, %d frees", counts.allocs, counts.frees);
+	free(data);
+END_TEST
+
+struct parse_counts {
+	int headers, bars, tracks, beats, notes;
+	int last_value;
+};
+
+static void count_header(void *data, struct gpf *gpf) 
+{ 
+	((struct parse_counts *)data)->headers++; 
+	fail_unless(gpf->bars == NULL && gpf->tracks == NULL, "lists filled in");
+}
+
+static void count_bar(void *data, int bar, struct gp_bar *b) { ((struct parse_counts *)data)->bars++; }
+static void count_track(void *data, int track, struct gp_track *t) { ((struct parse_counts *)data)->tracks++; }
+static void count_beat(void *data, int bar, int track, struct gp_beat *beat) { ((struct parse_counts *)data)->beats++; }
+
+static void count_note(void *data, struct gp_beat *beat, struct gp_note *note)
+{
+	struct parse_counts *counts = data;
+	counts->notes++;
+	counts->last_value = note->value;
+}
+
+START_TEST(test_parse)
+	struct gp_events events = { count_header, count_bar, count_track, count_beat, count_note };
+	struct parse_counts counts;
+	struct gp_error error;
+	size_t length;
+	char *data = gp_test_data(&length);
+
+	memset(&counts, 0, sizeof(counts));
+	fail_unless(gp_parse_mem(data, length, &events, &counts, NULL, &error) == 0, "%s", gp_strerror(error.code));
+	fail_unless(counts.headers == 1, "got %d headers", counts.headers);
+	fail_unless(counts.bars == 1 && counts.tracks == 1, "got %d bars and %d tracks", counts.bars, counts.tracks);
+	fail_unless(counts.beats == 1 && counts.notes == 1, "got %d beats and %d notes", counts.beats, counts.notes);
+	fail_unless(counts.last_value == 3, "got fret %d", counts.last_value);
+
+	/* Nothing is reported past the first problem */
+	memset(&counts, 0, sizeof(counts));
+	fail_unless(gp_parse_mem(data, length - 3, &events, &counts, NULL, &error) == -1, "truncated file accepted");
+	fail_unless(counts.beats == 0, "incomplete beat reported");
+	free(data);
+END_TEST
+
+START_TEST(test_read_errors)
+	size_t length, i;
+	char *data = gp_test_data(&length);
+	struct gp_error error;
+	struct gpf *gpf;
+
+	gpf = gp_read_mem_ex(data, length, NULL, &error);
+	fail_unless(gpf != NULL, "parsing failed");
+	fail_unless(error.code == GP_ERROR_NONE, "got error %d", error.code);
+	gp_free(gpf);
+
+	/* Every prefix is an incomplete file */
+	for (i = 0; i < length; i++) {
+		gpf = gp_read_mem_ex(data, i, NULL, &error);
+		fail_unless(gpf == NULL, "truncated file of %d bytes accepted", (int)i);
+		fail_unless(error.code == GP_ERROR_TRUNCATED || error.code == GP_ERROR_BAD_LENGTH, 
+					"got %s", gp_strerror(error.code));
+		fail_unless(error.offset <= i, "offset 0x%x past the end", (int)error.offset);
+	}
+
+	/* Empty version string */
+	data[0] = 0;
+	fail_unless(gp_read_mem_ex(data, 1, NULL, &error) == NULL, "garbage accepted");
+	fail_unless(error.offset == 1, "got offset 0x%x", (int)error.offset);
+	free(data);
+
+	/* A title that claims to be longer than the data */
+	data = gp_test_data(&length);
+	memset(data + 31, 0xff, 4);
+	fail_unless(gp_read_mem_ex(data, length, NULL, &error) == NULL, "bad length accepted");
+	fail_unless(error.code == GP_ERROR_BAD_LENGTH, "got %s", gp_strerror(error.code));
+	fail_unless(error.offset == 31, "got offset 0x%x", (int)error.offset);
+	free(data);
+
+	fail_unless(gp_read_file_ex("/nonexistent.gp4", NULL, &error) == NULL, "missing file read");
+	fail_unless(error.code == GP_ERROR_IO, "got %s", gp_strerror(error.code));
+END_TEST
+
 Suite *gp_suite()
 {
 	Suite *s = suite_create("gp");
 	TCase *tc_core = tcase_create("core");
 	suite_add_tcase(s, tc_core);
 	tcase_add_test(tc_core, test_get_step);
+	tcase_add_test(tc_core, test_read_mem);
+	tcase_add_test(tc_core, test_read_errors);
+	tcase_add_test(tc_core, test_free);
+	tcase_add_test(tc_core, test_parse);
 	return s;
 }
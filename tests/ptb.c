@@ -21,6 +21,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "ptb.h"
 
 START_TEST(test_get_step)
@@ -53,6 +56,625 @@ START_TEST(test_get_tone_full_invalid)
 	fail_unless(strcmp(ptb_get_tone_full(15), "_UNKNOWN_CHORD_") == 0, "got %s", ptb_get_tone_full(15));
 END_TEST
 
+/* Song header, 2 x 8 empty lists, 3 fonts and the trailing settings */
+static const char minimal_ptb[] = 
+	"ptab" "\x04\x00" "\x00"
+	"\x00" "\x03" "Foo" "\x00" "\x03" 
+	"\x00" "\x00\x00\x00\x00\x00\x00\x00" "\x00\x00"
+	"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+	"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+	"\x05" "Arial" "\x0c\x00\x00\x00" "\x90\x01\x00\x00" "\x00\x00\x00" "\x00\x00\x00\x00"
+	"\x00" "\x0c\x00\x00\x00" "\x90\x01\x00\x00" "\x00\x00\x00" "\x00\x00\x00\x00"
+	"\x00" "\x0c\x00\x00\x00" "\x90\x01\x00\x00" "\x00\x00\x00" "\x00\x00\x00\x00"
+	"\x0a\x00\x00\x00" "\x00\x00\x00\x00" "\x00\x00\x00\x00";
+
+START_TEST(test_read_mem)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(bf->hdr.version == 4, "got version %d", bf->hdr.version);
+	fail_unless(strcmp(bf->hdr.class_info.song.title, "Foo") == 0, "got %s", bf->hdr.class_info.song.title);
+	fail_unless(bf->instrument[0].sections == NULL, "expected no sections");
+	fail_unless(strcmp(bf->tablature_font.family, "Arial") == 0, "got %s", bf->tablature_font.family);
+	fail_unless(bf->staff_line_space == 10, "got %d", bf->staff_line_space);
+	ptb_free(bf);
+END_TEST
+
+START_TEST(test_read_mem_truncated)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, 10);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(bf->hdr.class_info.song.title == NULL, "string past end of buffer was read");
+	ptb_free(bf);
+END_TEST
+
+static void count_guitar(void *data, int instrument, struct ptb_guitar *guitar)
+{
+	(*(int *)data)++;
+}
+
+static void check_header(void *data, struct ptb_hdr *hdr)
+{
+	fail_unless(strcmp(hdr->class_info.song.title, "Foo") == 0, "got %s", hdr->class_info.song.title);
+}
+
+START_TEST(test_parse_mem)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_events events;
+	int nr_guitars = 0;
+	size_t length;
+	char *data;
+
+	bf->instrument[1].guitars = calloc(1, sizeof(struct ptb_guitar));
+	data = ptb_write_mem(bf, &length);
+	ptb_free(bf);
+
+	memset(&events, 0, sizeof(events));
+	events.on_header = check_header;
+	events.on_guitar = count_guitar;
+	fail_unless(ptb_parse_mem(data, length, &events, &nr_guitars, NULL) == 0, "parsing failed");
+	fail_unless(nr_guitars == 1, "got %d guitars", nr_guitars);
+	free(data);
+END_TEST
+
+START_TEST(test_lazy_sections)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_section *s1 = calloc(1, sizeof(struct ptb_section));
+	struct ptb_section *s2 = calloc(1, sizeof(struct ptb_section));
+	struct ptb_parse_options opts;
+	size_t length, newlength;
+	char *data, *newdata;
+
+	s1->next = s2; s2->prev = s1;
+	s1->letter = 'A'; s2->letter = 'B';
+	bf->instrument[0].sections = s1;
+	data = ptb_write_mem(bf, &length);
+	ptb_free(bf);
+
+	ptb_init_parse_options(&opts);
+	opts.lazy_sections = 1;
+	bf = ptb_read_mem_ex(data, length, &opts);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(bf->instrument[0].sections == NULL, "sections decoded up front");
+	fail_unless(bf->instrument[0].nr_sections == 2, "got %d sections", bf->instrument[0].nr_sections);
+	fail_unless(ptb_get_section(bf, 0, 1)->letter == 'B', "wrong section");
+	fail_unless(ptb_get_section(bf, 0, 0)->letter == 'A', "wrong section");
+	fail_unless(ptb_get_section(bf, 0, 2) == NULL, "section past the end");
+
+	newdata = ptb_write_mem(bf, &newlength);
+	fail_unless(newlength == length && memcmp(data, newdata, length) == 0, "output differs");
+	fail_unless(ptb_get_section(bf, 0, 1)->letter == 'B', "wrong section after writing");
+
+	ptb_free(bf);
+	free(newdata);
+	free(data);
+END_TEST
+
+START_TEST(test_flatten)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_section *section = calloc(1, sizeof(struct ptb_section));
+	struct ptb_staff *staff = calloc(1, sizeof(struct ptb_staff));
+	struct ptb_position *p1 = calloc(1, sizeof(struct ptb_position));
+	struct ptb_position *p2 = calloc(1, sizeof(struct ptb_position));
+	struct ptb_linedata *ld = calloc(1, sizeof(struct ptb_linedata));
+	struct ptb_flat *flat;
+
+	bf->instrument[1].sections = section;
+	section->staffs = staff;
+	staff->positions[1] = p1;
+	p1->next = p2; p2->prev = p1;
+	p1->offset = 0; p1->length = 4;
+	p2->offset = 1; p2->length = 8;
+	p2->linedatas = ld;
+	ld->detailed.string = 2;
+	ld->detailed.fret = 5;
+
+	flat = ptb_flatten(bf);
+	ptb_free(bf);
+	fail_unless(flat != NULL, "flattening failed");
+	fail_unless(flat->nr_staffs == 1, "got %d staffs", flat->nr_staffs);
+	fail_unless(flat->staffs[0].instrument == 1, "got instrument %d", flat->staffs[0].instrument);
+	fail_unless(flat->staffs[0].nr_positions[0] == 0, "got %d positions", flat->staffs[0].nr_positions[0]);
+	fail_unless(flat->staffs[0].nr_positions[1] == 2, "got %d positions", flat->staffs[0].nr_positions[1]);
+	fail_unless(flat->nr_positions == 2 && flat->length[1] == 8, "wrong positions");
+	fail_unless(flat->first_note[1] == 0 && flat->first_note[2] == 1, "wrong note ranges");
+	fail_unless(flat->string[0] == 2 && flat->fret[0] == 5, "got %d/%d", flat->string[0], flat->fret[0]);
+	ptb_free_flat(flat);
+END_TEST
+
+START_TEST(test_position_index)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_section *section = calloc(1, sizeof(struct ptb_section));
+	struct ptb_staff *staff = calloc(1, sizeof(struct ptb_staff));
+	struct ptb_position *p[3];
+	int i, bars, length;
+	size_t datalen;
+	char *data;
+
+	for (i = 0; i < 3; i++) {
+		p[i] = calloc(1, sizeof(struct ptb_position));
+		p[i]->offset = i * 2;
+		p[i]->length = 2;
+		if (i) { p[i-1]->next = p[i]; p[i]->prev = p[i-1]; }
+	}
+	p[2]->length = 4;
+	bf->instrument[0].sections = section;
+	section->staffs = staff;
+	staff->positions[1] = p[0];
+	data = ptb_write_mem(bf, &datalen);
+	ptb_free(bf);
+
+	bf = ptb_read_mem(data, datalen);
+	fail_unless(bf != NULL, "parsing failed");
+	staff = bf->instrument[0].sections->staffs;
+	fail_unless(staff->index != NULL, "staff not indexed");
+	fail_unless(ptb_get_position(staff, 4) == staff->positions[1]->next->next, "wrong position");
+	fail_unless(ptb_get_position(staff, 3) == NULL, "position at empty offset");
+
+	ptb_get_position_difference(bf->instrument[0].sections, 0, 4, &bars, &length);
+	fail_unless(bars == 1 && length == 0, "got %d bars, length %d", bars, length);
+	ptb_get_position_difference(bf->instrument[0].sections, 2, 0xffff, &bars, &length);
+	fail_unless(bars == 0 && length == 1, "got %d bars, length %d", bars, length);
+
+	/* Lists are walked without an index */
+	free(staff->index);
+	staff->index = NULL;
+	ptb_get_position_difference(bf->instrument[0].sections, 2, 0xffff, &bars, &length);
+	fail_unless(bars == 0 && length == 1, "got %d bars, length %d", bars, length);
+	fail_unless(ptb_index_staff(bf, staff) == 0, "indexing failed");
+	fail_unless(ptb_get_position(staff, 2) == staff->positions[1]->next, "wrong position");
+
+	/* The index is part of cache images */
+	fail_unless(ptb_save_cache("test-index.ptbc", bf) == 0, "saving cache failed");
+	ptb_free(bf);
+	bf = ptb_open_cache("test-index.ptbc", NULL, NULL);
+	fail_unless(bf != NULL, "opening cache failed");
+	staff = bf->instrument[0].sections->staffs;
+	fail_unless(staff->index != NULL, "index not cached");
+	fail_unless(ptb_get_position(staff, 4) == staff->positions[1]->next->next, "wrong position");
+	ptb_free(bf);
+	unlink("test-index.ptbc");
+	free(data);
+END_TEST
+
+START_TEST(test_timeline)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_section *s1 = calloc(1, sizeof(struct ptb_section));
+	struct ptb_section *s2 = calloc(1, sizeof(struct ptb_section));
+	struct ptb_staff *staff = calloc(1, sizeof(struct ptb_staff));
+	struct ptb_musicbar *bar = calloc(1, sizeof(struct ptb_musicbar));
+	struct ptb_tempomarker *tm = calloc(1, sizeof(struct ptb_tempomarker));
+	struct ptb_position *p[4];
+	struct ptb_timeline *tl;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		p[i] = calloc(1, sizeof(struct ptb_position));
+		p[i]->offset = i;
+		p[i]->length = 4;
+		if (i) { p[i-1]->next = p[i]; p[i]->prev = p[i-1]; }
+	}
+	p[1]->dots = POSITION_DOTS_1;
+	p[2]->length = 8;
+	p[2]->fermenta = POSITION_FERMENTA_TRIPLET_1;
+	p[3]->length = 16;
+	p[3]->properties = (5 - 1) * 8 + (4 - 1); /* 5 in the time of 4 */
+
+	s1->next = s2; s2->prev = s1;
+	s1->staffs = staff;
+	s1->musicbars = bar;
+	bar->offset = 2;
+	staff->positions[0] = p[0];
+	tm->section = 1;
+	tm->bpm = 60;
+	bf->instrument[0].sections = s1;
+	bf->instrument[0].tempomarkers = tm;
+
+	tl = ptb_get_timeline(bf, 0);
+	fail_unless(tl != NULL, "no timeline");
+	fail_unless(tl->nr_events == 4, "got %d events", tl->nr_events);
+	fail_unless(tl->events[1].tick == 960, "got tick %d", tl->events[1].tick);
+	fail_unless(tl->events[2].tick == 960 + 1440, "got tick %d", tl->events[2].tick);
+	fail_unless(tl->events[2].duration == 320, "got duration %d", tl->events[2].duration);
+	fail_unless(tl->events[3].duration == 192, "got duration %d", tl->events[3].duration);
+	fail_unless(tl->nr_sections == 2, "got %d sections", tl->nr_sections);
+	fail_unless(tl->sections[0].length == 3840, "not padded to a bar, got %d", tl->sections[0].length);
+	fail_unless(tl->sections[1].start == 3840, "got start %d", tl->sections[1].start);
+	fail_unless(tl->sections[1].length == 4 * 960, "empty section is not one bar");
+	fail_unless(tl->nr_bars == 3 && tl->bars[1] == 2400, "wrong bars");
+	fail_unless(ptb_timeline_find(tl, 2500) == 2, "wrong event");
+	fail_unless(ptb_timeline_find(tl, 5000) == 3, "wrong event");
+
+	fail_unless(tl->nr_tempos == 2 && tl->tempos[1].tick == 3840, "wrong tempos");
+	fail_unless(ptb_timeline_seconds(tl, 960) == 0.5, "got %f", ptb_timeline_seconds(tl, 960));
+	fail_unless(ptb_timeline_seconds(tl, 3840 + 960) == 3840 / 1920.0 + 1.0, "wrong time after tempo change");
+	fail_unless(ptb_timeline_ticks(tl, 3840 / 1920.0 + 1.0) == 3840 + 960, "got %d", ptb_timeline_ticks(tl, 3840 / 1920.0 + 1.0));
+
+	ptb_free_timeline(tl);
+	ptb_free(bf);
+END_TEST
+
+START_TEST(test_timeline_meter)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_section *s[3];
+	struct ptb_staff *staff = calloc(1, sizeof(struct ptb_staff));
+	struct ptb_position *p[4];
+	struct ptb_timeline *tl;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		s[i] = calloc(1, sizeof(struct ptb_section));
+		if (i) { s[i-1]->next = s[i]; s[i]->prev = s[i-1]; }
+	}
+	for (i = 0; i < 4; i++) {
+		p[i] = calloc(1, sizeof(struct ptb_position));
+		p[i]->offset = i;
+		p[i]->length = 4;
+		if (i) { p[i-1]->next = p[i]; p[i]->prev = p[i-1]; }
+	}
+
+	/* 3/4 with four quarter notes, an empty 6/8 and an empty 2/2 bar */
+	s[0]->detailed.beat_value = 3 - 1; s[0]->detailed.beat = 2;
+	s[1]->detailed.beat_value = 6 - 1; s[1]->detailed.beat = 3;
+	s[2]->detailed.beat_value = 2 - 1; s[2]->detailed.beat = 1;
+	s[2]->meter_type = METER_TYPE_CUT;
+	s[0]->staffs = staff;
+	staff->positions[0] = p[0];
+	bf->instrument[0].sections = s[0];
+
+	tl = ptb_get_timeline(bf, 0);
+	fail_unless(tl != NULL, "no timeline");
+	fail_unless(tl->sections[0].length == 2 * 2880, "got length %d", tl->sections[0].length);
+	fail_unless(tl->sections[1].start == 2 * 2880, "got start %d", tl->sections[1].start);
+	fail_unless(tl->sections[1].length == 2880, "empty 6/8 section is %d ticks", tl->sections[1].length);
+	fail_unless(tl->sections[2].length == 3840, "empty 2/2 section is %d ticks", tl->sections[2].length);
+	fail_unless(tl->length == 3 * 2880 + 3840, "got length %d", tl->length);
+
+	ptb_free_timeline(tl);
+	ptb_free(bf);
+END_TEST
+
+START_TEST(test_pitch_table)
+	uint8_t strings[] = { 40, 45 };
+	uint8_t bass_strings[] = { 28, 33 };
+	struct ptb_guitar gtr, bass;
+	struct ptb_pitch_table tables[2];
+	struct ptb_section section;
+	struct ptb_staff staff[2];
+	struct ptb_position pos[2];
+	struct ptb_linedata ld[3];
+	uint8_t pitches[3];
+
+	memset(&gtr, 0, sizeof(gtr));
+	gtr.nr_strings = 2;
+	gtr.strings = strings;
+	gtr.capo = 2;
+
+	ptb_init_pitch_table(&tables[0], &gtr, 0);
+	fail_unless(tables[0].pitch[1][3] == 48, "got %d", tables[0].pitch[1][3]);
+	fail_unless(tables[0].pitch[1][3] / 12 == ptb_get_octave(&gtr, 1, 3), "octave differs");
+	fail_unless(tables[0].pitch[1][3] % 12 == ptb_get_step(&gtr, 1, 3), "step differs");
+
+	ptb_init_pitch_table(&tables[0], &gtr, 1);
+	fail_unless(tables[0].pitch[0][0] == 42, "capo ignored, got %d", tables[0].pitch[0][0]);
+
+	memset(&bass, 0, sizeof(bass));
+	bass.nr_strings = 2;
+	bass.strings = bass_strings;
+	ptb_init_pitch_table(&tables[1], &bass, 1);
+
+	/* Same string and fret on two staffs with different tunings */
+	memset(&section, 0, sizeof(section));
+	memset(staff, 0, sizeof(staff));
+	memset(pos, 0, sizeof(pos));
+	memset(ld, 0, sizeof(ld));
+	section.staffs = &staff[0];
+	staff[0].next = &staff[1];
+	staff[0].positions[1] = &pos[0];
+	staff[1].positions[0] = &pos[1];
+	pos[0].linedatas = &ld[0];
+	ld[0].next = &ld[1];
+	pos[1].linedatas = &ld[2];
+	ld[0].detailed.string = 1; ld[0].detailed.fret = 5;
+	ld[1].detailed.string = 0; ld[1].detailed.fret = 0;
+	ld[2].detailed.string = 1; ld[2].detailed.fret = 5;
+
+	fail_unless(ptb_get_section_pitches(tables, 2, &section, pitches, 1) == 3, "wrong number of notes");
+	fail_unless(ptb_get_section_pitches(tables, 2, &section, pitches, 3) == 3, "wrong number of notes");
+	fail_unless(pitches[0] == 52 && pitches[1] == 42, "got %d %d", pitches[0], pitches[1]);
+	fail_unless(pitches[2] == 38, "bass tuning ignored, got %d", pitches[2]);
+
+	/* Staffs without a table */
+	fail_unless(ptb_get_section_pitches(tables, 1, &section, pitches, 3) == 3, "wrong number of notes");
+	fail_unless(pitches[0] == 52 && pitches[2] == 0, "got %d %d", pitches[0], pitches[2]);
+END_TEST
+
+START_TEST(test_validate)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_section *section = calloc(1, sizeof(struct ptb_section));
+	struct ptb_staff *s1 = calloc(1, sizeof(struct ptb_staff));
+	struct ptb_staff *s2 = calloc(1, sizeof(struct ptb_staff));
+	struct ptb_position *pos = calloc(1, sizeof(struct ptb_position));
+	struct ptb_validation result;
+	size_t length;
+	char *data;
+
+	fail_unless(ptb_validate(minimal_ptb, sizeof(minimal_ptb) - 1, &result) == 0, "%s", result.error);
+	fail_unless(result.error == NULL, "error set for valid file");
+	fail_unless(ptb_validate(minimal_ptb, 20, &result) == -1, "truncated file accepted");
+	fail_unless(result.offset == 20, "got offset %d", (int)result.offset);
+
+	/* A staff with only one voice is followed by the next staff */
+	bf->instrument[0].sections = section;
+	section->staffs = s1;
+	s1->next = s2; s2->prev = s1;
+	s1->positions[0] = pos;
+	pos->linedatas = calloc(1, sizeof(struct ptb_linedata));
+	data = ptb_write_mem(bf, &length);
+	ptb_free(bf);
+	fail_unless(ptb_validate(data, length, &result) == 0, "0x%x: %s", (int)result.offset, result.error);
+
+	/* Claim there is a second section */
+	data[0x27]++;
+	fail_unless(ptb_validate(data, length, &result) == -1, "bad section count accepted");
+	free(data);
+END_TEST
+
+static int nr_errors = 0;
+
+static void count_error(const char *fmt, va_list ap)
+{
+	nr_errors++;
+}
+
+START_TEST(test_read_mem_ex)
+	struct ptb_parse_options opts;
+	struct ptbf *bf;
+	ptb_init_parse_options(&opts);
+	opts.error_fn = count_error;
+	nr_errors = 0;
+	bf = ptb_read_mem_ex(minimal_ptb, 10, &opts);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(nr_errors > 0, "errors not reported to error_fn");
+	ptb_free(bf);
+END_TEST
+
+START_TEST(test_read_mem_arena)
+	struct ptbf *bf;
+	ptb_set_arena(1);
+	bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	ptb_set_arena(0);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(bf->arena != NULL, "no arena used");
+	fail_unless(strcmp(bf->hdr.class_info.song.title, "Foo") == 0, "got %s", bf->hdr.class_info.song.title);
+	ptb_free(bf);
+END_TEST
+
+START_TEST(test_write_mem)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	size_t length;
+	char *data = ptb_write_mem(bf, &length);
+	fail_unless(data != NULL, "writing failed");
+	fail_unless(length == sizeof(minimal_ptb) - 1, "got %lu bytes", (unsigned long)length);
+	fail_unless(memcmp(data, minimal_ptb, length) == 0, "output differs");
+	free(data);
+	ptb_free(bf);
+END_TEST
+
+START_TEST(test_write_class_refs)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_guitar *g1 = calloc(1, sizeof(struct ptb_guitar));
+	struct ptb_guitar *g2 = calloc(1, sizeof(struct ptb_guitar));
+	static const char classdef[] = "\x02\x00" "\xff\xff\x01\x00\x07\x00" "CGuitar";
+	size_t length;
+	char *data, *p;
+
+	g1->next = g2; g2->prev = g1; g2->index = 1;
+	bf->instrument[0].guitars = g1;
+	data = ptb_write_mem(bf, &length);
+	ptb_free(bf);
+	fail_unless(data != NULL, "writing failed");
+
+	/* The class is defined once and referenced by its id (1) afterwards */
+	for (p = data; p < data + length - sizeof(classdef); p++) 
+		if (memcmp(p, classdef, sizeof(classdef) - 1) == 0) break;
+	fail_unless(p < data + length - sizeof(classdef), "class definition not found");
+	p += sizeof(classdef) - 1 + 13; /* first guitar */
+	fail_unless(p[0] == '\x01' && p[1] == '\x80', "got %02x%02x", p[1], p[0]);
+
+	bf = ptb_read_mem(data, length);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(bf->instrument[0].guitars->next->index == 1, "second guitar lost");
+	ptb_free(bf);
+	free(data);
+END_TEST
+
+START_TEST(test_cache)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_guitar *g = calloc(1, sizeof(struct ptb_guitar));
+	FILE *f;
+	int c;
+
+	fail_unless(ptb_write_file("test-cache.ptb", bf) == 0, "writing failed");
+	ptb_free(bf);
+	bf = ptb_read_file("test-cache.ptb");
+	fail_unless(ptb_save_cache("test-cache.ptbc", bf) == 0, "saving cache failed");
+	ptb_free(bf);
+
+	bf = ptb_open_cache("test-cache.ptbc", "test-cache.ptb", NULL);
+	fail_unless(bf != NULL, "opening cache failed");
+	fail_unless(bf->cached, "cache not used");
+	fail_unless(strcmp(bf->hdr.class_info.song.title, "Foo") == 0, "got %s", bf->hdr.class_info.song.title);
+	ptb_free(bf);
+
+	/* A changed source makes the cache stale */
+	bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	bf->instrument[0].guitars = g;
+	fail_unless(ptb_write_file("test-cache.ptb", bf) == 0, "writing failed");
+	ptb_free(bf);
+
+	bf = ptb_open_cache("test-cache.ptbc", "test-cache.ptb", NULL);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(!bf->cached, "stale cache used");
+	fail_unless(bf->instrument[0].guitars != NULL, "guitar lost");
+	ptb_free(bf);
+
+	/* .. and is refreshed by ptb_open_cache() */
+	bf = ptb_open_cache("test-cache.ptbc", "test-cache.ptb", NULL);
+	fail_unless(bf != NULL && bf->cached, "cache not refreshed");
+	fail_unless(bf->instrument[0].guitars != NULL, "guitar lost");
+	ptb_free(bf);
+
+#ifdef UTIME_OMIT
+	/* A rewrite of the same size within the same second is noticed too */
+	{
+		struct timespec times[2];
+		struct stat st;
+		char *data = malloc(sizeof(minimal_ptb) - 1);
+		size_t i;
+
+		f = fopen("test-cache.ptb", "wb");
+		fwrite(minimal_ptb, 1, sizeof(minimal_ptb) - 1, f);
+		fclose(f);
+		bf = ptb_read_file("test-cache.ptb");
+		fail_unless(ptb_save_cache("test-cache.ptbc", bf) == 0, "saving cache failed");
+		ptb_free(bf);
+
+		fail_unless(stat("test-cache.ptb", &st) == 0, "stat failed");
+		memcpy(data, minimal_ptb, sizeof(minimal_ptb) - 1);
+		for (i = 0; memcmp(data + i, "Foo", 3); i++);
+		memcpy(data + i, "Bar", 3);
+		f = fopen("test-cache.ptb", "wb");
+		fwrite(data, 1, sizeof(minimal_ptb) - 1, f);
+		fclose(f);
+		free(data);
+
+		times[0].tv_sec = 0;
+		times[0].tv_nsec = UTIME_OMIT;
+		times[1].tv_sec = st.st_mtime;
+		times[1].tv_nsec = (st.st_mtim.tv_nsec + 1) % 1000000000;
+		fail_unless(utimensat(AT_FDCWD, "test-cache.ptb", times, 0) == 0, "utimensat failed");
+
+		bf = ptb_open_cache("test-cache.ptbc", "test-cache.ptb", NULL);
+		fail_unless(bf != NULL && !bf->cached, "stale cache used");
+		fail_unless(strcmp(bf->hdr.class_info.song.title, "Bar") == 0, "got %s", bf->hdr.class_info.song.title);
+		ptb_free(bf);
+	}
+#endif
+
+	/* A damaged image is not trusted, wherever it is mapped */
+	f = fopen("test-cache.ptbc", "r+b");
+	fail_unless(f != NULL, "unable to open cache");
+	fseek(f, 0, SEEK_END);
+	fseek(f, ftell(f) / 2, SEEK_SET);
+	c = fgetc(f);
+	fseek(f, -1, SEEK_CUR);
+	fputc(c ^ 0x40, f);
+	fclose(f);
+	fail_unless(ptb_open_cache("test-cache.ptbc", NULL, NULL) == NULL, "damaged cache used");
+
+	unlink("test-cache.ptb");
+	unlink("test-cache.ptbc");
+END_TEST
+
+START_TEST(test_stats)
+	struct ptbf *bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	struct ptb_guitar *g1 = calloc(1, sizeof(struct ptb_guitar));
+	struct ptb_guitar *g2 = calloc(1, sizeof(struct ptb_guitar));
+	const struct ptb_stats *stats;
+	struct ptb_parse_options opts;
+	size_t length;
+	char *data;
+
+	fail_unless(ptb_get_stats(bf) == NULL, "statistics kept by default");
+	g1->next = g2; g2->prev = g1;
+	bf->instrument[1].guitars = g1;
+	data = ptb_write_mem(bf, &length);
+	ptb_free(bf);
+
+	ptb_init_parse_options(&opts);
+	opts.stats = 1;
+	bf = ptb_read_mem_ex(data, length, &opts);
+	fail_unless(bf != NULL, "parsing failed");
+	stats = ptb_get_stats(bf);
+	fail_unless(stats != NULL, "no statistics");
+	fail_unless(strcmp(stats->classes[PTB_CLASS_GUITAR].name, "CGuitar") == 0, "got %s", stats->classes[PTB_CLASS_GUITAR].name);
+	fail_unless(stats->classes[PTB_CLASS_GUITAR].items == 2, "got %lu guitars", stats->classes[PTB_CLASS_GUITAR].items);
+	/* Class definition, a reference and two empty guitars */
+	fail_unless(stats->classes[PTB_CLASS_GUITAR].bytes == 13 + 2 + 2 * 13, "got %lu bytes", stats->classes[PTB_CLASS_GUITAR].bytes);
+	fail_unless(stats->classes[PTB_CLASS_SECTION].items == 0, "got %lu sections", stats->classes[PTB_CLASS_SECTION].items);
+	fail_unless(stats->allocs > 0, "allocations not counted");
+	fail_unless(stats->time >= stats->list_time[1][PTB_CLASS_GUITAR], "inconsistent times");
+	ptb_free(bf);
+	free(data);
+END_TEST
+
+struct budget {
+	size_t left;
+	int allocs, frees;
+};
+
+static void *budget_alloc(void *data, size_t size)
+{
+	struct budget *b = data;
+	if (size > b->left) return NULL;
+	b->left -= size;
+	b->allocs++;
+	return malloc(size);
+}
+
+static void *budget_realloc(void *data, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void budget_free(void *data, void *ptr)
+{
+	((struct budget *)data)->frees++;
+	free(ptr);
+}
+
+START_TEST(test_allocator)
+	struct ptb_allocator allocator = { budget_alloc, budget_realloc, budget_free, NULL };
+	struct ptb_parse_options opts;
+	struct budget budget;
+	struct ptbf *bf;
+	size_t length;
+	char *data;
+
+	ptb_init_parse_options(&opts);
+	opts.allocator = &allocator;
+	allocator.data = &budget;
+
+	memset(&budget, 0, sizeof(budget));
+	budget.left = 0x100000;
+	bf = ptb_read_mem_ex(minimal_ptb, sizeof(minimal_ptb) - 1, &opts);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(budget.allocs > 1, "allocator not used");
+	data = ptb_write_mem_ex(bf, &length, &opts);
+	fail_unless(data != NULL, "writing failed");
+	ptb_free(bf);
+	budget_free(&budget, data);
+	fail_unless(budget.allocs == budget.frees, "%d allocations, %d frees", budget.allocs, budget.frees);
+
+	/* Running out of memory half way fails the read, without leaking */
+	memset(&budget, 0, sizeof(budget));
+	budget.left = sizeof(struct ptbf) + 2;
+	opts.error_fn = NULL;
+	bf = ptb_read_mem_ex(minimal_ptb, sizeof(minimal_ptb) - 1, &opts);
+	fail_unless(bf == NULL, "parsing succeeded without memory");
+	fail_unless(budget.allocs == budget.frees, "%d allocations, %d frees", budget.allocs, budget.frees);
+
+	/* The default allocator */
+	memset(&budget, 0, sizeof(budget));
+	budget.left = 0x100000;
+	ptb_set_allocator(&allocator);
+	bf = ptb_read_mem(minimal_ptb, sizeof(minimal_ptb) - 1);
+	ptb_set_allocator(NULL);
+	fail_unless(bf != NULL, "parsing failed");
+	fail_unless(budget.allocs > 1, "default allocator not used");
+	ptb_free(bf);
+	fail_unless(budget.allocs == budget.frees, "%d allocations, %d frees", budget.allocs, budget.frees);
+END_TEST
+
 Suite *ptb_suite()
 {
 	Suite *s = suite_create("ptb");
@@ -65,5 +687,22 @@ Suite *ptb_suite()
 	tcase_add_test(tc_core, test_get_tone_full);
 	tcase_add_test(tc_core, test_get_tone_full_empty);
 	tcase_add_test(tc_core, test_get_tone_full_invalid);
+	tcase_add_test(tc_core, test_read_mem);
+	tcase_add_test(tc_core, test_read_mem_truncated);
+	tcase_add_test(tc_core, test_read_mem_ex);
+	tcase_add_test(tc_core, test_read_mem_arena);
+	tcase_add_test(tc_core, test_write_mem);
+	tcase_add_test(tc_core, test_write_class_refs);
+	tcase_add_test(tc_core, test_parse_mem);
+	tcase_add_test(tc_core, test_lazy_sections);
+	tcase_add_test(tc_core, test_flatten);
+	tcase_add_test(tc_core, test_position_index);
+	tcase_add_test(tc_core, test_timeline);
+	tcase_add_test(tc_core, test_timeline_meter);
+	tcase_add_test(tc_core, test_pitch_table);
+	tcase_add_test(tc_core, test_validate);
+	tcase_add_test(tc_core, test_cache);
+	tcase_add_test(tc_core, test_stats);
+	tcase_add_test(tc_core, test_allocator);
 	return s;
 }
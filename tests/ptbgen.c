@@ -0,0 +1,384 @@
+/*
+    generator for synthetic PowerTab and Guitar Pro files
+    (c) 2007 Jelmer Vernooij <jelmer@samba.org>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* The same seed and settings always produce the same file, on every
+ * platform. The contents are random but valid, so that files can be
+ * used to benchmark and stress the parsers and the converters. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ptb.h"
+#include "gp.h"
+
+#define malloc_p(t,n) (t *) calloc(sizeof(t), n)
+
+/* Largest number of items in a list */
+#define MAX_ITEMS 0xffff
+
+struct settings {
+	unsigned long seed;
+	int nr_sections;
+	int nr_staffs;
+	int nr_positions;
+	int nr_notes;
+	int nr_chorddiagrams;
+	int header_length;
+};
+
+static uint32_t rnd_state;
+
+/* xorshift32, so the sequence does not depend on the C library */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void rnd_seed(unsigned long seed)
+{
+	rnd_state = (uint32_t)(seed * 2654435761UL) ^ 0x5eed1e55;
+	if (!rnd_state) rnd_state = 1;
+}
+
+#define RND(n) (rnd() % (n))
+
+/* Random text of length characters */
+static char *rnd_text(int length)
+{
+	static const char *words[] = { "la", "da", "riff", "solo", "bridge", "verse", "chorus", "outro", "intro", "slow", "fast" };
+	char *ret = malloc(length + 1);
+	int i = 0;
+
+	while (i < length) {
+		const char *w = words[RND(sizeof(words) / sizeof(words[0]))];
+		while (*w && i < length) ret[i++] = *w++;
+		if (i < length) ret[i++] = ' ';
+	}
+	ret[length] = '\0';
+	return ret;
+}
+
+static const uint8_t tuning[] = { 64, 59, 55, 50, 45, 40 };
+static const uint8_t lengths[] = { 1, 2, 4, 8, 16 };
+
+#define LINK(first, last, item) do { \
+	if (last) { (last)->next = (item); (item)->prev = (last); } \
+	else (first) = (item); \
+	(last) = (item); \
+} while (0)
+
+static struct ptb_position *gen_position(const struct settings *s, int k)
+{
+	static const uint8_t ld_properties[] = { 0, 0, 0, LINEDATA_PROPERTY_TIE, LINEDATA_PROPERTY_MUTED,
+		LINEDATA_PROPERTY_HAMMERON_FROM, LINEDATA_PROPERTY_PULLOFF_FROM, LINEDATA_PROPERTY_GHOST_NOTE };
+	struct ptb_position *position = malloc_p(struct ptb_position, 1);
+	struct ptb_linedata *last = NULL;
+	int l, nr_notes = s->nr_notes;
+
+	position->offset = k;
+	position->length = lengths[RND(sizeof(lengths))];
+	if (!RND(8)) position->dots = POSITION_DOTS_1;
+	if (!RND(16)) position->palm_mute = POSITION_PALM_MUTE;
+	if (!RND(4)) position->properties = POSITION_PROPERTY_IN_SINGLE_BEAM;
+
+	if (nr_notes == 0) position->dots |= POSITION_DOTS_REST;
+	if (nr_notes > (int)sizeof(tuning)) nr_notes = sizeof(tuning);
+
+	for (l = 0; l < nr_notes; l++) {
+		struct ptb_linedata *ld = malloc_p(struct ptb_linedata, 1);
+		ld->detailed.string = l;
+		ld->detailed.fret = RND(20);
+		ld->properties = ld_properties[RND(sizeof(ld_properties))];
+		LINK(position->linedatas, last, ld);
+	}
+
+	return position;
+}
+
+static struct ptb_section *gen_section(const struct settings *s, int i)
+{
+	struct ptb_section *section = malloc_p(struct ptb_section, 1);
+	struct ptb_staff *last_staff = NULL;
+	struct ptb_chordtext *last_chordtext = NULL;
+	struct ptb_musicbar *musicbar;
+	int j, k, voice;
+
+	section->letter = 'A' + i % 26;
+	section->meter_type = 0x1000;
+	section->detailed.beat = 2; /* 4/4 */
+	section->detailed.beat_value = 4 - 1;
+	section->position_width = 20;
+
+	musicbar = malloc_p(struct ptb_musicbar, 1);
+	musicbar->properties = MUSICBAR_PROPERTY_SINGLE_BAR;
+	section->musicbars = musicbar;
+
+	for (j = 0; j < s->nr_chorddiagrams && j < 4; j++) {
+		struct ptb_chordtext *chordtext = malloc_p(struct ptb_chordtext, 1);
+		chordtext->offset = j * 8;
+		chordtext->name[0] = chordtext->name[1] = RND(12);
+		LINK(section->chordtexts, last_chordtext, chordtext);
+	}
+
+	for (j = 0; j < s->nr_staffs; j++) {
+		struct ptb_staff *staff = malloc_p(struct ptb_staff, 1);
+
+		staff->properties = sizeof(tuning);
+
+		/* The low melody has a quarter of the positions of the high one */
+		for (voice = 0; voice < 2; voice++) {
+			struct ptb_position *last = NULL;
+			int nr_positions = voice?s->nr_positions / 4:s->nr_positions;
+
+			for (k = 0; k < nr_positions; k++) {
+				struct ptb_position *position = gen_position(s, k);
+				LINK(staff->positions[voice], last, position);
+			}
+		}
+
+		LINK(section->staffs, last_staff, staff);
+	}
+
+	return section;
+}
+
+static int gen_ptb(const struct settings *s, const char *output)
+{
+	struct ptbf *bf = malloc_p(struct ptbf, 1);
+	struct ptb_section *last_section = NULL;
+	struct ptb_chorddiagram *last_chorddiagram = NULL;
+	int i, j, ret;
+
+	bf->hdr.version = 4;
+	bf->hdr.classification = CLASSIFICATION_SONG;
+	bf->hdr.class_info.song.content_type = CONTENT_TYPE_GUITAR;
+	bf->hdr.class_info.song.title = rnd_text(s->header_length);
+	bf->hdr.class_info.song.artist = rnd_text(s->header_length);
+	bf->hdr.class_info.song.release_info.pr_audio.album_title = rnd_text(s->header_length);
+	bf->hdr.class_info.song.release_info.pr_audio.year = 1950 + RND(60);
+	bf->hdr.class_info.song.music_by = rnd_text(s->header_length);
+	bf->hdr.class_info.song.words_by = rnd_text(s->header_length);
+	bf->hdr.class_info.song.copyright = rnd_text(s->header_length);
+	bf->hdr.class_info.song.lyrics = rnd_text(s->header_length * 16 > MAX_ITEMS?MAX_ITEMS:s->header_length * 16);
+	bf->hdr.guitar_notes = rnd_text(s->header_length);
+
+	for (i = 0; i < 2; i++) {
+		struct ptb_guitar *guitar = malloc_p(struct ptb_guitar, 1);
+
+		guitar->index = 0;
+		guitar->title = strdup(i?"Bass":"Guitar");
+		guitar->type = strdup("Synthetic");
+		guitar->nr_strings = sizeof(tuning);
+		guitar->strings = malloc(sizeof(tuning));
+		memcpy(guitar->strings, tuning, sizeof(tuning));
+		guitar->initial_volume = 104;
+		guitar->midi_instrument = 25;
+		bf->instrument[i].guitars = guitar;
+	}
+
+	for (i = 0; i < s->nr_chorddiagrams; i++) {
+		struct ptb_chorddiagram *chorddiagram = malloc_p(struct ptb_chorddiagram, 1);
+
+		chorddiagram->name.name[0] = chorddiagram->name.name[1] = RND(12);
+		chorddiagram->frets = RND(12);
+		chorddiagram->nr_strings = sizeof(tuning);
+		chorddiagram->tones = malloc(sizeof(tuning));
+		for (j = 0; j < (int)sizeof(tuning); j++)
+			chorddiagram->tones[j] = RND(5);
+		LINK(bf->instrument[0].chorddiagrams, last_chorddiagram, chorddiagram);
+	}
+
+	for (i = 0; i < s->nr_sections; i++) {
+		struct ptb_section *section = gen_section(s, i);
+		LINK(bf->instrument[0].sections, last_section, section);
+	}
+
+	bf->tablature_font.family = strdup("Courier New");
+	bf->chord_name_font.family = strdup("Arial");
+	bf->default_font.family = strdup("Times New Roman");
+	bf->staff_line_space = 8;
+
+	ret = ptb_write_file(output, bf);
+	ptb_free(bf);
+	return ret;
+}
+
+static int gen_gp(const struct settings *s, const char *output, double version)
+{
+	struct gpf *gpf = malloc_p(struct gpf, 1);
+	uint32_t i, j, k;
+	int l;
+
+	gpf->version = version;
+	gpf->version_string = version >= 4.0?"FICHIER GUITAR PRO v4.00":"FICHIER GUITAR PRO v3.00";
+	gpf->title = rnd_text(s->header_length);
+	gpf->subtitle = rnd_text(s->header_length);
+	gpf->artist = rnd_text(s->header_length);
+	gpf->album = rnd_text(s->header_length);
+	gpf->author = rnd_text(s->header_length);
+	gpf->copyright = rnd_text(s->header_length);
+	gpf->tab_by = rnd_text(s->header_length);
+	gpf->instruction = rnd_text(s->header_length);
+	gpf->bpm = 80 + RND(100);
+
+	gpf->num_tracks = s->nr_staffs;
+	gpf->tracks = malloc_p(struct gp_track, gpf->num_tracks);
+	for (i = 0; i < gpf->num_tracks; i++) {
+		gpf->tracks[i].name = "Guitar";
+		gpf->tracks[i].num_frets = 24;
+		gpf->tracks[i].num_strings = sizeof(tuning);
+		gpf->tracks[i].strings = malloc_p(struct gp_track_string, sizeof(tuning));
+		for (j = 0; j < sizeof(tuning); j++)
+			gpf->tracks[i].strings[j].pitch = tuning[j];
+		gpf->tracks[i].midi_port = 1;
+		gpf->tracks[i].channel1 = 1 + i % 16;
+		gpf->tracks[i].channel2 = 1 + i % 16;
+	}
+
+	gpf->num_bars = s->nr_sections;
+	gpf->bars = malloc_p(struct gp_bar, gpf->num_bars);
+	for (i = 0; i < gpf->num_bars; i++) {
+		struct gp_bar *bar = &gpf->bars[i];
+
+		bar->rhythm_1 = bar->rhythm_2 = 4;
+		if (i == 0) {
+			bar->properties |= GP_BAR_PROPERTY_MARKER;
+			bar->marker.name = rnd_text(s->header_length);
+		}
+
+		bar->tracks = malloc_p(struct gp_bar_track, gpf->num_tracks);
+		for (j = 0; j < gpf->num_tracks; j++) {
+			bar->tracks[j].num_beats = s->nr_positions;
+			bar->tracks[j].beats = malloc_p(struct gp_beat, s->nr_positions);
+			for (k = 0; k < bar->tracks[j].num_beats; k++) {
+				struct gp_beat *beat = &bar->tracks[j].beats[k];
+
+				beat->duration = RND(4);
+				if (!RND(8)) beat->properties |= GP_BEAT_PROPERTY_DOTTED;
+				if (k < (uint32_t)s->nr_chorddiagrams && k < 4) {
+					beat->properties |= GP_BEAT_PROPERTY_CHORD;
+					beat->chord.name = "C";
+					beat->chord.top_fret = 1 + RND(12);
+				}
+
+				beat->notes = malloc_p(struct gp_note, 7);
+				for (l = 0; l < s->nr_notes && l < 7 && l < (int)sizeof(tuning); l++) {
+					struct gp_note *n = &beat->notes[beat->num_notes++];
+					beat->strings_present |= 1 << l;
+					n->string = l;
+					n->properties = GP_NOTE_PROPERTY_ALTERATION;
+					n->alteration = 1;
+					n->value = RND(20);
+				}
+			}
+		}
+	}
+
+	return gp_write_file(output, gpf);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] output.ptb|output.gp4|output.gp3\n"
+		"  -s SEED    Seed (default: 1)\n"
+		"  -S N       Number of sections (GP: bars) (default: 10)\n"
+		"  -t N       Number of staffs per section (GP: tracks) (default: 2)\n"
+		"  -p N       Number of positions per staff (GP: beats) (default: 32)\n"
+		"  -n N       Number of notes per position (default: 3)\n"
+		"  -c N       Number of chord diagrams (default: 4)\n"
+		"  -H N       Length of header strings (default: 16)\n"
+		"  -N N       Number of files to generate, output then contains %%d (default: 1)\n",
+		prog);
+	exit(1);
+}
+
+static int clamp(const char *name, int n, int max)
+{
+	if (n < 0 || n > max) {
+		fprintf(stderr, "Number of %s must be between 0 and %d\n", name, max);
+		exit(1);
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	struct settings s = { 1, 10, 2, 32, 3, 4, 16 };
+	int c, i, nr_files = 1;
+
+	while ((c = getopt(argc, argv, "s:S:t:p:n:c:H:N:h")) != -1) {
+		switch (c) {
+		case 's': s.seed = strtoul(optarg, NULL, 0); break;
+		case 'S': s.nr_sections = clamp("sections", atoi(optarg), MAX_ITEMS); break;
+		case 't': s.nr_staffs = clamp("staffs", atoi(optarg), MAX_ITEMS); break;
+		case 'p': s.nr_positions = clamp("positions", atoi(optarg), MAX_ITEMS); break;
+		case 'n': s.nr_notes = clamp("notes", atoi(optarg), sizeof(tuning)); break;
+		case 'c': s.nr_chorddiagrams = clamp("chord diagrams", atoi(optarg), MAX_ITEMS); break;
+		case 'H': s.header_length = clamp("header characters", atoi(optarg), MAX_ITEMS); break;
+		case 'N': nr_files = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1) usage(argv[0]);
+
+	if (nr_files > 1 && !strstr(argv[optind], "%d")) {
+		fprintf(stderr, "Output file name should contain %%d when generating several files\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_files; i++) {
+		size_t len = strlen(argv[optind]) + 20;
+		char *output = malloc(len);
+		const char *ext;
+		int ret;
+
+		/* The name is not a format string, only its first %d is replaced */
+		if (nr_files > 1) {
+			const char *pos = strstr(argv[optind], "%d");
+			int n = pos - argv[optind];
+			snprintf(output, len, "%.*s%d%s", n, argv[optind], i, pos + 2);
+		} else {
+			strcpy(output, argv[optind]);
+		}
+		rnd_seed(s.seed + i);
+
+		ext = strrchr(output, '.');
+		if (ext && !strcmp(ext, ".gp4")) {
+			ret = gen_gp(&s, output, 4.0);
+		} else if (ext && !strcmp(ext, ".gp3")) {
+			ret = gen_gp(&s, output, 3.0);
+		} else {
+			ret = gen_ptb(&s, output);
+		}
+
+		if (ret < 0) {
+			perror(output);
+			return 1;
+		}
+		free(output);
+	}
+
+	return 0;
+}
@@ -97,6 +97,14 @@ SOURCE=..\gp.h
 # End Source File
 # Begin Source File
 
+SOURCE="..\ptb-arena.c"
+# End Source File
+# Begin Source File
+
+SOURCE="..\ptb-arena.h"
+# End Source File
+# Begin Source File
+
 SOURCE="..\ptb-tuning.c"
 # End Source File
 # Begin Source File
@@ -84,6 +84,10 @@ LINK32=link.exe
 # Name "ptb2ascii - Win32 Debug"
 # Begin Source File
 
+SOURCE=..\batch.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\ptb2ascii.c
 # End Source File
 # End Target
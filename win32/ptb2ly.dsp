@@ -83,6 +83,10 @@ LINK32=link.exe
 # Name "ptb2ly - Win32 Debug"
 # Begin Source File
 
+SOURCE=..\batch.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\ptb2ly.c
 # End Source File
 # End Target
@@ -83,6 +83,10 @@ LINK32=link.exe
 # Name "ptb2xml - Win32 Debug"
 # Begin Source File
 
+SOURCE=..\batch.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\ptb2xml.c
 # End Source File
 # End Target